@@ -0,0 +1,303 @@
+#ifndef ADMISSION_HPP
+#define ADMISSION_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "demux.hpp"
+#include "io.hpp"
+#include "stats.hpp"
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <utility>
+#include <vector>
+
+// Admission control of server. Connection requests wait in queue until
+// server takes them. Number of served and waiting sessions and bytes held by
+// waiting requests are capped: request over cap is rejected right after its
+// header is read, and one that waited longer than bounded wait is rejected
+// when it's taken, as its client gives up soon.
+namespace ADMISSION {
+using namespace PPCB;
+using clock = std::chrono::steady_clock;
+
+struct Limits {
+    // Sessions served and waiting in queue.
+    std::optional<size_t> max_sessions;
+    // Bytes held by requests waiting in queue.
+    std::optional<size_t> max_buffered;
+    // Client waits MAX_WAIT for answer, request taken later is rejected.
+    std::chrono::milliseconds max_wait{MAX_WAIT * 1000 / 2};
+};
+
+template <class T> class Queue {
+  private:
+    struct Request {
+        DEMUX::SessionKey _key;
+        T _value;
+        size_t _bytes;
+        clock::time_point _since;
+    };
+
+    Limits _limits;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Request> _requests;
+    size_t _served{0};
+    size_t _buffered{0};
+
+    void release() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _served--;
+    }
+
+  public:
+    // Request taken from queue, counted as served session until destroyed.
+    class Slot {
+      private:
+        Queue *_queue;
+
+      public:
+        T _value;
+        session_t _session_id;
+
+        Slot(Queue &queue, T value, session_t session_id)
+            : _queue(&queue), _value(std::move(value)),
+              _session_id(session_id) {}
+
+        Slot(Slot &&other)
+            : _queue(std::exchange(other._queue, nullptr)),
+              _value(std::move(other._value)),
+              _session_id(other._session_id) {}
+
+        Slot &operator=(Slot &&) = delete;
+
+        ~Slot() {
+            if (_queue) {
+                _queue->release();
+            }
+        }
+    };
+
+    explicit Queue(Limits limits = {}) : _limits(limits) {}
+
+    void configure(Limits limits) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _limits = limits;
+    }
+
+    // Queues request of given header and size, value is made only if it
+    // fits under caps (unless they don't apply to it). Repeated request,
+    // retransmitted by client, replaces waiting one. Only datagrams are
+    // retransmitted, connections of unnamed unix sockets or SHMOPEN share
+    // their key, so they're never replaced.
+    template <class Make>
+    bool offer(const IO::Address &addr, session_t session_id, size_t bytes,
+               Make make, bool capped = true) {
+        auto &stats = STATS::registry().admission();
+        DEMUX::SessionKey key(addr, session_id);
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (auto &request : _requests) {
+            if (T::RETRANSMITTED && request._key == key) {
+                _buffered = _buffered - request._bytes + bytes;
+                request._value = make();
+                request._bytes = bytes;
+                request._since = clock::now();
+                return true;
+            }
+        }
+        if (capped && _limits.max_sessions &&
+            _served + _requests.size() >= *_limits.max_sessions) {
+            stats.rejected_sessions();
+            return false;
+        }
+        if (capped && _limits.max_buffered &&
+            _buffered + bytes > *_limits.max_buffered) {
+            stats.rejected_bytes();
+            return false;
+        }
+        _requests.push_back({key, make(), bytes, clock::now()});
+        _buffered += bytes;
+        stats.admitted();
+        lock.unlock();
+        _cv.notify_one();
+        return true;
+    }
+
+    // Takes oldest request, waiting for one until deadline (if given).
+    // Requests that waited too long are passed to reject on the way.
+    template <class Reject>
+    std::optional<Slot> pop(std::optional<clock::time_point> deadline,
+                            Reject reject) {
+        std::vector<Request> expired;
+        std::optional<Slot> slot;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true) {
+                while (!_requests.empty() &&
+                       clock::now() - _requests.front()._since >
+                           _limits.max_wait) {
+                    _buffered -= _requests.front()._bytes;
+                    expired.push_back(std::move(_requests.front()));
+                    _requests.pop_front();
+                    STATS::registry().admission().expired();
+                }
+                if (!_requests.empty()) {
+                    Request &request = _requests.front();
+                    _buffered -= request._bytes;
+                    _served++;
+                    slot.emplace(*this, std::move(request._value),
+                                 request._key._session_id);
+                    _requests.pop_front();
+                    break;
+                }
+                if (!deadline) {
+                    _cv.wait(lock);
+                } else if (_cv.wait_until(lock, *deadline) ==
+                           std::cv_status::timeout) {
+                    break;
+                }
+            }
+        }
+        for (auto &request : expired) {
+            DBG_printer("request of session", request._key._session_id,
+                        "waited too long");
+            reject(request._value, request._key._session_id);
+        }
+        return slot;
+    }
+};
+
+// Connection request received over udp.
+struct Datagram {
+    static constexpr bool RETRANSMITTED = true;
+
+    IO::Address _addr;
+    std::vector<char> _data;
+};
+
+// Requests sent to server's udp socket while it serves session are queued
+// from inside of session, so queue is shared.
+Queue<Datagram> &datagrams() {
+    static Queue<Datagram> queue;
+    return queue;
+}
+
+// Accepted tcp connection, with request still waiting in it.
+struct Connection {
+    static constexpr bool RETRANSMITTED = false;
+
+    IO::Socket _socket;
+    IO::Address _addr;
+};
+
+// Rejects connection over caps or one that waited in queue for too long.
+void reject(Connection &connection, session_t session_id) {
+    try {
+        Packet<CONNRJT>(session_id)
+            .getSender(connection._socket, &connection._addr)
+            .send<IO::Socket::TCP>();
+    } catch (std::exception &e) {
+        // Client is gone already.
+    }
+}
+
+// Accepted connection whose request hasn't arrived yet.
+struct Unread {
+    Connection _connection;
+    clock::time_point _deadline;
+    // Part of header arrived, connection is peeked again after each poll
+    // instead of being polled for data it already has.
+    bool _partial{false};
+};
+
+// Queues request of connection, rejecting one over caps.
+void admit(Connection &connection, Queue<Connection> &queue,
+           const char *header) {
+    auto [id, session_id] = Header::decode(header);
+    int pending = 0;
+    ioctl((int)connection._socket, FIONREAD, &pending);
+
+    if (!queue.offer(
+            connection._addr, session_id, (size_t)pending,
+            [&]() { return connection; }, id != STRIPE)) {
+        DBG_printer("rejected connection of session", session_id);
+        reject(connection, session_id);
+    }
+}
+
+// Accepts connections to listening socket until stop is requested and
+// queues them. Connections wait for their request in poll set for at most
+// max_wait each, then only header of first packet is peeked and size of
+// what waits in connection checked, request over caps is rejected. Streams
+// joining striped group are left to group.
+void gatekeep(std::stop_token stop, IO::Socket &socket,
+              Queue<Connection> &queue, std::chrono::milliseconds max_wait) {
+    static constexpr auto STOP_CHECK = std::chrono::milliseconds(200);
+    std::vector<Unread> unread;
+    while (!stop.stop_requested()) {
+        auto wake = clock::now() + STOP_CHECK;
+        std::vector<pollfd> pfds{{(int)socket, POLLIN, 0}};
+        for (auto &entry : unread) {
+            pfds.push_back({(int)entry._connection._socket,
+                            (short)(entry._partial ? 0 : POLLIN), 0});
+            wake = std::min(wake, entry._deadline);
+        }
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(
+            wake - clock::now());
+        if (poll(pfds.data(), pfds.size(),
+                 (int)std::max<int64_t>(timeout.count(), 0)) < 0) {
+            continue;
+        }
+
+        auto now = clock::now();
+        std::vector<Unread> waiting;
+        for (size_t i = 0; i < unread.size(); i++) {
+            Unread &entry = unread[i];
+            if (pfds[i + 1].revents != 0 || entry._partial) {
+                char header[Header::SIZE];
+                ssize_t ret = recv((int)entry._connection._socket,
+                                   header, sizeof(header),
+                                   MSG_PEEK | MSG_DONTWAIT);
+                if (ret == (ssize_t)sizeof(header)) {
+                    admit(entry._connection, queue, header);
+                    continue;
+                }
+                if (ret == 0 || (ret < 0 && errno != EAGAIN &&
+                                 errno != EWOULDBLOCK && errno != EINTR)) {
+                    DBG_printer("connection closed before request");
+                    continue;
+                }
+                entry._partial = ret > 0;
+            }
+            if (now >= entry._deadline) {
+                DBG_printer("request didn't arrive in time");
+                continue;
+            }
+            waiting.push_back(std::move(entry));
+        }
+        unread = std::move(waiting);
+
+        if (pfds[0].revents & POLLIN) {
+            IO::Address addr;
+            int fd = socket.accept(addr);
+            if (fd >= 0) {
+                unread.push_back({{IO::Socket(fd), addr}, now + max_wait});
+            }
+        }
+    }
+}
+} // namespace ADMISSION
+
+#endif /* ADMISSION_HPP */
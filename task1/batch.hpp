@@ -0,0 +1,250 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interface.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Batch transfers: one session carries many files. Data of session starts
+// with manifest (u32 entry count, then u16 name length, name and u64 file
+// length of every entry, integers in network order) followed by contents
+// of all files in manifest order.
+namespace BATCHING {
+using namespace PPCB;
+
+constexpr uint32_t MAX_ENTRIES = 1 << 20;
+constexpr uint16_t MAX_NAME_LEN = 4096;
+// Bytes of manifest, which server holds in memory.
+constexpr size_t MAX_MANIFEST_LEN = 1 << 26;
+
+struct Entry {
+    std::string _name;
+    b_cnt_t _length;
+};
+
+// Names are relative paths that stay inside server directory.
+const std::string &checked_name(const std::string &name) {
+    std::filesystem::path path(name);
+    bool valid = !name.empty() && name.size() <= MAX_NAME_LEN &&
+                 name.find('\0') == std::string::npos && path.is_relative();
+    for (auto &part : path) {
+        if (part == "." || part == ".." || part.empty()) {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        throw std::runtime_error("Invalid batch entry name: " + name);
+    }
+    return name;
+}
+
+// Reads files listed one per line in input and builds data of session.
+std::vector<char> build(std::istream &list) {
+    std::vector<Entry> entries;
+    std::vector<std::vector<char>> contents;
+    std::string name;
+    while (std::getline(list, name)) {
+        if (name.empty()) {
+            continue;
+        }
+        std::ifstream file(name, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Couldn't open batch file: " + name);
+        }
+        std::vector<char> content((std::istreambuf_iterator<char>(file)),
+                                  std::istreambuf_iterator<char>());
+        entries.push_back({checked_name(name), content.size()});
+        contents.push_back(std::move(content));
+        if (entries.size() > MAX_ENTRIES) {
+            throw std::runtime_error("Too many files in batch");
+        }
+    }
+
+    std::vector<char> data;
+    auto append = [&](const void *ptr, size_t len) {
+        data.insert(data.end(), (const char *)ptr, (const char *)ptr + len);
+    };
+    size_t manifest_len = sizeof(uint32_t);
+    for (auto &entry : entries) {
+        manifest_len +=
+            sizeof(uint16_t) + entry._name.size() + sizeof(b_cnt_t);
+    }
+    if (manifest_len > MAX_MANIFEST_LEN) {
+        throw std::runtime_error("Batch manifest too long");
+    }
+
+    uint32_t cnt = to_net((uint32_t)entries.size());
+    append(&cnt, sizeof(cnt));
+    for (auto &entry : entries) {
+        uint16_t len = to_net((uint16_t)entry._name.size());
+        b_cnt_t length = to_net(entry._length);
+        append(&len, sizeof(len));
+        append(entry._name.data(), entry._name.size());
+        append(&length, sizeof(length));
+    }
+    for (auto &content : contents) {
+        append(content.data(), content.size());
+    }
+    DBG_printer("batch of", entries.size(), "files,", data.size(), "bytes");
+    return data;
+}
+
+// Parses manifest and writes each file of batch separately in directory.
+class BatchSink : public Sink {
+  private:
+    std::filesystem::path _dir;
+    // Bytes of manifest not parsed yet, parsed ones are erased after each
+    // write.
+    std::vector<char> _buffer;
+    size_t _pos{0};
+    size_t _parsed{0};
+    std::optional<uint32_t> _cnt;
+    std::vector<Entry> _entries;
+    bool _manifest_done{false};
+
+    size_t _current{0};
+    b_cnt_t _written{0};
+    int _fd{-1};
+
+    template <class T> T peek(size_t offset) const {
+        T var;
+        std::memcpy(&var, _buffer.data() + _pos + offset, sizeof(T));
+        return to_host(var);
+    }
+
+    size_t available() const { return _buffer.size() - _pos; }
+
+    // Parses as much of manifest as was received.
+    void parse_manifest() {
+        if (!_cnt && available() >= sizeof(uint32_t)) {
+            _cnt = peek<uint32_t>(0);
+            _pos += sizeof(uint32_t);
+            if (*_cnt > MAX_ENTRIES) {
+                throw std::runtime_error("Too many files in batch: " +
+                                         std::to_string(*_cnt));
+            }
+        }
+        while (_cnt && _entries.size() < *_cnt &&
+               available() >= sizeof(uint16_t)) {
+            uint16_t len = peek<uint16_t>(0);
+            if (available() < sizeof(uint16_t) + len + sizeof(b_cnt_t)) {
+                break;
+            }
+            std::string name(_buffer.data() + _pos + sizeof(uint16_t), len);
+            b_cnt_t length = peek<b_cnt_t>(sizeof(uint16_t) + len);
+            _entries.push_back({checked_name(name), length});
+            _pos += sizeof(uint16_t) + len + sizeof(b_cnt_t);
+        }
+        _manifest_done = _cnt && _entries.size() == *_cnt;
+    }
+
+    void close_file() {
+        if (_fd >= 0 && close(_fd) < 0) {
+            _fd = -1;
+            throw std::runtime_error(std::string("Couldn't close file: ") +
+                                     std::strerror(errno));
+        }
+        _fd = -1;
+    }
+
+    // Opens file receiving next bytes, creating empty files on the way.
+    void advance() {
+        while (_fd < 0 && _current < _entries.size()) {
+            auto path = _dir / _entries[_current]._name;
+            std::filesystem::create_directories(path.parent_path());
+            _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (_fd < 0) {
+                throw std::runtime_error("Couldn't open batch file " +
+                                         path.string() + ": " +
+                                         std::strerror(errno));
+            }
+            _written = 0;
+            if (_entries[_current]._length == 0) {
+                close_file();
+                _current++;
+            }
+        }
+    }
+
+    void write_files(const char *data, size_t len) {
+        while (len > 0) {
+            advance();
+            if (_fd < 0) {
+                throw std::runtime_error("Batch has more data than manifest");
+            }
+            size_t part = std::min<b_cnt_t>(
+                len, _entries[_current]._length - _written);
+            ssize_t ret = ::write(_fd, data, part);
+            if (ret < 0) {
+                throw std::runtime_error(
+                    std::string("Couldn't write batch file: ") +
+                    std::strerror(errno));
+            }
+            data += ret;
+            len -= ret;
+            _written += ret;
+            if (_written == _entries[_current]._length) {
+                close_file();
+                _current++;
+            }
+        }
+    }
+
+  public:
+    explicit BatchSink(const std::string &dir) : _dir(dir) {}
+
+    BatchSink(const BatchSink &) = delete;
+    BatchSink &operator=(const BatchSink &) = delete;
+
+    void write(const char *data, size_t len) {
+        if (_manifest_done) {
+            write_files(data, len);
+            return;
+        }
+
+        _buffer.insert(_buffer.end(), data, data + len);
+        parse_manifest();
+        _parsed += _pos;
+        _buffer.erase(_buffer.begin(), _buffer.begin() + (ptrdiff_t)_pos);
+        _pos = 0;
+        if (_manifest_done) {
+            DBG_printer("batch manifest of", _entries.size(), "files");
+            std::vector<char> rest = std::move(_buffer);
+            _buffer = {};
+            write_files(rest.data(), rest.size());
+        } else if (_parsed + _buffer.size() > MAX_MANIFEST_LEN) {
+            throw std::runtime_error("Batch manifest too long");
+        }
+    }
+
+    void finish() {
+        if (_manifest_done) {
+            advance();
+        }
+        if (!_manifest_done || _current != _entries.size()) {
+            throw std::runtime_error("Batch incomplete: " +
+                                     std::to_string(_current) + "/" +
+                                     std::to_string(_entries.size()) +
+                                     " files");
+        }
+    }
+
+    ~BatchSink() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+};
+} // namespace BATCHING
+
+#endif /* BATCH_HPP */
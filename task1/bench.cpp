@@ -0,0 +1,386 @@
+#include "io.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Loopback benchmark of ppcbs/ppcbc: runs transfer for every combination of
+// protocol, packet size, file size and loss rate and prints results as JSON.
+// Lossy runs go through ppcbp, so only protocols that recover from loss
+// (udpr and its windowed variants) are run with loss above 0. Busy poll
+// times above 0 run both programs in low-latency mode, ACK latency
+// percentiles come from client's RTT histogram.
+
+using clock_type = std::chrono::steady_clock;
+
+struct BenchOptions {
+    // tcp, udp, udpr or udpr-<controller> for windowed udpr.
+    std::vector<std::string> protocols{"tcp", "udp", "udpr", "udpr-aimd"};
+    std::vector<size_t> packet_sizes{1'400, 8'000};
+    std::vector<size_t> file_sizes{256 * 1024, 4 * 1024 * 1024};
+    std::vector<double> losses{0, 0.001};
+    // Microseconds, 0 is default (blocking) mode.
+    std::vector<size_t> busy_polls{0};
+    uint64_t seed{1};
+    std::chrono::seconds timeout{120};
+    uint16_t port{20'000};
+};
+
+struct Case {
+    std::string _protocol;
+    size_t _packet_size;
+    size_t _file_size;
+    double _loss;
+    size_t _busy_poll;
+};
+
+struct Result {
+    bool _completed{false};
+    double _seconds{0};
+    std::optional<double> _ttfb;
+    std::optional<uint64_t> _retransmits;
+    std::optional<uint64_t> _ack_p50;
+    std::optional<uint64_t> _ack_p99;
+    double _client_cpu{0};
+    double _server_cpu{0};
+};
+
+std::vector<std::string> split_list(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+BenchOptions read_options(int argc, char *argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string option(argv[i]);
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value of option: " + option);
+        }
+        std::string value(argv[++i]);
+        if (option == "--protocols") {
+            options.protocols = split_list(value);
+        } else if (option == "--packet-sizes") {
+            options.packet_sizes.clear();
+            for (auto &item : split_list(value)) {
+                options.packet_sizes.push_back(IO::read_size(item.c_str()));
+            }
+        } else if (option == "--file-sizes") {
+            options.file_sizes.clear();
+            for (auto &item : split_list(value)) {
+                options.file_sizes.push_back(IO::read_size(item.c_str()));
+            }
+        } else if (option == "--loss") {
+            options.losses.clear();
+            for (auto &item : split_list(value)) {
+                options.losses.push_back(std::stod(item));
+            }
+        } else if (option == "--busy-poll") {
+            options.busy_polls.clear();
+            for (auto &item : split_list(value)) {
+                options.busy_polls.push_back(IO::read_size(item.c_str()));
+            }
+        } else if (option == "--seed") {
+            options.seed = IO::read_size(value.c_str());
+        } else if (option == "--timeout") {
+            options.timeout =
+                std::chrono::seconds(IO::read_size(value.c_str()));
+        } else if (option == "--port") {
+            options.port = IO::read_port(value.c_str());
+        } else {
+            throw std::runtime_error("Unknown option: " + option);
+        }
+    }
+    return options;
+}
+
+// Starts program with given standard descriptors.
+pid_t spawn(const std::vector<std::string> &args, int in, int out, int err) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork failed: ") +
+                                 std::strerror(errno));
+    }
+    if (pid == 0) {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        std::vector<char *> argv;
+        for (auto &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+double cpu_seconds(const rusage &usage) {
+    return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double stop(pid_t pid, int sig) {
+    rusage usage{};
+    kill(pid, sig);
+    wait4(pid, nullptr, 0, &usage);
+    return cpu_seconds(usage);
+}
+
+// Temporary file, removed when closed.
+int temporary_file() {
+    char name[] = "/tmp/ppcbbXXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Couldn't create file: ") +
+                                 std::strerror(errno));
+    }
+    unlink(name);
+    return fd;
+}
+
+std::string read_all(int fd) {
+    std::string content;
+    char buffer[4096];
+    ssize_t ret;
+    lseek(fd, 0, SEEK_SET);
+    while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
+        content.append(buffer, (size_t)ret);
+    }
+    return content;
+}
+
+// Value of key=<number> following prefix in text.
+std::optional<uint64_t> find_counter(const std::string &text,
+                                     const std::string &prefix,
+                                     const std::string &key) {
+    size_t pos = text.find(prefix);
+    if (pos == std::string::npos) {
+        return std::nullopt;
+    }
+    pos = text.find(key + "=", pos);
+    if (pos == std::string::npos) {
+        return std::nullopt;
+    }
+    return std::stoull(text.substr(pos + key.size() + 1));
+}
+
+Result run(const Case &c, const BenchOptions &options,
+           const std::vector<char> &data, int input, uint16_t port) {
+    bool tcp = c._protocol == "tcp";
+    std::string protocol = c._protocol.substr(0, c._protocol.find('-'));
+    bool proxied = c._loss > 0;
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        throw std::runtime_error(std::string("pipe failed: ") +
+                                 std::strerror(errno));
+    }
+
+    std::vector<std::string> server_args{"./ppcbs", tcp ? "tcp" : "udp",
+                                         std::to_string(port)};
+    if (c._busy_poll) {
+        server_args.push_back("--busy-poll");
+        server_args.push_back(std::to_string(c._busy_poll));
+    }
+    int server_log = temporary_file();
+    pid_t server = spawn(server_args, null, pipefd[1], server_log);
+    close(pipefd[1]);
+
+    uint16_t target = port;
+    pid_t proxy = -1;
+    if (proxied) {
+        target = (uint16_t)(port + 1);
+        std::ostringstream loss;
+        loss << c._loss;
+        proxy = spawn({"./ppcbp", std::to_string(target), "127.0.0.1",
+                       std::to_string(port), "--loss", loss.str(), "--seed",
+                       std::to_string(options.seed)},
+                      null, null, null);
+    }
+    // Servers and proxy need a moment to bind their sockets.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::vector<std::string> args{"./ppcbc",
+                                  protocol,
+                                  "127.0.0.1",
+                                  std::to_string(target),
+                                  "--packet-size",
+                                  std::to_string(c._packet_size)};
+    if (protocol != c._protocol) {
+        args.push_back("--cc");
+        args.push_back(c._protocol.substr(protocol.size() + 1));
+    }
+    if (c._busy_poll) {
+        args.push_back("--busy-poll");
+        args.push_back(std::to_string(c._busy_poll));
+    }
+    int client_log = temporary_file();
+    lseek(input, 0, SEEK_SET);
+    auto begin = clock_type::now();
+    pid_t client = spawn(args, input, null, client_log);
+
+    Result result;
+    size_t received = 0;
+    bool corrupted = false;
+    std::optional<clock_type::time_point> end;
+    std::vector<char> buffer(1 << 16);
+    while (true) {
+        pollfd pfd{pipefd[0], POLLIN, 0};
+        int ret = poll(&pfd, 1, end ? 100 : 10);
+        if (ret > 0) {
+            ssize_t len = read(pipefd[0], buffer.data(), buffer.size());
+            if (len <= 0) {
+                break;
+            }
+            if (!result._ttfb) {
+                result._ttfb = std::chrono::duration<double, std::milli>(
+                                   clock_type::now() - begin)
+                                   .count();
+            }
+            size_t cnt = std::min((size_t)len, data.size() - received);
+            corrupted |= cnt < (size_t)len ||
+                         std::memcmp(buffer.data(), data.data() + received,
+                                     cnt) != 0;
+            received += cnt;
+        } else if (end) {
+            // Client finished and server has nothing more to write.
+            break;
+        }
+
+        rusage usage{};
+        if (!end && wait4(client, nullptr, WNOHANG, &usage) == client) {
+            end = clock_type::now();
+            result._client_cpu = cpu_seconds(usage);
+        } else if (!end && clock_type::now() - begin > options.timeout) {
+            kill(client, SIGKILL);
+        }
+    }
+
+    if (!end) {
+        // Server exited before client, e.g. when port was still taken.
+        stop(client, SIGKILL);
+        if (proxied) {
+            stop(proxy, SIGKILL);
+        }
+        throw std::runtime_error("Server exited: " + read_all(server_log));
+    }
+    result._seconds = std::chrono::duration<double>(*end - begin).count();
+    result._server_cpu = stop(server, SIGTERM);
+    close(pipefd[0]);
+    close(server_log);
+    close(null);
+    result._completed = received == data.size() && !corrupted;
+
+    std::string client_stats = read_all(client_log);
+    close(client_log);
+    if (proxied) {
+        stop(proxy, SIGTERM);
+    }
+    // Client prints stats of its session on exit.
+    result._retransmits = find_counter(client_stats, "session:", "retransmits");
+    result._ack_p50 = find_counter(client_stats, "session:", "rtt_p50_us");
+    result._ack_p99 = find_counter(client_stats, "session:", "rtt_p99_us");
+    return result;
+}
+
+void print(std::ostream &os, const Case &c, const Result &r) {
+    auto optional = [&](const auto &value) {
+        std::ostringstream s;
+        if (value) {
+            s << *value;
+        } else {
+            s << "null";
+        }
+        return s.str();
+    };
+    double gb = (double)c._file_size / 1e9;
+    os << "    {\"protocol\": \"" << c._protocol
+       << "\", \"packet_size\": " << c._packet_size
+       << ", \"file_size\": " << c._file_size << ", \"loss\": " << c._loss
+       << ", \"busy_poll_us\": " << c._busy_poll
+       << ", \"completed\": " << (r._completed ? "true" : "false")
+       << ", \"seconds\": " << r._seconds << ", \"mb_per_s\": "
+       << (r._completed ? (double)c._file_size / 1e6 / r._seconds : 0)
+       << ", \"ttfb_ms\": " << optional(r._ttfb)
+       << ", \"retransmits\": " << optional(r._retransmits)
+       << ", \"ack_p50_us\": " << optional(r._ack_p50)
+       << ", \"ack_p99_us\": " << optional(r._ack_p99)
+       << ", \"client_cpu_s\": " << r._client_cpu
+       << ", \"server_cpu_s\": " << r._server_cpu << ", \"cpu_s_per_gb\": "
+       << (r._client_cpu + r._server_cpu) / gb << "}";
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        signal(SIGPIPE, SIG_IGN);
+        BenchOptions options = read_options(argc, argv);
+
+        std::vector<Case> cases;
+        for (auto &protocol : options.protocols) {
+            for (double loss : options.losses) {
+                if (loss > 0 && protocol.rfind("udpr", 0) != 0) {
+                    continue;
+                }
+                for (size_t file_size : options.file_sizes) {
+                    for (size_t packet_size : options.packet_sizes) {
+                        for (size_t busy_poll : options.busy_polls) {
+                            cases.push_back({protocol, packet_size, file_size,
+                                             loss, busy_poll});
+                        }
+                    }
+                }
+            }
+        }
+
+        std::cout << "{\n  \"seed\": " << options.seed << ",\n  \"runs\": [";
+        std::mt19937_64 rng(options.seed);
+        uint16_t port = options.port;
+        for (size_t i = 0; i < cases.size(); i++) {
+            auto &c = cases[i];
+            std::vector<char> data(c._file_size);
+            for (auto &byte : data) {
+                byte = (char)rng();
+            }
+            int input = temporary_file();
+            if (write(input, data.data(), data.size()) !=
+                (ssize_t)data.size()) {
+                throw std::runtime_error("Couldn't write input file");
+            }
+
+            std::cerr << "bench: " << c._protocol << " packet=" << c._packet_size
+                      << " file=" << c._file_size << " loss=" << c._loss
+                      << " busy_poll=" << c._busy_poll << "\n";
+            Result result = run(c, options, data, input, port);
+            close(input);
+            // Fresh ports, so that runs don't meet packets of earlier ones.
+            port = (uint16_t)(port + 2);
+
+            std::cout << (i ? ",\n" : "\n");
+            print(std::cout, c, result);
+            std::cout << std::flush;
+        }
+        std::cout << "\n  ]\n}\n";
+    } catch (std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}
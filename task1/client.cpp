@@ -1,37 +1,33 @@
+#include "batch.hpp"
 #include "common.hpp"
+#include "congestion.hpp"
 #include "debug.hpp"
+#include "delta.hpp"
 #include "interface.hpp"
 #include "io.hpp"
+#include "multicast.hpp"
+#include "readahead.hpp"
+#include "shm.hpp"
+#include "stats.hpp"
+#include "stripe.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include <signal.h>
 
 using namespace PPCB;
 using namespace DEBUG_NS;
 
+// Sends all data packets of file, first of them numbered packet_number,
+// and waits for RCVD.
 template <protocol_t P>
-void client_handler(Session<P> &session, int64_t session_id, File &file) {
-    DBG_printer("Sending file of size: ", file.get_size());
-
-    session.send(
-        std::make_unique<Packet<CONN>>(session_id, P, file.get_size()));
-
-    auto [reader, id] = session.get_next();
-
-    if (id == CONNRJT) {
-        return;
-    }
-
-    if (id != CONNACC) {
-        throw unexpected_packet(CONNACC, std::nullopt, id, std::nullopt);
-    }
-
-    Packet<CONNACC> connacc(*reader);
-
-    p_cnt_t packet_number = 0;
+void send_file(Session<P> &session, File &file, p_cnt_t packet_number = 0) {
     while (file.get_size() != 0) {
         // Included retransmit part to avoid copy pasting code.
         session.send(std::make_unique<Packet<DATA>>(file.get_next_packet()));
@@ -39,7 +35,8 @@ void client_handler(Session<P> &session, int64_t session_id, File &file) {
 
         if constexpr (retransmits<P>()) {
             auto [reader_2, id_2] =
-                session.template get_next<CONNACC, ACC>(0, packet_number - 1);
+                session.template get_next<CONNACC, RESUMEACC, ACC>(
+                    0, 0, packet_number - 1);
             if (id_2 == ACC) {
                 Packet<ACC> acc(*reader_2);
                 if (acc._packet_number != packet_number - 1) {
@@ -60,8 +57,8 @@ void client_handler(Session<P> &session, int64_t session_id, File &file) {
         }
     }
 
-    auto [reader_2, id_2] =
-        session.template get_next<CONNACC, ACC>(0, packet_number);
+    auto [reader_2, id_2] = session.template get_next<CONNACC, RESUMEACC, ACC>(
+        0, 0, packet_number);
 
     if (id_2 == RCVD) {
         return;
@@ -69,59 +66,529 @@ void client_handler(Session<P> &session, int64_t session_id, File &file) {
         Packet<RJT> rjt(*reader_2);
         throw rejected_data(rjt._packet_number);
     } else {
-        throw unexpected_packet(RCVD, std::nullopt, id, std::nullopt);
+        throw unexpected_packet(RCVD, std::nullopt, id_2, std::nullopt);
     }
 }
 
-int main(int argc, char *argv[]) {
-    try {
-        signal(SIGPIPE, SIG_IGN);
+// Sends file with window set by congestion controller if one was chosen,
+// otherwise waiting for ACC of every packet.
+template <protocol_t P>
+void send_data(Session<P> &session, File &file,
+               const CONGESTION::Options &congestion,
+               p_cnt_t packet_number = 0) {
+    if constexpr (retransmits<P>()) {
+        if (congestion.controller) {
+            CONGESTION::WindowedSender sender(session.socket(),
+                                              session.address(), session.id(),
+                                              congestion, session.stats());
+            sender.run(file, packet_number);
+            sender.print_stats(std::cerr);
+            return;
+        }
+    }
+    send_file(session, file, packet_number);
+}
+
+// Sends connection request and whole file if server accepts it.
+// Returns false if server rejected connection.
+template <protocol_t P>
+bool client_handler(Session<P> &session, std::unique_ptr<PacketBase> hello,
+                    File &file, const CONGESTION::Options &congestion) {
+    DBG_printer("Sending file of size: ", file.get_size());
+
+    session.send(std::move(hello));
+
+    auto [reader, id] = session.get_next();
+
+    if (id == CONNRJT) {
+        return false;
+    }
+
+    if (id != CONNACC) {
+        throw unexpected_packet(CONNACC, std::nullopt, id, std::nullopt);
+    }
 
-        if (argc != 4) {
-            throw std::runtime_error("Usage: <protocol> <ip> <port>");
+    Packet<CONNACC> connacc(*reader);
+
+    send_data(session, file, congestion);
+    return true;
+}
+
+// Sends first packet of file in connection request. Without retransmissions
+// rest of file is sent right away, with them after ACC of first packet, which
+// also confirms session. Returns false if server rejected connection.
+template <protocol_t P>
+bool early_client_handler(Session<P> &session, File &file,
+                          const CONGESTION::Options &congestion) {
+    b_cnt_t size = file.get_size();
+    DBG_printer("Sending file of size: ", size, "in 0-RTT session");
+
+    session.send(std::make_unique<Packet<CONNDATA>>(session.id(), P, size,
+                                                    file.get_next_packet()));
+
+    if constexpr (retransmits<P>()) {
+        auto [reader, id] = session.template get_next<CONNACC>(0);
+        if (id == CONNRJT) {
+            return false;
+        }
+        if (id == RJT) {
+            throw rejected_data(Packet<RJT>(*reader)._packet_number);
+        }
+        if (id != ACC) {
+            throw unexpected_packet(ACC, 0, id, std::nullopt);
+        }
+        Packet<ACC> acc(*reader);
+        if (acc._packet_number != 0) {
+            throw unexpected_packet(ACC, 0, ACC, acc._packet_number);
+        }
+        send_data(session, file, congestion, 1);
+    } else {
+        p_cnt_t packet_number = 1;
+        while (file.get_size() != 0) {
+            session.send(
+                std::make_unique<Packet<DATA>>(file.get_next_packet()));
+            packet_number++;
         }
 
-        std::string s_protocol(argv[1]);
-        uint16_t port = IO::read_port(argv[3]);
+        auto [reader, id] = session.get_next();
+        if (id == CONNRJT) {
+            return false;
+        }
+        if (id != CONNACC) {
+            throw unexpected_packet(CONNACC, std::nullopt, id, std::nullopt);
+        }
+        // Nothing is left to send, only RCVD is awaited.
+        send_file(session, file, packet_number);
+    }
+    return true;
+}
 
-        sockaddr_in server_address = IO::get_server_address(argv[2], port);
+// Continues transfer of input named name from offset server already has.
+template <protocol_t P>
+void resume_handler(Session<P> &session, int64_t session_id,
+                    const std::string &name, const std::vector<char> &input,
+                    const CONGESTION::Options &congestion,
+                    b_cnt_t packet_size) {
+    session.send(std::make_unique<Packet<RESUME>>(session_id, P, input.size(),
+                                                  name));
 
-        session_t session_id = session_id_generate();
+    auto [reader, id] = session.get_next();
 
-        File file(session_id);
+    if (id == CONNRJT) {
+        throw std::runtime_error("Server rejected resumable transfer");
+    }
 
-        std::optional<Packet<CONN>> conn;
+    if (id != RESUMEACC) {
+        throw unexpected_packet(RESUMEACC, std::nullopt, id, std::nullopt);
+    }
 
-        if (s_protocol == "tcp") {
-            IO::Socket socket(IO::Socket::TCP);
-            DBG_printer("Connecting...");
+    Packet<RESUMEACC> resumeacc(*reader);
+    if (resumeacc._offset > input.size()) {
+        throw std::runtime_error("Server has more bytes than input: " +
+                                 std::to_string(resumeacc._offset));
+    }
 
-            if (connect((int)socket, (sockaddr *)&server_address,
-                        (socklen_t)sizeof(server_address)) < 0) {
-                throw std::runtime_error("Cannot connect to the server");
+    DBG_printer("Resuming from offset: ", resumeacc._offset);
+
+    File file(session_id,
+              std::vector<char>(input.begin() + resumeacc._offset, input.end()),
+              packet_size);
+    send_data(session, file, congestion);
+}
+
+struct ClientOptions {
+    bool delta{false};
+    std::optional<std::string> resume;
+    uint32_t streams{1};
+    // First data packet is carried by connection request.
+    bool early{false};
+    // Stdin lists files sent in one batch session.
+    bool batch{false};
+    stripe_layout_t layout{strided};
+    // Bytes of data carried by one DATA packet.
+    uint32_t packet_size{OPTIMAL_DATA_SIZE};
+    // Low-latency mode: receiving spins that long before blocking.
+    std::chrono::microseconds busy_poll{0};
+    std::optional<size_t> cpu;
+    // Packets go through shared memory rings (tcp over unix socket only).
+    bool shm{false};
+    // Input of that many bytes is generated instead of read from stdin.
+    std::optional<b_cnt_t> gen_bytes;
+    // Packets read ahead of sending when stdin is regular file, 0 reads
+    // whole input before connecting.
+    size_t read_ahead{1024};
+    MULTICAST::MulticastOptions multicast;
+    CONGESTION::Options congestion;
+};
+
+ClientOptions read_options(int argc, char *argv[], int first) {
+    ClientOptions options;
+    for (int i = first; i < argc; i++) {
+        std::string option(argv[i]);
+        if (option == "--delta") {
+            options.delta = true;
+        } else if (option == "--0rtt") {
+            options.early = true;
+        } else if (option == "--batch") {
+            options.batch = true;
+        } else if (option == "--resume" && i + 1 < argc) {
+            options.resume = argv[++i];
+        } else if (option == "--streams" && i + 1 < argc) {
+            size_t streams = IO::read_size(argv[++i]);
+            if (streams == 0 || streams > STRIPING::MAX_STREAMS) {
+                throw std::runtime_error(
+                    "Number of streams has to be in range [1, " +
+                    std::to_string(STRIPING::MAX_STREAMS) + "]");
+            }
+            options.streams = (uint32_t)streams;
+        } else if (option == "--stripe" && i + 1 < argc) {
+            std::string layout(argv[++i]);
+            if (layout == "contiguous") {
+                options.layout = contiguous;
+            } else if (layout == "strided") {
+                options.layout = strided;
+            } else {
+                throw std::runtime_error("Unknown stripe layout: " + layout);
+            }
+        } else if (option == "--packet-size" && i + 1 < argc) {
+            size_t packet_size = IO::read_size(argv[++i]);
+            if (packet_size == 0 || packet_size > MAX_DATA_SIZE) {
+                throw std::runtime_error(
+                    "Packet size must be between 1 and " +
+                    std::to_string(MAX_DATA_SIZE));
+            }
+            options.packet_size = (uint32_t)packet_size;
+        } else if (option == "--busy-poll" && i + 1 < argc) {
+            options.busy_poll = IO::read_busy_poll(argv[++i]);
+        } else if (option == "--gen-bytes" && i + 1 < argc) {
+            options.gen_bytes = IO::read_size(argv[++i]);
+        } else if (option == "--read-ahead" && i + 1 < argc) {
+            options.read_ahead = IO::read_size(argv[++i]);
+        } else if (option == "--shm") {
+            options.shm = true;
+        } else if (option == "--cpu" && i + 1 < argc) {
+            options.cpu = IO::read_size(argv[++i]);
+        } else if (option == "--cc" && i + 1 < argc) {
+            options.congestion.controller = argv[++i];
+            CONGESTION::make_controller(*options.congestion.controller);
+        } else if (option == "--pacing" && i + 1 < argc) {
+            options.congestion.pacing = CONGESTION::read_pacing(argv[++i]);
+        } else if (option == "--receivers" && i + 1 < argc) {
+            options.multicast.receivers = IO::read_size(argv[++i]);
+        } else if (option == "--iface" && i + 1 < argc) {
+            options.multicast.iface = MULTICAST::read_ip(argv[++i]);
+        } else if (option == "--ttl" && i + 1 < argc) {
+            size_t ttl = IO::read_size(argv[++i]);
+            if (ttl > UINT8_MAX) {
+                throw std::runtime_error("TTL has to be at most 255");
             }
+            options.multicast.ttl = (int)ttl;
+        } else {
+            throw std::runtime_error("Unknown option: " + option);
+        }
+    }
 
-            Session<tcp> session(socket, server_address, session_id, false);
+    if ((options.delta ? 1 : 0) + (options.resume ? 1 : 0) +
+            (options.streams > 1 ? 1 : 0) >
+        1) {
+        throw std::runtime_error(
+            "--delta, --resume and --streams can't be combined");
+    }
+    if (options.batch && (options.delta || options.resume ||
+                          options.streams > 1 || options.early)) {
+        throw std::runtime_error("--batch can't be combined with other modes");
+    }
+    if (options.early && (options.resume || options.streams > 1)) {
+        throw std::runtime_error(
+            "--0rtt can't be combined with --resume and --streams");
+    }
+    if (options.gen_bytes && (options.batch || options.delta ||
+                              options.resume || options.streams > 1)) {
+        throw std::runtime_error(
+            "--gen-bytes can't be combined with --batch, --delta, --resume "
+            "and --streams");
+    }
+    if (options.shm && options.streams > 1) {
+        throw std::runtime_error("--shm can't be combined with --streams");
+    }
+    return options;
+}
 
-            client_handler(session, session_id, file);
-        } else if (s_protocol == "udp") {
-            IO::Socket socket(IO::Socket::UDP);
-            DBG_printer("Connecting...");
+template <protocol_t P>
+IO::Socket open_socket(IO::Address server_address,
+                       const ClientOptions &options) {
+    if constexpr (uses_tcp<P>()) {
+        IO::Socket socket(IO::Socket::TCP, server_address.family());
+        socket.setBusyPoll(options.busy_poll);
+        DBG_printer("Connecting...");
 
-            Session<udp> session(socket, server_address, session_id, false);
+        if (connect((int)socket, server_address.get(), server_address.size()) <
+            0) {
+            throw std::runtime_error("Cannot connect to the server");
+        }
+        if (options.shm) {
+            SHM::connect(socket);
+        }
+        return socket;
+    } else {
+        IO::Socket socket(IO::Socket::UDP, server_address.family());
+        if (server_address.family() == AF_UNIX) {
+            socket.autobind();
+            // Server waits when client's queue is full of ACCs, so windowed
+            // sender drops DATA instead and retransmits it later.
+            if (retransmits<P>()) {
+                socket.dropWhenFull();
+            }
+        }
+        // Session sockets of client are used by one thread, so sent datagrams
+        // can be matched with their TX timestamps (IPv4 only).
+        socket.enableTimestamps(server_address.family() == AF_INET);
+        socket.setBusyPoll(options.busy_poll);
+        DBG_printer("Connecting...");
+        return socket;
+    }
+}
 
-            client_handler(session, session_id, file);
-        } else if (s_protocol == "udpr") {
-            IO::Socket socket(IO::Socket::UDP);
-            DBG_printer("Connecting...");
+// Sends input split between options.streams parallel sessions, reporting
+// progress of each stream on stderr.
+template <protocol_t P>
+void run_striped(IO::Address server_address, const ClientOptions &options,
+                 const std::vector<char> &input) {
+    using clock = std::chrono::steady_clock;
+    static constexpr auto REPORT_INTERVAL = std::chrono::seconds(1);
+
+    uint32_t cnt = options.streams;
+    auto parts =
+        STRIPING::split(input, cnt, options.layout, options.packet_size);
+    session_t group_id = session_id_generate();
+
+    std::vector<session_t> session_ids;
+    std::vector<std::unique_ptr<File>> files;
+    for (uint32_t i = 0; i < cnt; i++) {
+        session_ids.push_back(session_id_generate());
+        files.push_back(std::make_unique<File>(session_ids[i], parts[i],
+                                               options.packet_size));
+    }
+
+    auto begin = clock::now();
+    std::vector<std::exception_ptr> errors(cnt);
+    std::vector<clock::duration> durations(cnt);
+    std::atomic<uint32_t> finished{0};
+    {
+        std::vector<std::jthread> streams;
+        for (uint32_t i = 0; i < cnt; i++) {
+            streams.emplace_back([&, i]() {
+                try {
+                    IO::Socket socket =
+                        open_socket<P>(server_address, options);
+                    Session<P> session(socket, server_address, session_ids[i],
+                                       false);
+                    auto hello = std::make_unique<Packet<STRIPE>>(
+                        session_ids[i], P, parts[i].size(), group_id, i, cnt,
+                        options.layout, options.packet_size, input.size());
+                    if (!client_handler(session, std::move(hello), *files[i],
+                                        options.congestion)) {
+                        throw std::runtime_error("Stream " +
+                                                 std::to_string(i) +
+                                                 " rejected");
+                    }
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+                durations[i] = clock::now() - begin;
+                finished++;
+            });
+        }
+
+        auto next_report = begin + REPORT_INTERVAL;
+        while (finished < cnt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (clock::now() < next_report) {
+                continue;
+            }
+            next_report += REPORT_INTERVAL;
+            for (uint32_t i = 0; i < cnt; i++) {
+                std::cerr << "stream " << i << ": "
+                          << parts[i].size() - files[i]->get_size() << "/"
+                          << parts[i].size() << " bytes\n";
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < cnt; i++) {
+        double seconds = std::chrono::duration<double>(durations[i]).count();
+        std::cerr << "stream " << i << ": " << (errors[i] ? "failed" : "done")
+                  << ", " << parts[i].size() << " bytes in " << seconds
+                  << " s\n";
+    }
+
+    for (auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+// Sends input once to multicast group.
+void run_multicast(IO::Address group_address, const ClientOptions &options) {
+    std::vector<char> input = read_input();
+    IO::Socket socket(IO::Socket::UDP);
+    MULTICAST::Sender sender(socket, group_address, session_id_generate(),
+                             input, options.multicast);
+
+    size_t receivers = sender.run();
+    DBG_printer("receivers that confirmed data:", receivers);
+    if (options.multicast.receivers && receivers < *options.multicast.receivers) {
+        throw std::runtime_error("Only " + std::to_string(receivers) + "/" +
+                                 std::to_string(*options.multicast.receivers) +
+                                 " receivers confirmed data");
+    }
+}
+
+// Sends files listed on stdin in one session.
+template <protocol_t P>
+void run_batch(IO::Address server_address, const ClientOptions &options) {
+    session_t session_id = session_id_generate();
+    File file(session_id, BATCHING::build(std::cin), options.packet_size);
+    IO::Socket socket = open_socket<P>(server_address, options);
+    Session<P> session(socket, server_address, session_id, false);
+
+    if (!client_handler(session,
+                        std::make_unique<Packet<BATCH>>(session_id, P,
+                                                        file.get_size()),
+                        file, options.congestion)) {
+        throw std::runtime_error("Server rejected batch");
+    }
+}
+
+// Sends file in session opened by CONN, or CONNDATA in 0-RTT mode.
+template <protocol_t P>
+void send_session(Session<P> &session, File &file,
+                  const ClientOptions &options) {
+    if (options.early && file.get_size() != 0) {
+        early_client_handler(session, file, options.congestion);
+    } else {
+        client_handler(session,
+                       std::make_unique<Packet<CONN>>(session.id(), P,
+                                                      file.get_size()),
+                       file, options.congestion);
+    }
+}
+
+template <protocol_t P>
+void run_client(IO::Address server_address, const ClientOptions &options) {
+    if (options.congestion.controller && !retransmits<P>()) {
+        throw std::runtime_error("--cc requires udpr protocol");
+    }
+
+    if (options.batch) {
+        run_batch<P>(server_address, options);
+        return;
+    }
+
+    if (options.gen_bytes) {
+        session_t session_id = session_id_generate();
+        IO::Socket socket = open_socket<P>(server_address, options);
+        Session<P> session(socket, server_address, session_id, false);
+        File file(session_id, *options.gen_bytes, options.packet_size,
+                  generated);
+        send_session(session, file, options);
+        return;
+    }
+
+    // Stdin of known size is sent while it's read, other modes need whole
+    // input first.
+    auto size = READAHEAD::regular_size(STDIN_FILENO);
+    if (size && options.read_ahead != 0 && options.streams == 1 &&
+        !options.resume && !options.delta) {
+        session_t session_id = session_id_generate();
+        IO::Socket socket = open_socket<P>(server_address, options);
+        Session<P> session(socket, server_address, session_id, false);
+        File file(session_id, STDIN_FILENO, *size, options.packet_size,
+                  options.read_ahead, read_ahead);
+        send_session(session, file, options);
+        return;
+    }
 
-            Session<udpr> session(socket, server_address, session_id, false);
+    std::vector<char> input = read_input();
 
-            client_handler(session, session_id, file);
+    if (options.streams > 1) {
+        run_striped<P>(server_address, options, input);
+        return;
+    }
+
+    session_t session_id = session_id_generate();
+    IO::Socket socket = open_socket<P>(server_address, options);
+    Session<P> session(socket, server_address, session_id, false);
+
+    if (options.resume) {
+        resume_handler(session, session_id, options.resume.value(), input,
+                       options.congestion, options.packet_size);
+    } else if (options.delta) {
+        auto signatures = DELTA::request_signatures(session, session_id);
+        DELTA::Encoder delta(input, signatures);
+        DBG_printer("delta size:", delta.get().size(), "input size:",
+                    input.size());
+        File file(session_id, delta.get(), options.packet_size);
+        send_session(session, file, options);
+    } else {
+        File file(session_id, input, options.packet_size);
+        send_session(session, file, options);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        signal(SIGPIPE, SIG_IGN);
+        TRACE::init("ppcbc");
+        STATS::Reporter::block_signals();
+        // Stats are dumped on SIGUSR1, trace on SIGUSR2.
+        STATS::Reporter reporter(std::nullopt);
+
+        if (argc < 3 || (argc < 4 && !IO::Address::is_path(argv[2]))) {
+            throw std::runtime_error(
+                "Usage: <protocol> <ip> <port> | <protocol> <socket path> "
+                "[--0rtt] [--packet-size <n>] "
+                "[--busy-poll <us>] [--cpu <n>] [--shm] [--gen-bytes <n>] "
+                "[--read-ahead <packets>] "
+                "[--batch | --delta | "
+                "--resume <name> | "
+                "--streams <n> [--stripe contiguous|strided]] "
+                "[--cc aimd|delay [--pacing none|kernel|bucket]] "
+                "(mcast: [--receivers <n>] [--iface <ip>] [--ttl <n>])");
+        }
+
+        std::string s_protocol(argv[1]);
+        // Path selects unix socket transport instead of IPv4.
+        bool unix_path = IO::Address::is_path(argv[2]);
+        ClientOptions options = read_options(argc, argv, unix_path ? 3 : 4);
+
+        IO::Address server_address =
+            unix_path ? IO::Address::unix_path(argv[2])
+                      : IO::get_server_address(argv[2], IO::read_port(argv[3]));
+        if (unix_path && s_protocol == "mcast") {
+            throw std::runtime_error("mcast requires ip and port");
+        }
+        if (options.shm && (!unix_path || s_protocol != "tcp")) {
+            throw std::runtime_error("--shm requires tcp and socket path");
+        }
+        if (options.cpu) {
+            IO::pin_to_cpu(*options.cpu);
+        }
+
+        if (s_protocol == "tcp") {
+            run_client<tcp>(server_address, options);
+        } else if (s_protocol == "udp") {
+            run_client<udp>(server_address, options);
+        } else if (s_protocol == "udpr") {
+            run_client<udpr>(server_address, options);
+        } else if (s_protocol == "mcast") {
+            run_multicast(server_address, options);
         } else {
             throw std::runtime_error("Unknown protocol: " + s_protocol);
         }
     } catch (std::exception &e) {
         std::cerr << "ERROR: " << e.what() << "\n";
     }
-}
\ No newline at end of file
+    STATS::registry().print(std::cerr);
+}
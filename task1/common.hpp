@@ -37,7 +37,7 @@ namespace PPCB {
 constexpr int MAX_DATA_SIZE = 64'000;
 constexpr int OPTIMAL_DATA_SIZE = 1'400; // default MTU size is 1500
 
-enum protocol_t : int8_t { tcp = 1, udp = 2, udpr = 3 };
+enum protocol_t : int8_t { tcp = 1, udp = 2, udpr = 3, mcast = 4 };
 
 // p_cnt_t:   packet number type.
 // b_cnt_t:   byte count type.
@@ -50,10 +50,14 @@ template <class T> T to_host(T v);
 
 template <class T> T to_net(T v);
 
+template <> uint16_t to_host<uint16_t>(uint16_t v) { return be16toh(v); }
+
 template <> p_cnt_t to_host<p_cnt_t>(p_cnt_t v) { return be32toh(v); }
 
 template <> b_cnt_t to_host<b_cnt_t>(b_cnt_t v) { return be64toh(v); }
 
+template <> uint16_t to_net<uint16_t>(uint16_t v) { return htobe16(v); }
+
 template <> p_cnt_t to_net<p_cnt_t>(p_cnt_t v) { return htobe32(v); }
 
 template <> b_cnt_t to_net<b_cnt_t>(b_cnt_t v) { return htobe64(v); }
@@ -65,7 +69,16 @@ enum packet_type_t : int8_t {
     DATA = 4,
     ACC = 5,
     RJT = 6,
-    RCVD = 7
+    RCVD = 7,
+    SIGREQ = 8,
+    SIGS = 9,
+    RESUME = 10,
+    RESUMEACC = 11,
+    STRIPE = 12,
+    NACK = 13,
+    CONNDATA = 14,
+    BATCH = 15,
+    SHMOPEN = 16
 };
 
 std::string packet_to_string(packet_type_t packet_type) {
@@ -84,11 +97,36 @@ std::string packet_to_string(packet_type_t packet_type) {
         return "RJT";
     case RCVD:
         return "RCVD";
+    case SIGREQ:
+        return "SIGREQ";
+    case SIGS:
+        return "SIGS";
+    case RESUME:
+        return "RESUME";
+    case RESUMEACC:
+        return "RESUMEACC";
+    case STRIPE:
+        return "STRIPE";
+    case NACK:
+        return "NACK";
+    case CONNDATA:
+        return "CONNDATA";
+    case BATCH:
+        return "BATCH";
+    case SHMOPEN:
+        return "SHMOPEN";
     default:
         return "Unkown packet type";
     }
 }
 
+// Packets opening new session.
+constexpr bool is_connection_request(packet_type_t packet_type) {
+    return packet_type == CONN || packet_type == RESUME ||
+           packet_type == STRIPE || packet_type == CONNDATA ||
+           packet_type == BATCH;
+}
+
 class unexpected_packet : public std::exception {
   private:
     packet_type_t _expected;
@@ -156,24 +194,36 @@ session_t session_id_generate() {
 }
 
 // Packet types classes.
-class PacketBase {
-  private:
-    // Helper function to call mtb before read.
-    session_t read_session_from_begining(IO::PacketReaderBase &reader) {
-        reader.mtb();
-        return std::get<1>(reader.readGeneric<packet_type_t, session_t>());
-    }
+using SCHEMA::Net;
+using SCHEMA::Raw;
+
+// Fixed part of every packet starts with its type and session id, of
+// ordered packets also with packet number.
+using Header = SCHEMA::Layout<Raw<packet_type_t>, Raw<session_t>>;
+using OrderedHeader = Header::append<Net<p_cnt_t>>;
+
+// Builds packet from its fixed part, fields following packet type are passed
+// to constructor of T in layout order.
+template <class T> T from_layout(IO::PacketReaderBase &reader) {
+    return std::make_from_tuple<T>(
+        SCHEMA::drop<1>(reader.readLayout<typename T::layout>()));
+}
+
+// Sender with fixed part of packet, extra is length of part that follows.
+template <class Layout>
+IO::PacketSender layout_sender(IO::Socket &socket, IO::Address *receiver,
+                               const typename Layout::values_t &values,
+                               size_t extra = 0) {
+    IO::PacketSender sender(socket, receiver);
+    sender.add_layout<Layout>(values, extra);
+    return sender;
+}
 
+class PacketBase {
   public:
     const session_t _session_id;
 
     PacketBase(session_t session_id) : _session_id(session_id) {}
-    PacketBase(IO::PacketReaderBase &reader)
-        : _session_id(read_session_from_begining(reader)) {}
-
-    void fillSender(IO::PacketSender &sender) const {
-        sender.add_var<packet_type_t, session_t>(getID(), _session_id);
-    }
 
     virtual void printer(std::ostream &os) const {
         os << "<" << packet_to_string(getID()) << ">";
@@ -185,7 +235,7 @@ class PacketBase {
     }
 
     virtual IO::PacketSender getSender(IO::Socket &socket,
-                                       sockaddr_in *receiver) const = 0;
+                                       IO::Address *receiver) const = 0;
     virtual packet_type_t getID() const = 0;
 
     virtual ~PacketBase() = default;
@@ -198,15 +248,6 @@ class PacketOrderedBase : public PacketBase {
     PacketOrderedBase(session_t session_id, p_cnt_t packet_number)
         : PacketBase(session_id), _packet_number(packet_number) {}
 
-    PacketOrderedBase(IO::PacketReaderBase &reader)
-        : PacketBase(reader),
-          _packet_number(to_host(std::get<0>(reader.readGeneric<p_cnt_t>()))) {}
-
-    void fillSender(IO::PacketSender &sender) const {
-        PacketBase::fillSender(sender);
-        sender.add_var<p_cnt_t>(to_net(_packet_number));
-    }
-
     virtual packet_type_t getID() const = 0;
     virtual void printer(std::ostream &os) const {
         os << "<" << packet_to_string(getID()) << " nr:" << _packet_number
@@ -220,7 +261,8 @@ template <packet_type_t P> class Packet;
 
 template <> class Packet<CONN> : public PacketBase {
   public:
-    static const packet_type_t _id = CONN;
+    static constexpr packet_type_t _id = CONN;
+    using layout = Header::append<Raw<protocol_t>, Net<b_cnt_t>>;
     const protocol_t _protocol;
     const b_cnt_t _data_len;
 
@@ -229,16 +271,12 @@ template <> class Packet<CONN> : public PacketBase {
         : PacketBase(session_id), _protocol(protocol), _data_len(data_len) {}
 
     Packet(IO::PacketReaderBase &reader)
-        : PacketBase(reader),
-          _protocol(std::get<0>(reader.readGeneric<protocol_t>())),
-          _data_len(to_host(std::get<0>(reader.readGeneric<b_cnt_t>()))) {}
+        : Packet(from_layout<Packet>(reader)) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketBase::fillSender(sender);
-        sender.add_var<protocol_t, b_cnt_t>(_protocol, to_net(_data_len));
-        return sender;
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _protocol, _data_len});
     }
 
     packet_type_t getID() const { return _id; }
@@ -246,17 +284,17 @@ template <> class Packet<CONN> : public PacketBase {
 
 template <> class Packet<CONNACC> : public PacketBase {
   public:
-    static const packet_type_t _id = CONNACC;
+    static constexpr packet_type_t _id = CONNACC;
+    using layout = Header;
 
   public:
     Packet(session_t session_id) : PacketBase(session_id) {}
-    Packet(IO::PacketReaderBase &reader) : PacketBase(reader) {}
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketBase::fillSender(sender);
-        return sender;
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver, {_id, _session_id});
     }
 
     packet_type_t getID() const { return _id; }
@@ -264,17 +302,17 @@ template <> class Packet<CONNACC> : public PacketBase {
 
 template <> class Packet<CONNRJT> : public PacketBase {
   public:
-    static const packet_type_t _id = CONNRJT;
+    static constexpr packet_type_t _id = CONNRJT;
+    using layout = Header;
 
   public:
     Packet(session_t session_id) : PacketBase(session_id) {}
-    Packet(IO::PacketReaderBase &reader) : PacketBase(reader) {}
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketBase::fillSender(sender);
-        return sender;
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver, {_id, _session_id});
     }
 
     packet_type_t getID() const { return _id; }
@@ -282,7 +320,8 @@ template <> class Packet<CONNRJT> : public PacketBase {
 
 template <> class Packet<DATA> : public PacketOrderedBase {
   public:
-    static const packet_type_t _id = DATA;
+    static constexpr packet_type_t _id = DATA;
+    using layout = OrderedHeader::append<Net<b_cnt_t>>;
     const b_cnt_t _packet_byte_cnt;
     const std::vector<char> _data;
 
@@ -296,22 +335,17 @@ template <> class Packet<DATA> : public PacketOrderedBase {
     Packet(session_t session_id, p_cnt_t packet_number, b_cnt_t packet_byte_cnt,
            std::vector<char> data)
         : PacketOrderedBase(session_id, packet_number),
-          _packet_byte_cnt(packet_byte_cnt), _data(data) {}
+          _packet_byte_cnt(packet_byte_cnt), _data(std::move(data)) {}
 
     Packet(IO::PacketReaderBase &reader)
-        : PacketOrderedBase(reader),
-          _packet_byte_cnt(to_host(std::get<0>(reader.readGeneric<b_cnt_t>()))),
-          _data(try_to_read_data(reader)) {
-        if (_packet_byte_cnt > MAX_DATA_SIZE) {
-            throw data_packet_wrong_format(_packet_number);
-        }
-    }
+        : Packet(reader.readLayout<layout>(), reader) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketOrderedBase::fillSender(sender);
-        sender.add_var<b_cnt_t>(to_net(_packet_byte_cnt));
+                               IO::Address *receiver) const {
+        auto sender = layout_sender<layout>(
+            socket, receiver,
+            {_id, _session_id, _packet_number, _packet_byte_cnt},
+            _data.size());
         sender.add_data(_data.data(), _data.size());
         return sender;
     }
@@ -319,7 +353,15 @@ template <> class Packet<DATA> : public PacketOrderedBase {
     packet_type_t getID() const { return _id; }
 
   private:
+    Packet(const layout::values_t &fields, IO::PacketReaderBase &reader)
+        : PacketOrderedBase(std::get<1>(fields), std::get<2>(fields)),
+          _packet_byte_cnt(std::get<3>(fields)),
+          _data(try_to_read_data(reader)) {}
+
     std::vector<char> try_to_read_data(IO::PacketReaderBase &reader) {
+        if (_packet_byte_cnt > MAX_DATA_SIZE) {
+            throw data_packet_wrong_format(_packet_number);
+        }
         try {
             return reader.readn(_packet_byte_cnt);
         } catch (IO::packet_smaller_than_expected &e) {
@@ -328,21 +370,26 @@ template <> class Packet<DATA> : public PacketOrderedBase {
     }
 };
 
+// Acknowledges packets up to _packet_number, _credit is number of bytes of
+// data receiver can take after it.
 template <> class Packet<ACC> : public PacketOrderedBase {
   public:
-    static const packet_type_t _id = ACC;
+    static constexpr packet_type_t _id = ACC;
+    using layout = OrderedHeader::append<Net<uint32_t>>;
+    const uint32_t _credit;
 
   public:
-    Packet(session_t session_id, p_cnt_t packet_number)
-        : PacketOrderedBase(session_id, packet_number) {}
+    Packet(session_t session_id, p_cnt_t packet_number, uint32_t credit)
+        : PacketOrderedBase(session_id, packet_number), _credit(credit) {}
 
-    Packet(IO::PacketReaderBase &reader) : PacketOrderedBase(reader) {}
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketOrderedBase::fillSender(sender);
-        return sender;
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _packet_number,
+                                      _credit});
     }
 
     packet_type_t getID() const { return _id; }
@@ -350,19 +397,20 @@ template <> class Packet<ACC> : public PacketOrderedBase {
 
 template <> class Packet<RJT> : public PacketOrderedBase {
   public:
-    static const packet_type_t _id = RJT;
+    static constexpr packet_type_t _id = RJT;
+    using layout = OrderedHeader;
 
   public:
     Packet(session_t session_id, p_cnt_t packet_number)
         : PacketOrderedBase(session_id, packet_number) {}
 
-    Packet(IO::PacketReaderBase &reader) : PacketOrderedBase(reader) {}
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketOrderedBase::fillSender(sender);
-        return sender;
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _packet_number});
     }
 
     packet_type_t getID() const { return _id; }
@@ -370,23 +418,373 @@ template <> class Packet<RJT> : public PacketOrderedBase {
 
 template <> class Packet<RCVD> : public PacketBase {
   public:
-    static const packet_type_t _id = RCVD;
+    static constexpr packet_type_t _id = RCVD;
+    using layout = Header;
+
+  public:
+    Packet(session_t session_id) : PacketBase(session_id) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver, {_id, _session_id});
+    }
+
+    packet_type_t getID() const { return _id; }
+};
+
+// Block signature used by delta transfers: rolling weak hash + strong hash.
+struct block_signature_t {
+    uint32_t weak;
+    uint64_t strong;
+};
+
+template <> class Packet<SIGREQ> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = SIGREQ;
+    using layout = Header;
 
   public:
     Packet(session_t session_id) : PacketBase(session_id) {}
 
-    Packet(IO::PacketReaderBase &reader) : PacketBase(reader) {}
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
 
     IO::PacketSender getSender(IO::Socket &socket,
-                               sockaddr_in *receiver) const {
-        IO::PacketSender sender(socket, receiver);
-        PacketBase::fillSender(sender);
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver, {_id, _session_id});
+    }
+
+    packet_type_t getID() const { return _id; }
+};
+
+// Chunk of block signatures of server-side basis file.
+// Packet number is index of chunk, _first_block index of its first signature.
+template <> class Packet<SIGS> : public PacketOrderedBase {
+  public:
+    static constexpr packet_type_t _id = SIGS;
+    // Block size, block count, first block and count of signatures in
+    // packet, which follow it.
+    using layout = OrderedHeader::append<Net<uint32_t>, Net<uint32_t>,
+                                         Net<uint32_t>, Net<uint32_t>>;
+    using signature_layout = SCHEMA::Layout<Net<uint32_t>, Net<uint64_t>>;
+    static constexpr uint32_t SIGNATURE_SIZE = signature_layout::SIZE;
+    static constexpr uint32_t MAX_SIGNATURES =
+        OPTIMAL_DATA_SIZE / SIGNATURE_SIZE;
+    const uint32_t _block_size;
+    const uint32_t _block_cnt;
+    const uint32_t _first_block;
+    const std::vector<block_signature_t> _signatures;
+
+  public:
+    Packet(session_t session_id, p_cnt_t packet_number, uint32_t block_size,
+           uint32_t block_cnt, uint32_t first_block,
+           std::vector<block_signature_t> signatures)
+        : PacketOrderedBase(session_id, packet_number),
+          _block_size(block_size), _block_cnt(block_cnt),
+          _first_block(first_block), _signatures(std::move(signatures)) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(reader.readLayout<layout>(), reader) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        auto sender = layout_sender<layout>(
+            socket, receiver,
+            {_id, _session_id, _packet_number, _block_size, _block_cnt,
+             _first_block, (uint32_t)_signatures.size()},
+            _signatures.size() * SIGNATURE_SIZE);
+        for (auto &sig : _signatures) {
+            sender.add_layout<signature_layout>({sig.weak, sig.strong});
+        }
         return sender;
     }
 
+    packet_type_t getID() const { return _id; }
+
+  private:
+    Packet(const layout::values_t &fields, IO::PacketReaderBase &reader)
+        : PacketOrderedBase(std::get<1>(fields), std::get<2>(fields)),
+          _block_size(std::get<3>(fields)), _block_cnt(std::get<4>(fields)),
+          _first_block(std::get<5>(fields)),
+          _signatures(try_to_read_signatures(reader, std::get<6>(fields))) {}
+
+    std::vector<block_signature_t>
+    try_to_read_signatures(IO::PacketReaderBase &reader, uint32_t cnt) {
+        if (cnt > MAX_SIGNATURES) {
+            throw data_packet_wrong_format(_packet_number);
+        }
+
+        std::vector<char> buffor;
+        try {
+            buffor = reader.readn(cnt * SIGNATURE_SIZE);
+        } catch (IO::packet_smaller_than_expected &e) {
+            throw data_packet_wrong_format(_packet_number);
+        }
+        std::vector<block_signature_t> signatures(cnt);
+        for (uint32_t i = 0; i < cnt; i++) {
+            auto [weak, strong] =
+                signature_layout::decode(buffor.data() + i * SIGNATURE_SIZE);
+            signatures[i] = {weak, strong};
+        }
+        return signatures;
+    }
+};
+
+// Connection request continuing transfer identified by name from last offset
+// accepted by server. _data_len is length of whole transfer.
+template <> class Packet<RESUME> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = RESUME;
+    static constexpr uint16_t MAX_NAME_LEN = 255;
+    // Name of length given by last field follows.
+    using layout =
+        Header::append<Raw<protocol_t>, Net<b_cnt_t>, Net<uint16_t>>;
+    const protocol_t _protocol;
+    const b_cnt_t _data_len;
+    const std::string _name;
+
+  public:
+    Packet(session_t session_id, protocol_t protocol, b_cnt_t data_len,
+           std::string name)
+        : PacketBase(session_id), _protocol(protocol), _data_len(data_len),
+          _name(std::move(name)) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(reader.readLayout<layout>(), reader) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        auto sender = layout_sender<layout>(
+            socket, receiver,
+            {_id, _session_id, _protocol, _data_len, (uint16_t)_name.size()},
+            _name.size());
+        sender.add_data(_name.data(), _name.size());
+        return sender;
+    }
+
+    packet_type_t getID() const { return _id; }
+
+  private:
+    Packet(const layout::values_t &fields, IO::PacketReaderBase &reader)
+        : PacketBase(std::get<1>(fields)), _protocol(std::get<2>(fields)),
+          _data_len(std::get<3>(fields)),
+          _name(read_name(reader, std::get<4>(fields))) {}
+
+    static std::string read_name(IO::PacketReaderBase &reader, uint16_t len) {
+        if (len > MAX_NAME_LEN) {
+            throw std::runtime_error("Transfer name too long: " +
+                                     std::to_string(len));
+        }
+        auto name = reader.readn(len);
+        return std::string(name.begin(), name.end());
+    }
+};
+
+// Accepts RESUME, _offset is number of bytes server already has.
+template <> class Packet<RESUMEACC> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = RESUMEACC;
+    using layout = Header::append<Net<b_cnt_t>>;
+    const b_cnt_t _offset;
+
+  public:
+    Packet(session_t session_id, b_cnt_t offset)
+        : PacketBase(session_id), _offset(offset) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _offset});
+    }
+
+    packet_type_t getID() const { return _id; }
+};
+
+enum stripe_layout_t : int8_t { contiguous = 1, strided = 2 };
+
+// Connection request of one of _stream_cnt sessions carrying parts of
+// _total_len bytes long input. _data_len is length of this stream part.
+template <> class Packet<STRIPE> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = STRIPE;
+    using layout =
+        Header::append<Raw<protocol_t>, Net<b_cnt_t>, Raw<session_t>,
+                       Net<uint32_t>, Net<uint32_t>, Raw<stripe_layout_t>,
+                       Net<uint32_t>, Net<b_cnt_t>>;
+    const protocol_t _protocol;
+    const b_cnt_t _data_len;
+    const session_t _group_id;
+    const uint32_t _stream_idx;
+    const uint32_t _stream_cnt;
+    const stripe_layout_t _layout;
+    const uint32_t _chunk_size;
+    const b_cnt_t _total_len;
+
+  public:
+    Packet(session_t session_id, protocol_t protocol, b_cnt_t data_len,
+           session_t group_id, uint32_t stream_idx, uint32_t stream_cnt,
+           stripe_layout_t stripe_layout, uint32_t chunk_size,
+           b_cnt_t total_len)
+        : PacketBase(session_id), _protocol(protocol), _data_len(data_len),
+          _group_id(group_id), _stream_idx(stream_idx),
+          _stream_cnt(stream_cnt), _layout(stripe_layout),
+          _chunk_size(chunk_size), _total_len(total_len) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(
+            socket, receiver,
+            {_id, _session_id, _protocol, _data_len, _group_id, _stream_idx,
+             _stream_cnt, _layout, _chunk_size, _total_len});
+    }
+
+    packet_type_t getID() const { return _id; }
+};
+
+// Request of multicast receiver to repeat _cnt data packets starting from
+// _packet_number. ALL_PACKETS asks for all packets after it.
+template <> class Packet<NACK> : public PacketOrderedBase {
+  public:
+    static constexpr packet_type_t _id = NACK;
+    static constexpr p_cnt_t ALL_PACKETS = UINT32_MAX;
+    using layout = OrderedHeader::append<Net<p_cnt_t>>;
+    const p_cnt_t _cnt;
+
+  public:
+    Packet(session_t session_id, p_cnt_t packet_number, p_cnt_t cnt)
+        : PacketOrderedBase(session_id, packet_number), _cnt(cnt) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _packet_number, _cnt});
+    }
+
+    packet_type_t getID() const { return _id; }
+};
+
+// Connection request carrying first data packet (number 0) of session, so
+// that client doesn't wait for CONNACC before sending data.
+template <> class Packet<CONNDATA> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = CONNDATA;
+    // Data of length given by last field follows.
+    using layout =
+        Header::append<Raw<protocol_t>, Net<b_cnt_t>, Net<b_cnt_t>>;
+    const protocol_t _protocol;
+    const b_cnt_t _data_len;
+    const b_cnt_t _packet_byte_cnt;
+    const std::vector<char> _data;
+
+  public:
+    Packet(session_t session_id, protocol_t protocol, b_cnt_t data_len,
+           const Packet<DATA> &first)
+        : PacketBase(session_id), _protocol(protocol), _data_len(data_len),
+          _packet_byte_cnt(first._packet_byte_cnt), _data(first._data) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(reader.readLayout<layout>(), reader) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        auto sender = layout_sender<layout>(
+            socket, receiver,
+            {_id, _session_id, _protocol, _data_len, _packet_byte_cnt},
+            _data.size());
+        sender.add_data(_data.data(), _data.size());
+        return sender;
+    }
+
+    packet_type_t getID() const { return _id; }
+
+    Packet<CONN> conn() const {
+        return Packet<CONN>(_session_id, _protocol, _data_len);
+    }
+
+    Packet<DATA> first_data() const {
+        return Packet<DATA>(_session_id, 0, _packet_byte_cnt, _data);
+    }
+
+  private:
+    Packet(const layout::values_t &fields, IO::PacketReaderBase &reader)
+        : PacketBase(std::get<1>(fields)), _protocol(std::get<2>(fields)),
+          _data_len(std::get<3>(fields)),
+          _packet_byte_cnt(std::get<4>(fields)),
+          _data(try_to_read_data(reader)) {}
+
+    std::vector<char> try_to_read_data(IO::PacketReaderBase &reader) {
+        if (_packet_byte_cnt > MAX_DATA_SIZE) {
+            throw data_packet_wrong_format(0);
+        }
+        try {
+            return reader.readn(_packet_byte_cnt);
+        } catch (IO::packet_smaller_than_expected &e) {
+            throw data_packet_wrong_format(0);
+        }
+    }
+};
+
+// Connection request of session carrying manifest and contents of many
+// files, _data_len bytes in total.
+template <> class Packet<BATCH> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = BATCH;
+    using layout = Header::append<Raw<protocol_t>, Net<b_cnt_t>>;
+    const protocol_t _protocol;
+    const b_cnt_t _data_len;
+
+  public:
+    Packet(session_t session_id, protocol_t protocol, b_cnt_t data_len)
+        : PacketBase(session_id), _protocol(protocol), _data_len(data_len) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _protocol, _data_len});
+    }
+
+    packet_type_t getID() const { return _id; }
+};
+
+// Moves connection to shared memory rings with _capacity bytes each, memfd
+// and eventfds of which are passed with packet. Sent before any session.
+template <> class Packet<SHMOPEN> : public PacketBase {
+  public:
+    static constexpr packet_type_t _id = SHMOPEN;
+    using layout = Header::append<Net<uint32_t>>;
+    const uint32_t _capacity;
+
+  public:
+    Packet(session_t session_id, uint32_t capacity)
+        : PacketBase(session_id), _capacity(capacity) {}
+
+    Packet(IO::PacketReaderBase &reader)
+        : Packet(from_layout<Packet>(reader)) {}
+
+    IO::PacketSender getSender(IO::Socket &socket,
+                               IO::Address *receiver) const {
+        return layout_sender<layout>(socket, receiver,
+                                     {_id, _session_id, _capacity});
+    }
+
     packet_type_t getID() const { return _id; }
 };
 
 } // namespace PPCB
 
-#endif /* COMMON_HPP */
\ No newline at end of file
+#endif /* COMMON_HPP */
@@ -0,0 +1,562 @@
+#ifndef CONGESTION_HPP
+#define CONGESTION_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interface.hpp"
+#include "io.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// Congestion control of windowed udpr transfers. Client keeps up to window
+// DATA packets in flight, server acknowledges them cumulatively with ACC of
+// last in-order packet and repeats it for packets received out of order.
+// Window is also limited by credit granted in ACC, free space of server's
+// receive buffer.
+namespace CONGESTION {
+using namespace PPCB;
+using clock = std::chrono::steady_clock;
+using std::chrono::microseconds;
+
+constexpr double INITIAL_WINDOW = 4;
+constexpr double MIN_WINDOW = 1;
+constexpr double MAX_WINDOW = 1024;
+constexpr int DUPACK_THRESHOLD = 3;
+constexpr auto INITIAL_RTO = std::chrono::milliseconds(200);
+constexpr auto MIN_RTO = std::chrono::milliseconds(10);
+constexpr auto MAX_RTO = std::chrono::seconds(MAX_WAIT);
+// Pacing rate is that many times window per round trip time.
+constexpr double PACING_GAIN = 1.25;
+// Token bucket holds at most that many packets.
+constexpr double PACING_BURST = 4;
+
+// Round trip time estimation as in RFC 6298.
+class RttEstimator {
+  private:
+    microseconds _srtt{0};
+    microseconds _rttvar{0};
+    microseconds _latest{0};
+    microseconds _min{microseconds::max()};
+
+  public:
+    void sample(microseconds rtt) {
+        if (_srtt.count() == 0) {
+            _srtt = rtt;
+            _rttvar = rtt / 2;
+        } else {
+            microseconds diff = rtt > _srtt ? rtt - _srtt : _srtt - rtt;
+            _rttvar = (3 * _rttvar + diff) / 4;
+            _srtt = (7 * _srtt + rtt) / 8;
+        }
+        _latest = rtt;
+        _min = std::min(_min, rtt);
+    }
+
+    bool has_sample() const { return _srtt.count() != 0; }
+    microseconds srtt() const { return _srtt; }
+    microseconds latest() const { return _latest; }
+    microseconds min() const { return _min; }
+
+    microseconds rto() const {
+        if (!has_sample()) {
+            return INITIAL_RTO;
+        }
+        return std::clamp<microseconds>(_srtt + 4 * _rttvar, MIN_RTO,
+                                        MAX_RTO);
+    }
+};
+
+// Numbers exported to compare controllers.
+struct Stats {
+    uint64_t _sent{0};
+    uint64_t _retransmitted{0};
+    uint64_t _loss_events{0};
+    uint64_t _timeouts{0};
+    uint64_t _probes{0};
+    uint64_t _delay_samples{0};
+    microseconds _queue_delay_sum{0};
+    microseconds _queue_delay_max{0};
+
+    // Queueing delay is time of sample above minimal round trip time.
+    void add_delay(const RttEstimator &rtt) {
+        microseconds delay = rtt.latest() - rtt.min();
+        _delay_samples++;
+        _queue_delay_sum += delay;
+        _queue_delay_max = std::max(_queue_delay_max, delay);
+    }
+
+    void print(std::ostream &os, const std::string &controller,
+               const RttEstimator &rtt, double window) const {
+        double loss_rate = _sent ? (double)_retransmitted / (double)_sent : 0;
+        int64_t avg_delay =
+            _delay_samples ? _queue_delay_sum.count() / (int64_t)_delay_samples
+                           : 0;
+        os << "congestion: controller=" << controller << " sent=" << _sent
+           << " retransmitted=" << _retransmitted
+           << " loss_events=" << _loss_events << " timeouts=" << _timeouts
+           << " probes=" << _probes
+           << " loss_rate=" << loss_rate
+           << " min_rtt_us=" << (rtt.has_sample() ? rtt.min().count() : 0)
+           << " srtt_us=" << rtt.srtt().count()
+           << " avg_queue_delay_us=" << avg_delay
+           << " max_queue_delay_us=" << _queue_delay_max.count()
+           << " final_window=" << window << "\n";
+    }
+};
+
+// Sets size of send window (in packets) from acknowledgments and losses.
+class Controller {
+  public:
+    // Called when acked packets were acknowledged for the first time.
+    virtual void on_ack(p_cnt_t acked, const RttEstimator &rtt) = 0;
+    // Called once per window in which loss was detected by duplicate ACC.
+    virtual void on_loss() = 0;
+    // Called when retransmission timer expired.
+    virtual void on_timeout() = 0;
+
+    virtual double window() const = 0;
+    virtual std::string name() const = 0;
+
+    virtual ~Controller() = default;
+};
+
+// Slow start followed by additive increase, multiplicative decrease.
+class Aimd : public Controller {
+  private:
+    double _window{INITIAL_WINDOW};
+    double _threshold{MAX_WINDOW};
+
+  public:
+    void on_ack(p_cnt_t acked, const RttEstimator &) {
+        for (p_cnt_t i = 0; i < acked; i++) {
+            _window += _window < _threshold ? 1 : 1 / _window;
+        }
+        _window = std::min(_window, MAX_WINDOW);
+    }
+
+    void on_loss() {
+        _threshold = std::max(_window / 2, 2 * MIN_WINDOW);
+        _window = _threshold;
+    }
+
+    void on_timeout() {
+        _threshold = std::max(_window / 2, 2 * MIN_WINDOW);
+        _window = MIN_WINDOW;
+    }
+
+    double window() const { return _window; }
+    std::string name() const { return "aimd"; }
+};
+
+// Delay based control (Vegas). Keeps number of packets queued on path,
+// estimated from difference between current and minimal round trip time,
+// between ALPHA and BETA.
+class Delay : public Controller {
+  private:
+    static constexpr double ALPHA = 2;
+    static constexpr double BETA = 4;
+    // Slow start ends when more packets than that are queued.
+    static constexpr double GAMMA = 1;
+
+    double _window{INITIAL_WINDOW};
+    bool _slow_start{true};
+
+  public:
+    void on_ack(p_cnt_t acked, const RttEstimator &rtt) {
+        double queued = 0;
+        if (rtt.has_sample() && rtt.latest().count() > 0) {
+            queued = _window * (double)(rtt.latest() - rtt.min()).count() /
+                     (double)rtt.latest().count();
+        }
+
+        if (_slow_start && queued > GAMMA) {
+            _slow_start = false;
+        }
+        if (_slow_start) {
+            _window += acked;
+        } else if (queued < ALPHA) {
+            _window += acked / _window;
+        } else if (queued > BETA) {
+            _window -= acked / _window;
+        }
+        _window = std::clamp(_window, MIN_WINDOW, MAX_WINDOW);
+    }
+
+    void on_loss() {
+        _window = std::max(_window * 3 / 4, MIN_WINDOW);
+        _slow_start = false;
+    }
+
+    void on_timeout() {
+        _window = MIN_WINDOW;
+        _slow_start = false;
+    }
+
+    double window() const { return _window; }
+    std::string name() const { return "delay"; }
+};
+
+std::unique_ptr<Controller> make_controller(const std::string &name) {
+    if (name == "aimd") {
+        return std::make_unique<Aimd>();
+    } else if (name == "delay") {
+        return std::make_unique<Delay>();
+    }
+    throw std::runtime_error("Unknown congestion controller: " + name);
+}
+
+enum pacing_t { no_pacing, kernel_pacing, bucket_pacing };
+
+pacing_t read_pacing(const std::string &name) {
+    if (name == "none") {
+        return no_pacing;
+    } else if (name == "kernel") {
+        return kernel_pacing;
+    } else if (name == "bucket") {
+        return bucket_pacing;
+    }
+    throw std::runtime_error("Unknown pacing: " + name);
+}
+
+struct Options {
+    // Windowed sending is used only when controller is set.
+    std::optional<std::string> controller;
+    pacing_t pacing{bucket_pacing};
+};
+
+// Spreads packets of window over round trip time. Kernel pacing sets
+// SO_MAX_PACING_RATE on socket (enforced by fq qdisc), bucket pacing
+// delays sends in user space.
+class Pacer {
+  private:
+    IO::Socket &_socket;
+    pacing_t _pacing;
+    // Data bytes of packets of window.
+    double _packet_bytes{OPTIMAL_DATA_SIZE};
+    // Bytes per second, 0 (no limit) before first round trip time sample.
+    double _rate{0};
+    double _kernel_rate{0};
+    double _tokens{PACING_BURST * OPTIMAL_DATA_SIZE};
+    clock::time_point _last_refill{clock::now()};
+
+    void refill() {
+        auto now = clock::now();
+        double elapsed = std::chrono::duration<double>(now - _last_refill).count();
+        _tokens = std::min(_tokens + elapsed * _rate,
+                           PACING_BURST * _packet_bytes);
+        _last_refill = now;
+    }
+
+  public:
+    Pacer(IO::Socket &socket, pacing_t pacing)
+        : _socket(socket), _pacing(pacing) {}
+
+    void update(double window, const RttEstimator &rtt, size_t packet_size) {
+        if (_pacing == no_pacing || !rtt.has_sample()) {
+            return;
+        }
+        _packet_bytes = (double)packet_size;
+        refill();
+        _rate = PACING_GAIN * window * _packet_bytes /
+                std::chrono::duration<double>(rtt.srtt()).count();
+
+        // Socket option is changed only when rate changed noticeably.
+        if (_pacing == kernel_pacing &&
+            (_rate < _kernel_rate * 7 / 8 || _rate > _kernel_rate * 9 / 8)) {
+            uint64_t rate = (uint64_t)_rate;
+            _socket.setsockopt(IO::Socket::MAX_PACING_RATE, &rate,
+                               sizeof(rate));
+            _kernel_rate = _rate;
+        }
+    }
+
+    // Time left until packet of given size can be sent.
+    clock::duration delay(size_t bytes) {
+        if (_pacing != bucket_pacing || _rate <= 0) {
+            return clock::duration::zero();
+        }
+        refill();
+        if (_tokens >= (double)bytes) {
+            return clock::duration::zero();
+        }
+        return std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(((double)bytes - _tokens) / _rate));
+    }
+
+    void consume(size_t bytes) {
+        if (_pacing == bucket_pacing && _rate > 0) {
+            _tokens -= (double)bytes;
+        }
+    }
+};
+
+// Sends file over udpr session keeping window of packets in flight. Lost
+// packets are sent again from first unacknowledged one (server accepts
+// packets only in order).
+class WindowedSender {
+  private:
+    struct InFlight {
+        Packet<DATA> _packet;
+        // Kernel TX timestamp of last send, if socket has them.
+        IO::timestamp_t _sent;
+        uint32_t _tx_key{0};
+        bool _retransmitted{false};
+    };
+
+    IO::Socket &_socket;
+    IO::Address _addr;
+    session_t _session_id;
+    std::unique_ptr<Controller> _controller;
+    Pacer _pacer;
+    RttEstimator _rtt;
+    Stats _stats;
+    STATS::SessionStats &_session_stats;
+
+    // Packets sent but not acknowledged, first of them has number _base.
+    std::deque<InFlight> _in_flight;
+    p_cnt_t _base{0};
+    // Index in _in_flight of next packet to (re)send.
+    size_t _next{0};
+    // Loss is not reported again before packets up to _recover are acked.
+    p_cnt_t _recover{0};
+    int _dupacks{0};
+    int _timeouts_in_row{0};
+    clock::time_point _timer{clock::now()};
+    // Packets before _credit_end fit in receive buffer of server.
+    p_cnt_t _credit_end{std::numeric_limits<p_cnt_t>::max()};
+    size_t _packet_size{OPTIMAL_DATA_SIZE};
+    int _probes_in_row{0};
+
+    size_t window() const {
+        return (size_t)std::min<p_cnt_t>((p_cnt_t)_controller->window(),
+                                         _credit_end - _base);
+    }
+
+    // Sending waits for credit, not for congestion window.
+    bool credit_limited() const {
+        return _next >= window() && window() < (size_t)_controller->window();
+    }
+
+    // Server that is behind is probed less and less often.
+    clock::duration timeout() const {
+        return std::min<clock::duration>(
+            _rtt.rto() * (1 << std::min(_probes_in_row, 16)), MAX_RTO);
+    }
+
+    void send(InFlight &entry, bool retransmission) {
+        DBG_printer("sending: ", entry._packet);
+        auto sender = entry._packet.getSender(_socket, &_addr);
+        entry._tx_key = _socket.txKey();
+        entry._sent = std::chrono::system_clock::now();
+        sender.send<IO::Socket::UDP>();
+        _stats._sent++;
+        TRACE::record(retransmission ? TRACE::RETRANSMITTED : TRACE::SENT, DATA,
+                      _session_id, entry._packet._packet_number);
+        if (retransmission) {
+            entry._retransmitted = true;
+            _stats._retransmitted++;
+            _session_stats.retransmitted(sender.size());
+        } else {
+            _session_stats.sent(sender.size());
+            _session_stats.data(entry._packet._packet_byte_cnt);
+            _packet_size = std::max<size_t>(entry._packet._data.size(), 1);
+        }
+        _pacer.consume(entry._packet._data.size());
+    }
+
+    // Updates send times with TX timestamps. They come shortly after send,
+    // so matching packet is searched from last sent one.
+    void read_tx_timestamps() {
+        uint32_t key;
+        IO::timestamp_t time;
+        while (_socket.txTimestamps() && _socket.readTxTimestamp(key, time)) {
+            for (size_t i = std::min(_next, _in_flight.size()); i-- > 0;) {
+                if (_in_flight[i]._tx_key == key) {
+                    _in_flight[i]._sent = time;
+                    break;
+                }
+            }
+        }
+    }
+
+    void go_back() {
+        _next = 0;
+        _timer = clock::now();
+    }
+
+    void handle_acc(p_cnt_t number, uint32_t credit,
+                    IO::timestamp_t received_at) {
+        if (number + 1 >= _base) {
+            _credit_end = number + 1 + std::max<p_cnt_t>(
+                                           (p_cnt_t)(credit / _packet_size), 1);
+            _probes_in_row = 0;
+        }
+        if (number + 1 > _base && number < _base + _in_flight.size()) {
+            p_cnt_t acked = number + 1 - _base;
+            auto &last = _in_flight[acked - 1];
+            if (!last._retransmitted) {
+                auto sample = std::max(received_at - last._sent,
+                                       IO::timestamp_t::duration::zero());
+                _session_stats.rtt(sample);
+                _rtt.sample(std::chrono::duration_cast<microseconds>(sample));
+                _stats.add_delay(_rtt);
+            }
+            for (p_cnt_t i = 0; i < acked; i++) {
+                _in_flight.pop_front();
+            }
+            _next -= std::min<size_t>(_next, acked);
+            _base += acked;
+            _dupacks = 0;
+            _timeouts_in_row = 0;
+            _timer = clock::now();
+            _controller->on_ack(acked, _rtt);
+            _pacer.update(_controller->window(), _rtt, _packet_size);
+        } else if (number + 1 == _base && !_in_flight.empty() &&
+                   ++_dupacks == DUPACK_THRESHOLD && _base >= _recover) {
+            DBG_printer("loss detected at", _base);
+            TRACE::record(TRACE::LOSS, 0, _session_id, _base);
+            _stats._loss_events++;
+            _recover = _base + (p_cnt_t)_next;
+            _controller->on_loss();
+            _pacer.update(_controller->window(), _rtt, _packet_size);
+            go_back();
+        }
+    }
+
+    void handle_timeout() {
+        if (credit_limited()) {
+            probe();
+            return;
+        }
+        if (++_timeouts_in_row > MAX_RETRANSMITS) {
+            throw IO::timeout_error((int)_socket);
+        }
+        DBG_printer("retransmission timeout at", _base);
+        TRACE::record(TRACE::TIMEOUT, 0, _session_id, _base);
+        _stats._timeouts++;
+        _session_stats.timed_out();
+        _recover = _base + (p_cnt_t)_next;
+        _controller->on_timeout();
+        go_back();
+    }
+
+    // Packets in flight wait in full buffer of server, only first of them is
+    // sent again, so that it's acknowledged with new credit even if it was
+    // lost. Probes count as timeouts once they're MAX_RTO apart.
+    void probe() {
+        if (timeout() >= MAX_RTO && ++_timeouts_in_row > MAX_RETRANSMITS) {
+            throw IO::timeout_error((int)_socket);
+        }
+        DBG_printer("probing receive buffer at", _base);
+        _stats._probes++;
+        _probes_in_row++;
+        send(_in_flight.front(), true);
+        _timer = clock::now();
+    }
+
+    // Returns true when server confirmed all data.
+    bool receive() {
+        IO::Address addr;
+        auto received = IO::PacketReader<IO::Socket::UDP>::try_receive(
+            _socket, &addr, Header::SIZE, false);
+        if (!received) {
+            return false;
+        }
+        auto &reader = **received;
+        auto [id, session_id] = reader.readLayout<Header>();
+        if (session_id != _session_id || !(addr == _addr)) {
+            return false;
+        }
+        TRACE::record(TRACE::RECEIVED, id, _session_id,
+                      peek_number(reader, id));
+        reader.mtb();
+        _session_stats.received();
+
+        if (id == ACC) {
+            read_tx_timestamps();
+            Packet<ACC> acc(reader);
+            handle_acc(acc._packet_number, acc._credit,
+                       reader.timestamp().value_or(
+                           std::chrono::system_clock::now()));
+        } else if (id == RJT) {
+            _session_stats.rejected();
+            throw rejected_data(Packet<RJT>(reader)._packet_number);
+        } else if (id == RCVD) {
+            return true;
+        }
+        return false;
+    }
+
+  public:
+    WindowedSender(IO::Socket &socket, IO::Address addr, session_t session_id,
+                   const Options &options, STATS::SessionStats &session_stats)
+        : _socket(socket), _addr(addr), _session_id(session_id),
+          _controller(make_controller(options.controller.value())),
+          _pacer(socket, options.pacing), _session_stats(session_stats) {}
+
+    // Sends file, first packet of which has number first.
+    void run(File &file, p_cnt_t first = 0) {
+        _base = _recover = first;
+        while (true) {
+            while (_next < _in_flight.size() || file.get_size() != 0) {
+                if (_next >= window() || _pacer.delay(_packet_size) !=
+                                             clock::duration::zero()) {
+                    break;
+                }
+                if (_next == _in_flight.size()) {
+                    _in_flight.push_back({file.get_next_packet(), {}, false});
+                    send(_in_flight.back(), false);
+                } else {
+                    send(_in_flight[_next], true);
+                }
+                _next++;
+            }
+
+            read_tx_timestamps();
+            // After last ACC server has nothing to repeat, RCVD is awaited
+            // for whole timeout.
+            bool waiting_for_rcvd = _in_flight.empty() && file.get_size() == 0;
+            auto deadline =
+                _timer + (waiting_for_rcvd
+                              ? std::chrono::duration_cast<clock::duration>(
+                                    MAX_RTO)
+                              : timeout());
+            auto wait = deadline - clock::now();
+            bool can_send = _next < std::min(window(), _in_flight.size()) ||
+                            (_next < window() && file.get_size() != 0);
+            if (can_send) {
+                wait = std::min(wait, _pacer.delay(_packet_size));
+            }
+
+            try {
+                if (IO::wait_readable(_socket,
+                                      std::max(wait, clock::duration::zero()))) {
+                    if (receive()) {
+                        break;
+                    }
+                } else if (clock::now() >= deadline) {
+                    if (waiting_for_rcvd) {
+                        throw IO::timeout_error((int)_socket);
+                    }
+                    handle_timeout();
+                }
+            } catch (IO::packet_smaller_than_expected &e) {
+                // Incorrect packet, skipping
+            }
+        }
+    }
+
+    void print_stats(std::ostream &os) const {
+        _stats.print(os, _controller->name(), _rtt, _controller->window());
+    }
+};
+} // namespace CONGESTION
+
+#endif /* CONGESTION_HPP */
@@ -0,0 +1,424 @@
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interface.hpp"
+#include "io.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Rsync-like delta transfer. Server sends signatures of blocks of its basis
+// file, client answers with stream of literal data and block references,
+// which is sent as regular DATA payload and rebuilt by DeltaSink.
+namespace DELTA {
+using namespace PPCB;
+
+constexpr uint32_t MIN_BLOCK_SIZE = 512;
+constexpr uint32_t MAX_BLOCK_SIZE = 64 * 1024;
+
+// Delta stream operations.
+enum op_t : int8_t { LITERAL = 'L', COPY = 'C', END = 'E' };
+
+// Rolling checksum from rsync paper: a = sum x_i, b = sum (len - i) * x_i.
+class RollingHash {
+  private:
+    uint32_t _a{0};
+    uint32_t _b{0};
+    uint32_t _len{0};
+
+  public:
+    RollingHash() = default;
+    RollingHash(const char *data, uint32_t len) : _len(len) {
+        for (uint32_t i = 0; i < len; i++) {
+            _a += (uint8_t)data[i];
+            _b += (len - i) * (uint8_t)data[i];
+        }
+    }
+
+    // Moves window one byte forward.
+    void roll(char out, char in) {
+        _a += (uint8_t)in - (uint8_t)out;
+        _b += _a - _len * (uint8_t)out;
+    }
+
+    uint32_t digest() const { return (_a & 0xffff) | (_b << 16); }
+};
+
+// 64-bit strong hash (multiply-xorshift over 8 byte words), computed
+// incrementally so rebuilt files don't have to be kept in memory.
+class StrongHash {
+  private:
+    static constexpr uint64_t MUL1 = 0xff51afd7ed558ccdULL;
+    static constexpr uint64_t MUL2 = 0xc4ceb9fe1a85ec53ULL;
+    uint64_t _h{0x9e3779b97f4a7c15ULL};
+    uint64_t _len{0};
+    char _tail[sizeof(uint64_t)];
+    size_t _tail_len{0};
+
+    static uint64_t mix(uint64_t h, uint64_t w) {
+        h = (h ^ (w * MUL1)) * MUL2;
+        return h ^ (h >> 29);
+    }
+
+  public:
+    StrongHash &update(const char *data, size_t len) {
+        _len += len;
+        while (len > 0) {
+            size_t part = std::min(len, sizeof(_tail) - _tail_len);
+            std::memcpy(_tail + _tail_len, data, part);
+            _tail_len += part;
+            data += part;
+            len -= part;
+
+            if (_tail_len == sizeof(_tail)) {
+                _h = mix(_h, IO::read_single_var<uint64_t>(_tail));
+                _tail_len = 0;
+            }
+        }
+        return *this;
+    }
+
+    uint64_t digest() const {
+        uint64_t tail = 0;
+        std::memcpy(&tail, _tail, _tail_len);
+        uint64_t h = mix(mix(_h, tail), _len);
+        return h ^ (h >> 32);
+    }
+};
+
+uint64_t strong_hash(const char *data, size_t len) {
+    return StrongHash().update(data, len).digest();
+}
+
+// Block size in range [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE] close to sqrt(size).
+uint32_t choose_block_size(b_cnt_t file_size) {
+    auto root = (uint32_t)std::sqrt((double)file_size);
+    root = (root + 7) & ~7U;
+    return std::clamp(root, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+}
+
+// Signatures of every block of server-side basis file.
+class Signatures {
+  private:
+    uint32_t _block_size;
+    std::vector<block_signature_t> _blocks;
+
+  public:
+    Signatures() : _block_size(MIN_BLOCK_SIZE) {}
+
+    explicit Signatures(const std::string &path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            throw std::runtime_error("Couldn't open basis file: " + path);
+        }
+        _block_size = choose_block_size(file.tellg());
+        file.seekg(0);
+
+        std::vector<char> buffor(_block_size);
+        while (file.read(buffor.data(), _block_size) || file.gcount() > 0) {
+            auto len = (uint32_t)file.gcount();
+            _blocks.push_back({RollingHash(buffor.data(), len).digest(),
+                               strong_hash(buffor.data(), len)});
+        }
+    }
+
+    uint32_t block_size() const { return _block_size; }
+    uint32_t block_cnt() const { return (uint32_t)_blocks.size(); }
+    const std::vector<block_signature_t> &blocks() const { return _blocks; }
+
+    // Fills signatures received in SIGS packet.
+    void add(const Packet<SIGS> &sigs) {
+        _block_size = sigs._block_size;
+        if (_blocks.size() != sigs._block_cnt) {
+            _blocks.assign(sigs._block_cnt, {0, 0});
+        }
+        for (size_t i = 0; i < sigs._signatures.size(); i++) {
+            if (sigs._first_block + i < _blocks.size()) {
+                _blocks[sigs._first_block + i] = sigs._signatures[i];
+            }
+        }
+    }
+
+    // Packets that carry all signatures.
+    std::vector<Packet<SIGS>> to_packets(session_t session_id) const {
+        std::vector<Packet<SIGS>> packets;
+        p_cnt_t packet_number = 0;
+        uint32_t first = 0;
+        do {
+            uint32_t cnt = std::min(Packet<SIGS>::MAX_SIGNATURES,
+                                    block_cnt() - first);
+            packets.emplace_back(
+                session_id, packet_number++, _block_size, block_cnt(), first,
+                std::vector<block_signature_t>(_blocks.begin() + first,
+                                               _blocks.begin() + first + cnt));
+            first += cnt;
+        } while (first < block_cnt());
+        return packets;
+    }
+};
+
+// Sends signatures of basis as burst of SIGS packets.
+template <IO::Socket::connection_t C>
+void send_signatures(IO::Socket &socket, IO::Address *addr,
+                     session_t session_id, const Signatures &signatures) {
+    DBG_printer("sending", signatures.block_cnt(), "signatures of size",
+                signatures.block_size());
+    for (auto &sigs : signatures.to_packets(session_id)) {
+        sigs.getSender(socket, addr).send<C>();
+    }
+}
+
+// Asks server for signatures of its basis file. Lost SIGS packets only make
+// delta bigger, so after first one arrives, timeout ends waiting.
+template <protocol_t P>
+Signatures request_signatures(Session<P> &session, session_t session_id) {
+    session.send(std::make_unique<Packet<SIGREQ>>(session_id));
+
+    Signatures signatures;
+    std::vector<bool> received;
+    p_cnt_t received_cnt = 0;
+    while (received.empty() || received_cnt < received.size()) {
+        try {
+            auto [reader, id] = session.get_next();
+            if (id != SIGS) {
+                throw unexpected_packet(SIGS, std::nullopt, id, std::nullopt);
+            }
+
+            Packet<SIGS> sigs(*reader);
+            if (received.empty()) {
+                received.resize(std::max<size_t>(
+                    1, (sigs._block_cnt + Packet<SIGS>::MAX_SIGNATURES - 1) /
+                           Packet<SIGS>::MAX_SIGNATURES));
+            }
+            if (sigs._packet_number < received.size() &&
+                !received[sigs._packet_number]) {
+                received[sigs._packet_number] = true;
+                received_cnt++;
+                signatures.add(sigs);
+            }
+        } catch (IO::timeout_error &e) {
+            if (received_cnt == 0) {
+                throw;
+            }
+            DBG_printer("received", received_cnt, "/", received.size(),
+                        "SIGS packets");
+            break;
+        }
+    }
+    return signatures;
+}
+
+// Builds delta stream of data against signatures.
+class Encoder {
+  private:
+    std::vector<char> _delta;
+
+    template <class... Args> void add(Args... args) {
+        ((_delta.insert(_delta.end(), (char *)&args,
+                        (char *)&args + sizeof(Args))),
+         ...);
+    }
+
+    void add_literal(const char *data, size_t len) {
+        while (len > 0) {
+            auto part = (uint32_t)std::min<size_t>(len, UINT32_MAX);
+            add<op_t, uint32_t>(LITERAL, to_net(part));
+            _delta.insert(_delta.end(), data, data + part);
+            data += part;
+            len -= part;
+        }
+    }
+
+  public:
+    Encoder(const std::vector<char> &data, const Signatures &signatures) {
+        uint32_t block_size = signatures.block_size();
+        std::unordered_multimap<uint32_t, uint32_t> weak_index;
+        for (uint32_t i = 0; i < signatures.block_cnt(); i++) {
+            auto &sig = signatures.blocks()[i];
+            // Zeroed signatures were lost in transit.
+            if (sig.weak != 0 || sig.strong != 0) {
+                weak_index.emplace(sig.weak, i);
+            }
+        }
+
+        size_t literal_begin = 0;
+        size_t pos = 0;
+        // Run of consecutive matched blocks, empty if run_len == 0.
+        uint32_t run_begin = 0;
+        uint32_t run_len = 0;
+        auto flush_run = [&]() {
+            if (run_len > 0) {
+                add<op_t, uint32_t, uint32_t>(COPY, to_net(run_begin),
+                                              to_net(run_len));
+                run_len = 0;
+            }
+        };
+
+        RollingHash rolling;
+        bool rolling_valid = false;
+        while (!weak_index.empty() && pos + block_size <= data.size()) {
+            if (!rolling_valid) {
+                rolling = RollingHash(&data[pos], block_size);
+                rolling_valid = true;
+            }
+
+            std::optional<uint32_t> match;
+            auto [begin, end] = weak_index.equal_range(rolling.digest());
+            if (begin != end) {
+                uint64_t strong = strong_hash(&data[pos], block_size);
+                for (auto it = begin; it != end; it++) {
+                    if (signatures.blocks()[it->second].strong == strong) {
+                        // Prefer continuing current run.
+                        if (!match ||
+                            (run_len > 0 && it->second == run_begin + run_len)) {
+                            match = it->second;
+                        }
+                    }
+                }
+            }
+
+            if (match) {
+                if (literal_begin < pos) {
+                    flush_run();
+                    add_literal(data.data() + literal_begin,
+                                pos - literal_begin);
+                }
+                if (run_len == 0 || *match != run_begin + run_len) {
+                    flush_run();
+                    run_begin = *match;
+                }
+                run_len++;
+                pos += block_size;
+                literal_begin = pos;
+                rolling_valid = false;
+            } else {
+                if (pos + block_size < data.size()) {
+                    rolling.roll(data[pos], data[pos + block_size]);
+                }
+                pos++;
+            }
+        }
+
+        flush_run();
+        add_literal(data.data() + literal_begin, data.size() - literal_begin);
+        add<op_t, uint64_t>(END,
+                            to_net(strong_hash(data.data(), data.size())));
+    }
+
+    const std::vector<char> &get() const { return _delta; }
+};
+
+// Rebuilds file from delta stream and basis file, passing it to next sink.
+class DeltaSink : public Sink {
+  private:
+    Sink &_out;
+    std::ifstream _basis;
+    uint32_t _block_size;
+    std::vector<char> _header;
+    uint32_t _literal_left{0};
+    bool _ended{false};
+    StrongHash _rebuilt_hash;
+
+    static size_t header_size(op_t op) {
+        switch (op) {
+        case LITERAL:
+            return sizeof(op_t) + sizeof(uint32_t);
+        case COPY:
+            return sizeof(op_t) + 2 * sizeof(uint32_t);
+        case END:
+            return sizeof(op_t) + sizeof(uint64_t);
+        default:
+            throw std::runtime_error("Unknown delta operation: " +
+                                     std::to_string(op));
+        }
+    }
+
+    void output(const char *data, size_t len) {
+        _out.write(data, len);
+        _rebuilt_hash.update(data, len);
+    }
+
+    void copy_blocks(uint32_t first, uint32_t cnt) {
+        std::vector<char> buffor(_block_size);
+        _basis.clear();
+        _basis.seekg((std::streamoff)first * _block_size);
+        for (uint32_t i = 0; i < cnt; i++) {
+            _basis.read(buffor.data(), _block_size);
+            // Only last block of basis can be shorter.
+            if (_basis.gcount() == 0 ||
+                (_basis.gcount() < _block_size && i + 1 < cnt)) {
+                throw std::runtime_error("Delta references block " +
+                                         std::to_string(first + i) +
+                                         " outside of basis file");
+            }
+            output(buffor.data(), _basis.gcount());
+        }
+    }
+
+    void execute_header() {
+        auto op = (op_t)_header[0];
+        const char *args = _header.data() + sizeof(op_t);
+        if (op == LITERAL) {
+            _literal_left = to_host(IO::read_single_var<uint32_t>(args));
+        } else if (op == COPY) {
+            copy_blocks(to_host(IO::read_single_var<uint32_t>(args)),
+                        to_host(IO::read_single_var<uint32_t>(
+                            args + sizeof(uint32_t))));
+        } else {
+            uint64_t expected = to_host(IO::read_single_var<uint64_t>(args));
+            if (expected != _rebuilt_hash.digest()) {
+                throw std::runtime_error(
+                    "Delta reconstruction checksum mismatch");
+            }
+            _ended = true;
+        }
+        _header.clear();
+    }
+
+  public:
+    DeltaSink(Sink &out, const std::string &basis_path,
+              uint32_t block_size)
+        : _out(out), _basis(basis_path, std::ios::binary),
+          _block_size(block_size) {}
+
+    void write(const char *data, size_t len) {
+        while (len > 0) {
+            if (_ended) {
+                throw std::runtime_error("Data after end of delta stream");
+            }
+
+            if (_literal_left > 0) {
+                size_t part = std::min<size_t>(len, _literal_left);
+                output(data, part);
+                _literal_left -= (uint32_t)part;
+                data += part;
+                len -= part;
+                continue;
+            }
+
+            _header.push_back(*data);
+            data++;
+            len--;
+            if (_header.size() == header_size((op_t)_header[0])) {
+                execute_header();
+            }
+        }
+    }
+
+    void finish() {
+        if (!_ended) {
+            throw std::runtime_error("Delta stream ended prematurely");
+        }
+        _out.finish();
+    }
+};
+} // namespace DELTA
+
+#endif /* DELTA_HPP */
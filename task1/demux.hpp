@@ -0,0 +1,152 @@
+#ifndef DEMUX_HPP
+#define DEMUX_HPP
+
+#include "common.hpp"
+
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Demultiplexing of datagrams between sessions served on one socket.
+namespace DEMUX {
+using namespace PPCB;
+
+struct SessionKey {
+    // IPv4 address and port, or hash of unix socket path. Keys of unix
+    // peers may collide only if their random session ids do too.
+    uint64_t _addr;
+    session_t _session_id;
+
+    SessionKey(const IO::Address &addr, session_t session_id)
+        : _addr(addr.family() == AF_INET
+                    ? ((uint64_t)addr.in().sin_addr.s_addr << 16) |
+                          addr.in().sin_port
+                    : std::hash<std::string>()(addr.path())),
+          _session_id(session_id) {}
+
+    bool operator==(const SessionKey &other) const {
+        return _session_id == other._session_id && _addr == other._addr;
+    }
+
+    // Session ids are random, address is mixed in for sessions of same id.
+    uint64_t hash() const {
+        uint64_t x = _session_id ^ _addr;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+};
+
+// Open addressing hash table (linear probing) from client address and
+// session id to session state. Keys and slot states are kept apart from
+// values, so that probing touches few cache lines.
+template <class T> class SessionTable {
+  private:
+    enum slot_t : uint8_t { empty, full, erased };
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    std::vector<SessionKey> _keys;
+    std::vector<slot_t> _slots;
+    std::vector<std::optional<T>> _values;
+    size_t _size{0};
+    size_t _used{0};
+
+    size_t mask() const { return _slots.size() - 1; }
+
+    // Index of key, or of free slot where it would be inserted.
+    size_t probe(const SessionKey &key) const {
+        size_t idx = key.hash() & mask();
+        std::optional<size_t> free;
+        while (_slots[idx] != empty) {
+            if (_slots[idx] == full && _keys[idx] == key) {
+                return idx;
+            }
+            if (_slots[idx] == erased && !free) {
+                free = idx;
+            }
+            idx = (idx + 1) & mask();
+        }
+        return free.value_or(idx);
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<SessionKey> keys(capacity, SessionKey({}, 0));
+        std::vector<slot_t> slots(capacity, empty);
+        std::vector<std::optional<T>> values(capacity);
+        std::swap(keys, _keys);
+        std::swap(slots, _slots);
+        std::swap(values, _values);
+        _used = _size;
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i] == full) {
+                size_t idx = probe(keys[i]);
+                _keys[idx] = keys[i];
+                _slots[idx] = full;
+                _values[idx] = std::move(values[i]);
+            }
+        }
+    }
+
+  public:
+    SessionTable() { rehash(MIN_CAPACITY); }
+
+    T *find(const IO::Address &addr, session_t session_id) {
+        return find(SessionKey(addr, session_id));
+    }
+
+    T *find(const SessionKey &key) {
+        size_t idx = probe(key);
+        return _slots[idx] == full ? &*_values[idx] : nullptr;
+    }
+
+    template <class... Args>
+    T &emplace(const IO::Address &addr, session_t session_id,
+               Args &&...args) {
+        // Load (with erased slots) is kept below 3/4.
+        if ((_used + 1) * 4 > _slots.size() * 3) {
+            rehash(_size * 2 >= _slots.size() / 2 ? _slots.size() * 2
+                                                  : _slots.size());
+        }
+        SessionKey key(addr, session_id);
+        size_t idx = probe(key);
+        if (_slots[idx] != full) {
+            _size++;
+            _used += _slots[idx] == empty;
+        }
+        _keys[idx] = key;
+        _slots[idx] = full;
+        _values[idx].emplace(std::forward<Args>(args)...);
+        return *_values[idx];
+    }
+
+    bool erase(const IO::Address &addr, session_t session_id) {
+        size_t idx = probe(SessionKey(addr, session_id));
+        if (_slots[idx] != full) {
+            return false;
+        }
+        _slots[idx] = erased;
+        _values[idx].reset();
+        _size--;
+        return true;
+    }
+
+    size_t size() const { return _size; }
+
+    template <class F> void for_each(F f) {
+        for (size_t i = 0; i < _slots.size(); i++) {
+            if (_slots[i] == full) {
+                f(*_values[i]);
+            }
+        }
+    }
+};
+} // namespace DEMUX
+
+#endif /* DEMUX_HPP */
@@ -1,14 +1,23 @@
 #ifndef INTERFACE_HPP
 #define INTERFACE_HPP
 
+#include "admission.hpp"
 #include "common.hpp"
 #include "debug.hpp"
 #include "io.hpp"
-
+#include "readahead.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
 #include <fstream>
 #include <optional>
 #include <queue>
 #include <stdexcept>
+#include <string>
 #include <tuple>
 #include <type_traits>
 #include <vector>
@@ -16,34 +25,121 @@
 namespace PPCB {
 using namespace PPCB;
 
+// Reads whole stdin into memory.
+std::vector<char> read_input() {
+    std::vector<char> input;
+    static std::vector<char> buffor(OPTIMAL_DATA_SIZE);
+    while (std::cin.peek() != EOF) {
+        std::cin.read(buffor.data(), OPTIMAL_DATA_SIZE);
+
+        if (std::cin.gcount() == 0) {
+            throw std::runtime_error("Failed to read stdin");
+        }
+
+        input.insert(input.end(), buffor.data(),
+                     buffor.data() + std::cin.gcount());
+    }
+    return input;
+}
+
+// Synthetic input of client --gen-bytes, verified by server --discard. Byte
+// at offset is byte offset % 8 of word offset / 8, so that data landing at
+// wrong offset doesn't match.
+uint64_t pattern_word(b_cnt_t word) {
+    return (word + 1) * 0x9E3779B97F4A7C15ULL;
+}
+
+void fill_pattern(char *data, b_cnt_t offset, size_t len) {
+    // Partial words at both ends, whole words between them.
+    size_t skip = (size_t)(offset % 8);
+    b_cnt_t word = offset / 8;
+    if (skip != 0) {
+        uint64_t value = pattern_word(word++);
+        size_t n = std::min<size_t>(8 - skip, len);
+        std::memcpy(data, (const char *)&value + skip, n);
+        data += n;
+        len -= n;
+    }
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t value = pattern_word(word++);
+        std::memcpy(data, &value, 8);
+    }
+    if (len != 0) {
+        uint64_t value = pattern_word(word);
+        std::memcpy(data, &value, len);
+    }
+}
+
+struct generated_t {};
+constexpr generated_t generated{};
+
+struct read_ahead_t {};
+constexpr read_ahead_t read_ahead{};
+
 class File {
   private:
     std::queue<Packet<DATA>> _packets;
-    b_cnt_t _size;
+    // Atomic as striped transfers report progress from another thread.
+    std::atomic<b_cnt_t> _size;
+    // Generated files build packets when they are taken instead.
+    bool _generated{false};
+    // Files read ahead take data of packets from reader thread.
+    std::unique_ptr<READAHEAD::Reader> _reader;
+    session_t _session_id{0};
+    b_cnt_t _packet_size{OPTIMAL_DATA_SIZE};
+    b_cnt_t _offset{0};
+    p_cnt_t _packet_number{0};
 
   public:
-    File(session_t session_id) : _size(0) {
+    File(session_t session_id) : File(session_id, read_input()) {}
+
+    // Pattern of size bytes, nothing is read or kept in memory.
+    File(session_t session_id, b_cnt_t size, b_cnt_t packet_size, generated_t)
+        : _size(size), _generated(true), _session_id(session_id),
+          _packet_size(packet_size) {}
+
+    // Size bytes read from fd by reader thread, at most capacity packets
+    // ahead of sending.
+    File(session_t session_id, int fd, b_cnt_t size, b_cnt_t packet_size,
+         size_t capacity, read_ahead_t)
+        : _size(size), _reader(std::make_unique<READAHEAD::Reader>(
+                           fd, size, packet_size, capacity)),
+          _session_id(session_id) {}
+
+    File(session_t session_id, const std::vector<char> &data,
+         b_cnt_t packet_size = OPTIMAL_DATA_SIZE)
+        : _size(0) {
         p_cnt_t packet_number = 0;
-        while (std::cin.peek() != EOF) {
-            static std::vector<char> buffor(OPTIMAL_DATA_SIZE);
-
-            std::cin.read(buffor.data(), OPTIMAL_DATA_SIZE);
-
-            if (std::cin.gcount() == 0) {
-                throw std::runtime_error("Failed to read stdin");
-            }
-
-            _packets.emplace(session_id, packet_number, std::cin.gcount(),
-                             buffor.data());
+        while (_size < data.size()) {
+            b_cnt_t len = std::min<b_cnt_t>(packet_size, data.size() - _size);
+            _packets.emplace(session_id, packet_number, len,
+                             std::vector<char>(data.begin() + _size,
+                                               data.begin() + _size + len));
 
             packet_number++;
-            _size += std::cin.gcount();
+            _size += len;
         }
     }
 
     b_cnt_t get_size() { return _size; }
 
     Packet<DATA> get_next_packet() {
+        if (_generated) {
+            static thread_local std::vector<char> buffor(MAX_DATA_SIZE);
+            b_cnt_t len = std::min<b_cnt_t>(_packet_size, _size);
+            fill_pattern(buffor.data(), _offset, len);
+            _offset += len;
+            _size -= len;
+            return Packet<DATA>(_session_id, _packet_number++, len,
+                                buffor.data());
+        }
+        if (_reader) {
+            std::vector<char> data = _reader->next();
+            b_cnt_t len = data.size();
+            _size -= len;
+            return Packet<DATA>(_session_id, _packet_number++, len,
+                                std::move(data));
+        }
         auto ret = _packets.front();
         _packets.pop();
         _size -= ret._packet_byte_cnt;
@@ -51,45 +147,136 @@ class File {
     }
 };
 
+// Destination of data received by server.
+class Sink {
+  public:
+    virtual void write(const char *data, size_t len) = 0;
+
+    // Called after last byte of transfer was written.
+    virtual void finish() {}
+
+    // Descriptor that sink writes to, if parts of data can be written
+    // straight to it at their offsets instead.
+    virtual std::optional<int> fd() const { return std::nullopt; }
+
+    virtual ~Sink() = default;
+};
+
+class StdoutSink : public Sink {
+  public:
+    void write(const char *data, size_t len) {
+        std::cout.write(data, len);
+        std::cout << std::flush;
+    }
+
+    std::optional<int> fd() const { return STDOUT_FILENO; }
+};
+
+// Drops data after checking it against pattern of generated input.
+class DiscardSink : public Sink {
+  private:
+    b_cnt_t _offset{0};
+    std::vector<char> _expected;
+
+  public:
+    void write(const char *data, size_t len) {
+        _expected.resize(std::max(_expected.size(), len));
+        fill_pattern(_expected.data(), _offset, len);
+        if (std::memcmp(data, _expected.data(), len) != 0) {
+            throw std::runtime_error(
+                "Data doesn't match generated pattern near byte " +
+                std::to_string(_offset));
+        }
+        _offset += len;
+    }
+};
+
+// Answers DATA of session that isn't served with RJT. Only header of packet
+// is read, its data is not copied.
+void reject_data(IO::Socket &socket, IO::Address *addr,
+                 IO::PacketReaderBase &reader) {
+    reader.mtb();
+    auto [id, session_id, packet_number] =
+        reader.readGeneric<packet_type_t, session_t, p_cnt_t>();
+    Packet<RJT>(session_id, to_host(packet_number))
+        .getSender(socket, addr)
+        .send<IO::Socket::UDP>();
+}
+
+// Estimate of kernel memory charged for queued datagram: data with network
+// headers and shared info is allocated in power of two sized block (small
+// ones come from cache of bigger blocks), buffer head separately.
+size_t datagram_truesize(size_t size) {
+    static constexpr size_t HEADERS = 64;
+    static constexpr size_t SHARED_INFO = 320;
+    static constexpr size_t SMALL_BLOCK = 576;
+    static constexpr size_t BUFFER_HEAD = 256;
+    return std::max(std::bit_ceil(size + HEADERS + SHARED_INFO), SMALL_BLOCK) +
+           BUFFER_HEAD;
+}
+
+// Credit granted in ACC: bytes of data packets of given size that fit in free
+// part of receive buffer. Packets are acknowledged after sink took them, so
+// buffer fills up and credit shrinks while sink is slower than client.
+uint32_t receive_credit(IO::Socket &socket, size_t packet_size) {
+    size_t packets =
+        socket.receiveSpace() /
+        datagram_truesize(Packet<DATA>::layout::SIZE + packet_size);
+    return (uint32_t)std::min<size_t>(packets * packet_size, UINT32_MAX);
+}
+
 // Function that reads next packet for given session
 // and auto-respond (UDP) or throw exception (TCP) to other packets.
 template <IO::Socket::connection_t C>
 std::tuple<std::unique_ptr<IO::PacketReaderBase>, packet_type_t>
-get_next_from_session(IO::Socket &socket, sockaddr_in client_address,
+get_next_from_session(IO::Socket &socket, IO::Address client_address,
                       session_t current_session_id, bool is_server,
                       std::chrono::steady_clock::time_point to_begin =
                           std::chrono::steady_clock::now());
 
-template <>
-std::tuple<std::unique_ptr<IO::PacketReaderBase>, packet_type_t>
-get_next_from_session<IO::Socket::UDP>(
-    IO::Socket &socket, sockaddr_in client_address,
-    session_t current_session_id, bool is_server,
-    std::chrono::steady_clock::time_point to_begin) {
+// Reads next packet of udp session like get_next_from_session, but timeout
+// is returned, as retransmitting sessions wait for it many times in a row.
+IO::Expected<std::tuple<std::unique_ptr<IO::PacketReaderBase>, packet_type_t>>
+try_next_from_session(IO::Socket &socket, IO::Address client_address,
+                      session_t current_session_id, bool is_server,
+                      std::chrono::steady_clock::time_point to_begin) {
+    using Reader = IO::PacketReader<IO::Socket::UDP>;
 
     while (true) {
         try {
-            sockaddr_in addr;
-            auto reader = std::make_unique<IO::PacketReader<IO::Socket::UDP>>(
-                socket, &addr, true, to_begin);
-            auto [id, session_id] =
-                reader->readGeneric<packet_type_t, session_t>();
+            IO::Address addr;
+            auto received = Reader::try_receive(socket, &addr, Header::SIZE,
+                                                true, to_begin);
+            if (!received && received.error() == IO::failure_t::too_short) {
+                // Incorrect packet, skipping
+                continue;
+            } else if (!received) {
+                return received.error();
+            }
+            std::unique_ptr<Reader> reader = std::move(*received);
+            auto [id, session_id] = reader->readLayout<Header>();
 
             DBG_printer("readed next: id->", packet_to_string(id),
                         "session_id->", session_id);
 
             if (session_id == current_session_id && addr == client_address) {
                 reader->mtb();
-                return {std::move(reader), id};
-            } else if (id == CONN && is_server) {
-                Packet<CONNRJT>(session_id)
-                    .getSender(socket, &addr)
-                    .send<IO::Socket::UDP>();
+                return std::tuple<std::unique_ptr<IO::PacketReaderBase>,
+                                  packet_type_t>(std::move(reader), id);
+            } else if (is_connection_request(id) && is_server) {
+                // Waits for this session to end, unless it's over caps.
+                if (id == STRIPE ||
+                    !ADMISSION::datagrams().offer(
+                        addr, session_id, reader->size(), [&]() {
+                            return ADMISSION::Datagram{addr,
+                                                       reader->datagram()};
+                        })) {
+                    Packet<CONNRJT>(session_id)
+                        .getSender(socket, &addr)
+                        .send<IO::Socket::UDP>();
+                }
             } else if (id == DATA && is_server) {
-                Packet<DATA> data(*reader);
-                Packet<RJT>(session_id, data._packet_number)
-                    .getSender(socket, &addr)
-                    .send<IO::Socket::UDP>();
+                reject_data(socket, &addr, *reader);
             }
         } catch (IO::packet_smaller_than_expected &e) {
             // Incorrect packet, skipping
@@ -97,16 +284,28 @@ get_next_from_session<IO::Socket::UDP>(
     }
 }
 
+template <>
+std::tuple<std::unique_ptr<IO::PacketReaderBase>, packet_type_t>
+get_next_from_session<IO::Socket::UDP>(
+    IO::Socket &socket, IO::Address client_address,
+    session_t current_session_id, bool is_server,
+    std::chrono::steady_clock::time_point to_begin) {
+    return std::move(try_next_from_session(socket, client_address,
+                                           current_session_id, is_server,
+                                           to_begin)
+                         .value((int)socket));
+}
+
 template <>
 std::tuple<std::unique_ptr<IO::PacketReaderBase>, packet_type_t>
 get_next_from_session<IO::Socket::TCP>(
-    IO::Socket &socket, sockaddr_in addr, session_t current_session_id, bool,
+    IO::Socket &socket, IO::Address addr, session_t current_session_id, bool,
     std::chrono::steady_clock::time_point to_begin) {
 
     auto reader = std::make_unique<IO::PacketReader<IO::Socket::TCP>>(
         socket, &addr, true, to_begin);
 
-    auto [id, session_id] = reader->readGeneric<packet_type_t, session_t>();
+    auto [id, session_id] = reader->readLayout<Header>();
 
     DBG_printer("readed next: id->", packet_to_string(id), "session_id->",
                 session_id);
@@ -144,15 +343,14 @@ concept Unorderedable = (std::derived_from<Packet<P>, PacketBase> &&
 template <packet_type_t P>
 requires Orderedable<P> bool
 can_skip(std::unique_ptr<IO::PacketReaderBase> &reader, p_cnt_t wanted_num) {
-    reader->mtb();
-    auto [id, session_id] = reader->readGeneric<packet_type_t, session_t>();
+    auto [id, session_id] = reader->readLayout<Header>();
 
     if (id != P) {
         reader->mtb();
         return false;
     } else {
-        auto [packet_number] = reader->readGeneric<p_cnt_t>();
-        packet_number = to_host(packet_number);
+        p_cnt_t packet_number =
+            std::get<2>(reader->readLayout<OrderedHeader>());
         reader->mtb();
         return packet_number < wanted_num;
     }
@@ -162,8 +360,7 @@ can_skip(std::unique_ptr<IO::PacketReaderBase> &reader, p_cnt_t wanted_num) {
 template <packet_type_t P>
 requires Unorderedable<P> bool
 can_skip(std::unique_ptr<IO::PacketReaderBase> &reader, p_cnt_t) {
-    reader->mtb();
-    auto [id, session_id] = reader->readGeneric<packet_type_t, session_t>();
+    auto [id, session_id] = reader->readLayout<Header>();
     reader->mtb();
 
     if (id == P) {
@@ -173,10 +370,34 @@ can_skip(std::unique_ptr<IO::PacketReaderBase> &reader, p_cnt_t) {
     }
 }
 
+// Number of ordered packet (DATA, ACC, RJT), 0 for others.
+p_cnt_t packet_number(const PacketBase &packet) {
+    packet_type_t id = packet.getID();
+    if (id == DATA || id == ACC || id == RJT) {
+        return static_cast<const PacketOrderedBase &>(packet)._packet_number;
+    }
+    return 0;
+}
+
+// Number of ordered packet in reader, read without allocation.
+p_cnt_t peek_number(IO::PacketReaderBase &reader, packet_type_t id) {
+    if (id != DATA && id != ACC && id != RJT) {
+        return 0;
+    }
+    char header[sizeof(packet_type_t) + sizeof(session_t) + sizeof(p_cnt_t)];
+    reader.mtb();
+    reader.readn(header, sizeof(header));
+    reader.mtb();
+    p_cnt_t number;
+    std::memcpy(&number, header + sizeof(packet_type_t) + sizeof(session_t),
+                sizeof(number));
+    return to_host(number);
+}
+
 template <protocol_t P> class Session {
   private:
     IO::Socket &_socket;
-    sockaddr_in _addr;
+    IO::Address _addr;
     session_t _session_id;
     std::unique_ptr<PacketBase> _last_msg;
     int _retransmit_cnt{0};
@@ -184,21 +405,92 @@ template <protocol_t P> class Session {
     // case)
     bool _retransmit_ready{false};
     bool _is_server;
+    STATS::Handle _stats;
+    // Time of last send, RTT is sampled only if it wasn't retransmitted.
+    // Kernel timestamps replace it when socket has TX timestamps.
+    IO::timestamp_t _sent_at;
+    uint32_t _sent_key{0};
+    bool _retransmitted{false};
     static constexpr IO::Socket::connection_t connection =
         (uses_tcp<P>() ? IO::Socket::TCP : IO::Socket::UDP);
 
+    // Counts packet returned by get_next.
+    void received(IO::PacketReaderBase &reader, packet_type_t id) {
+        TRACE::record(TRACE::RECEIVED, id, _session_id,
+                      peek_number(reader, id));
+        _stats->received();
+        if (id == RJT || id == CONNRJT) {
+            _stats->rejected();
+        }
+        IO::timestamp_t sent_at = last_sent_at();
+        if (_retransmit_ready && !_retransmitted &&
+            answers(_last_msg->getID(), id)) {
+            _stats->rtt(reader.timestamp().value_or(
+                            std::chrono::system_clock::now()) -
+                        sent_at);
+        }
+    }
+
+    // Whether reply answers sent packet right away, so that time between them
+    // is round trip time. RCVD after last DATA of tcp and udp waits for
+    // server to take all data, it isn't sampled.
+    static bool answers(packet_type_t sent, packet_type_t reply) {
+        if (is_connection_request(sent)) {
+            return reply == CONNACC || reply == RESUMEACC || reply == CONNRJT;
+        }
+        return retransmits<P>() && sent == DATA && reply == ACC;
+    }
+
+    // Time of last send, read from kernel TX timestamps if there are any.
+    IO::timestamp_t last_sent_at() {
+        uint32_t key;
+        IO::timestamp_t time;
+        while (_socket.txTimestamps() && _socket.readTxTimestamp(key, time)) {
+            if (key == _sent_key) {
+                _sent_at = time;
+            }
+        }
+        return _sent_at;
+    }
+
   public:
-    Session(IO::Socket &socket, sockaddr_in addr, int64_t session_id,
+    Session(IO::Socket &socket, IO::Address addr, int64_t session_id,
             bool is_server)
         : _socket(socket), _addr(addr), _session_id(session_id),
-          _is_server(is_server) {}
+          _is_server(is_server), _stats(session_id, addr, STATS::kind_name(P)) {
+        TRACE::record(TRACE::SESSION_BEGIN, 0, _session_id, _is_server);
+    }
+
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    ~Session() {
+        TRACE::record(TRACE::SESSION_END, 0, _session_id, _is_server);
+    }
+
+    IO::Socket &socket() { return _socket; }
+    IO::Address address() const { return _addr; }
+    session_t id() const { return _session_id; }
+    STATS::SessionStats &stats() { return *_stats; }
 
     void send(std::unique_ptr<PacketBase> packet) {
         DBG_printer("sending: ", *packet);
-        packet->getSender(_socket, &_addr).send<connection>();
+        auto sender = packet->getSender(_socket, &_addr);
+        _sent_key = _socket.txKey();
+        _sent_at = std::chrono::system_clock::now();
+        sender.send<connection>();
+        TRACE::record(TRACE::SENT, packet->getID(), _session_id,
+                      packet_number(*packet));
+        _stats->sent(sender.size());
+        if (packet->getID() == DATA) {
+            _stats->data(static_cast<Packet<DATA> &>(*packet)._packet_byte_cnt);
+        } else if (packet->getID() == RJT || packet->getID() == CONNRJT) {
+            _stats->rejected();
+        }
         _retransmit_cnt = MAX_RETRANSMITS;
         _last_msg = std::move(packet);
         _retransmit_ready = true;
+        _retransmitted = false;
     }
 
     // Functions that pass next received packet to proccess in current session.
@@ -207,8 +499,17 @@ template <protocol_t P> class Session {
         tuple<std::unique_ptr<IO::PacketReaderBase>, packet_type_t> get_next(
             to_int<Ps>..., std::chrono::steady_clock::time_point to_begin =
                                std::chrono::steady_clock::now()) {
-        return get_next_from_session<connection>(_socket, _addr, _session_id,
-                                                 _is_server, to_begin);
+        try {
+            auto next = get_next_from_session<connection>(
+                _socket, _addr, _session_id, _is_server, to_begin);
+            received(*std::get<0>(next), std::get<1>(next));
+            _retransmit_ready = false;
+            return next;
+        } catch (IO::timeout_error &e) {
+            TRACE::record(TRACE::TIMEOUT, 0, _session_id);
+            _stats->timed_out();
+            throw;
+        }
     }
 
     template <packet_type_t... Ps>
@@ -217,28 +518,40 @@ template <protocol_t P> class Session {
             to_int<Ps>... cnts, std::chrono::steady_clock::time_point to_begin =
                                     std::chrono::steady_clock::now()) {
         while (true) {
-            try {
-                auto [reader, id] = get_next_from_session<connection>(
-                    _socket, _addr, _session_id, _is_server, to_begin);
+            auto next = try_next_from_session(_socket, _addr, _session_id,
+                                              _is_server, to_begin);
+            if (next) {
+                auto &[reader, id] = *next;
                 if ((can_skip<Ps>(reader, cnts) || ...)) {
+                    TRACE::record(TRACE::SKIPPED, id, _session_id,
+                                  peek_number(*reader, id));
+                    _stats->received();
                     continue;
                 }
 
                 reader->mtb();
+                received(*reader, id);
                 _retransmit_ready = false;
-                return {std::move(reader), id};
-            } catch (IO::timeout_error &e) {
-                if (_retransmit_cnt <= 0 || !_retransmit_ready) {
-                    throw e;
-                }
-
-                DBG_printer("retransmiting cnt->", _retransmit_cnt, "id->",
-                            packet_to_string(_last_msg->getID()));
+                return std::move(*next);
+            }
 
-                _retransmit_cnt--;
-                _last_msg->getSender(_socket, &_addr).send<connection>();
-                to_begin = std::chrono::steady_clock::now();
+            TRACE::record(TRACE::TIMEOUT, 0, _session_id);
+            _stats->timed_out();
+            if (_retransmit_cnt <= 0 || !_retransmit_ready) {
+                throw IO::timeout_error((int)_socket);
             }
+
+            DBG_printer("retransmiting cnt->", _retransmit_cnt, "id->",
+                        packet_to_string(_last_msg->getID()));
+
+            _retransmit_cnt--;
+            auto sender = _last_msg->getSender(_socket, &_addr);
+            sender.send<connection>();
+            TRACE::record(TRACE::RETRANSMITTED, _last_msg->getID(),
+                          _session_id, packet_number(*_last_msg));
+            _stats->retransmitted(sender.size());
+            _retransmitted = true;
+            to_begin = std::chrono::steady_clock::now();
         }
     }
 };
@@ -5,30 +5,41 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sock_diag.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
 #include <cstring>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <variant>
 #include <vector>
 
 #include "debug.hpp"
 using namespace DEBUG_NS;
 
 #include "protconst.h"
+#include "schema.hpp"
 
 // Operator overload for easy comparison of 2 addresses.
 bool operator==(const sockaddr_in &lhs, const sockaddr_in &rhs) {
@@ -39,28 +50,183 @@ bool operator==(const sockaddr_in &lhs, const sockaddr_in &rhs) {
 namespace IO {
 constexpr int MAX_UDP_PACKET_SIZE = 65'535;
 
+// Kernel timestamps packets with CLOCK_REALTIME.
+using timestamp_t = std::chrono::system_clock::time_point;
+
+timestamp_t to_timestamp(const timespec &ts) {
+    return timestamp_t(std::chrono::duration_cast<timestamp_t::duration>(
+        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+}
+
+// Address of peer or server: IPv4 address and port, or unix socket path
+// for transfers within one host.
+class Address {
+  private:
+    sockaddr_storage _storage{};
+    socklen_t _len{sizeof(sockaddr_storage)};
+
+  public:
+    Address() = default;
+
+    Address(const sockaddr_in &addr) : _len(sizeof(addr)) {
+        std::memcpy(&_storage, &addr, sizeof(addr));
+    }
+
+    static Address unix_path(const std::string &path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Invalid unix socket path: " + path);
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        Address address;
+        std::memcpy(&address._storage, &addr, sizeof(addr));
+        address._len = (socklen_t)(offsetof(sockaddr_un, sun_path) +
+                                   path.size() + 1);
+        return address;
+    }
+
+    // Paths contain slash, so that they aren't taken for host names.
+    static bool is_path(const std::string &string) {
+        return string.find('/') != std::string::npos;
+    }
+
+    sockaddr *get() { return (sockaddr *)&_storage; }
+    const sockaddr *get() const { return (const sockaddr *)&_storage; }
+    socklen_t size() const { return _len; }
+    // Sets size after kernel wrote address (up to sockaddr_storage).
+    void resize(socklen_t len) { _len = len; }
+    sa_family_t family() const { return _storage.ss_family; }
+
+    const sockaddr_in &in() const { return *(const sockaddr_in *)&_storage; }
+
+    const sockaddr_un &un() const { return *(const sockaddr_un *)&_storage; }
+
+    // Unix path, empty for unnamed sockets, starting with @ for abstract
+    // ones.
+    std::string path() const {
+        size_t len = _len - std::min<size_t>(_len, offsetof(sockaddr_un,
+                                                            sun_path));
+        if (len == 0) {
+            return "";
+        }
+        if (un().sun_path[0] == 0) {
+            return "@" + std::string(un().sun_path + 1, len - 1);
+        }
+        return std::string(un().sun_path, strnlen(un().sun_path, len));
+    }
+
+    bool operator==(const Address &other) const {
+        if (family() != other.family()) {
+            return false;
+        }
+        if (family() == AF_INET) {
+            return in() == other.in();
+        }
+        return _len == other._len &&
+               std::memcmp(&_storage, &other._storage, _len) == 0;
+    }
+
+    bool operator<(const Address &other) const {
+        if (family() != other.family()) {
+            return family() < other.family();
+        }
+        if (family() == AF_INET) {
+            return std::tie(in().sin_addr.s_addr, in().sin_port) <
+                   std::tie(other.in().sin_addr.s_addr, other.in().sin_port);
+        }
+        return path() < other.path();
+    }
+
+    std::string to_string() const {
+        if (family() != AF_INET) {
+            return path();
+        }
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in().sin_addr, addr, sizeof(addr));
+        return std::string(addr) + ":" + std::to_string(ntohs(in().sin_port));
+    }
+};
+
+// Messages of errors below are built only when they're asked for, as most
+// of them are caught without it.
 class timeout_error : public std::exception {
   private:
     int _fd;
-    std::string _msg;
+    mutable std::string _msg;
 
   public:
-    timeout_error(int fd)
-        : _fd(fd),
-          _msg("Socket on descriptor " + std::to_string(_fd) + " timed out") {}
-    const char *what() const throw() { return _msg.c_str(); }
+    timeout_error(int fd) : _fd(fd) {}
+    const char *what() const throw() {
+        if (_msg.empty()) {
+            _msg = "Socket on descriptor " + std::to_string(_fd) +
+                   " timed out";
+        }
+        return _msg.c_str();
+    }
 };
 
 class packet_smaller_than_expected : public std::exception {
   private:
     int _fd;
-    std::string _msg;
+    mutable std::string _msg;
 
   public:
-    packet_smaller_than_expected(int fd)
-        : _fd(fd), _msg("Packet readed from descriptor " + std::to_string(_fd) +
-                        " has less bytes than expected") {}
-    const char *what() const throw() { return _msg.c_str(); }
+    packet_smaller_than_expected(int fd) : _fd(fd) {}
+    const char *what() const throw() {
+        if (_msg.empty()) {
+            _msg = "Packet readed from descriptor " + std::to_string(_fd) +
+                   " has less bytes than expected";
+        }
+        return _msg.c_str();
+    }
+};
+
+// Failures that are part of normal operation of lossy transport. Receive
+// path returns them instead of throwing, only fatal errors are thrown.
+enum class failure_t { timeout, too_short };
+
+// Value or failure, in manner of C++23 std::expected.
+template <class T> class Expected {
+  private:
+    std::variant<T, failure_t> _value;
+
+  public:
+    Expected(T value) : _value(std::move(value)) {}
+    Expected(failure_t failure) : _value(failure) {}
+
+    bool has_value() const { return _value.index() == 0; }
+    explicit operator bool() const { return has_value(); }
+
+    T &operator*() { return *std::get_if<T>(&_value); }
+    T *operator->() { return std::get_if<T>(&_value); }
+
+    failure_t error() const { return *std::get_if<failure_t>(&_value); }
+
+    // Value, failure is thrown as exception of socket fd.
+    T &value(int fd) {
+        if (!has_value()) {
+            if (error() == failure_t::timeout) {
+                throw timeout_error(fd);
+            }
+            throw packet_smaller_than_expected(fd);
+        }
+        return **this;
+    }
+};
+
+// Byte stream that replaces stream socket for packets once it's attached to
+// socket (e.g. shared memory channel).
+class Stream {
+  public:
+    virtual void write(const char *data, size_t len) = 0;
+
+    // Reads exactly len bytes, throws timeout_error after deadline.
+    virtual void
+    read(char *data, size_t len,
+         std::optional<std::chrono::steady_clock::time_point> deadline) = 0;
+
+    virtual ~Stream() = default;
 };
 
 // Socket wrapper for easier interface.
@@ -82,7 +248,10 @@ class Socket {
         RCVLOWAT = SO_RCVLOWAT,
         RCVTIMEO = SO_RCVTIMEO,
         SNDLOWAT = SO_SNDLOWAT,
-        SNDTIMEO = SO_SNDTIMEO
+        SNDTIMEO = SO_SNDTIMEO,
+        MAX_PACING_RATE = SO_MAX_PACING_RATE,
+        TIMESTAMPNS = SO_TIMESTAMPNS,
+        TIMESTAMPING = SO_TIMESTAMPING
     };
 
   private:
@@ -95,7 +264,52 @@ class Socket {
                                     }};
     connection_t _type;
 
+    // Settings shared by copies of socket.
+    struct State {
+        // Datagrams sent, kernel numbers TX timestamps the same way
+        // (SOF_TIMESTAMPING_OPT_ID), so that they can be matched with packets.
+        std::atomic<uint32_t> _sent{0};
+        bool _tx_timestamps{false};
+        std::chrono::nanoseconds _busy_poll{0};
+        bool _drop_when_full{false};
+        std::shared_ptr<Stream> _stream;
+        // Descriptors received with data (SCM_RIGHTS) and not taken yet.
+        std::vector<int> _fds;
+
+        ~State() {
+            for (int fd : _fds) {
+                close(fd);
+            }
+        }
+    };
+    std::shared_ptr<State> _state{std::make_shared<State>()};
+
   public:
+    void bind(const Address &address) {
+        if (::bind(*_socket_fd, address.get(), address.size()) < 0) {
+            throw std::runtime_error(std::string("Couldn't bind socket: ") +
+                                     std::strerror(errno));
+        }
+    }
+
+    // Binds unix socket to abstract address picked by kernel, so that it
+    // can receive replies to datagrams.
+    void autobind() {
+        sa_family_t family = AF_UNIX;
+        if (::bind(*_socket_fd, (sockaddr *)&family, sizeof(family)) < 0) {
+            throw std::runtime_error(std::string("Couldn't bind socket: ") +
+                                     std::strerror(errno));
+        }
+    }
+
+    // Accepts connection and writes address of peer, returns -1 on error.
+    int accept(Address &peer) {
+        socklen_t len = sizeof(sockaddr_storage);
+        int fd = ::accept(*_socket_fd, peer.get(), &len);
+        peer.resize(len);
+        return fd;
+    }
+
     void bind(uint16_t port) {
         struct sockaddr_in server_address;
         server_address.sin_family = AF_INET; // IPv4
@@ -123,6 +337,16 @@ class Socket {
         }
     }
 
+    void setIpOption(int opt, const void *option_value, socklen_t opt_len) {
+        int ret =
+            ::setsockopt(*_socket_fd, IPPROTO_IP, opt, option_value, opt_len);
+        if (ret == -1) {
+            throw std::runtime_error(
+                std::string("Couldn't set ip socket option: ") +
+                std::strerror(errno));
+        }
+    }
+
     void setRecvTimeout(int64_t millis) {
         timeval timeout;
         timeout.tv_sec = millis / 1000;
@@ -139,6 +363,119 @@ class Socket {
 
     void resetRecvTimeout() { setRecvTimeout(0); }
 
+    // Free part of receive buffer. Kernel charges it with memory of queued
+    // datagrams, including their metadata.
+    size_t receiveSpace() const {
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+        if (getsockopt(*_socket_fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) <
+            0) {
+            throw std::runtime_error(
+                std::string("Couldn't read socket memory: ") +
+                std::strerror(errno));
+        }
+        return meminfo[SK_MEMINFO_RCVBUF] -
+               std::min(meminfo[SK_MEMINFO_RMEM_ALLOC],
+                        meminfo[SK_MEMINFO_RCVBUF]);
+    }
+
+    // Makes kernel timestamp received packets and, if tx is set and it's
+    // supported, sent datagrams. TX timestamps have to be read with
+    // readTxTimestamp, until then socket polls with POLLERR.
+    void enableTimestamps(bool tx) {
+        int on = 1;
+        setsockopt(TIMESTAMPNS, &on, sizeof(on));
+        int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                    SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        if (tx && ::setsockopt(*_socket_fd, SOL_SOCKET, TIMESTAMPING, &flags,
+                               sizeof(flags)) == 0) {
+            _state->_sent = 0;
+            _state->_tx_timestamps = true;
+        }
+    }
+
+    bool txTimestamps() const { return _state->_tx_timestamps; }
+
+    // Number of TX timestamp of next sent datagram.
+    uint32_t txKey() const {
+        return _state->_sent.load(std::memory_order_relaxed);
+    }
+
+    void datagramSent() {
+        _state->_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Receiving spins on non-blocking reads for up to spin before it blocks,
+    // kernel also busy polls device queue (SO_BUSY_POLL) if process is
+    // permitted to set it.
+    void setBusyPoll(std::chrono::microseconds spin) {
+        int us = (int)spin.count();
+        ::setsockopt(*_socket_fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+        _state->_busy_poll = spin;
+    }
+
+    std::chrono::nanoseconds busyPoll() const { return _state->_busy_poll; }
+
+    // Datagrams that don't fit in queue of receiver are dropped, as UDP
+    // would do, instead of waiting for it. Unix datagram sockets wait, which
+    // deadlocks two peers that both send faster than they read, so one of
+    // them has to drop.
+    void dropWhenFull() { _state->_drop_when_full = true; }
+
+    bool dropsWhenFull() const { return _state->_drop_when_full; }
+
+    // Packets are sent and received through stream from now on, socket only
+    // stays connected.
+    void attach(std::shared_ptr<Stream> stream) {
+        _state->_stream = std::move(stream);
+    }
+
+    Stream *stream() const { return _state->_stream.get(); }
+
+    void receivedFds(const int *fds, size_t cnt) {
+        _state->_fds.insert(_state->_fds.end(), fds, fds + cnt);
+    }
+
+    // Caller owns returned descriptors.
+    std::vector<int> takeFds() { return std::exchange(_state->_fds, {}); }
+
+    // Takes next TX timestamp from error queue, false if there is none.
+    bool readTxTimestamp(uint32_t &key, timestamp_t &time) {
+        while (true) {
+            alignas(cmsghdr) char control[256];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(*_socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                return false;
+            }
+
+            std::optional<timestamp_t> sent;
+            std::optional<uint32_t> number;
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                 cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                    scm_timestamping ts;
+                    std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                    sent = to_timestamp(ts.ts[0]);
+                } else if (cmsg->cmsg_level == SOL_IP &&
+                           cmsg->cmsg_type == IP_RECVERR) {
+                    sock_extended_err err;
+                    std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                    if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                        number = err.ee_data;
+                    }
+                }
+            }
+            if (sent && number) {
+                key = *number;
+                time = *sent;
+                return true;
+            }
+        }
+    }
+
     void resetSendTimeout() { setSendTimeout(0); }
 
     operator int() const { return *_socket_fd; }
@@ -167,8 +504,66 @@ class Socket {
     }
 };
 
+// Polls socket without waiting for its busy poll time, at most timeout,
+// which is decreased by time spent.
+bool spin_readable(Socket &socket, std::chrono::nanoseconds &timeout) {
+    if (socket.busyPoll() == socket.busyPoll().zero()) {
+        return false;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    auto end = begin + std::min(socket.busyPoll(), timeout);
+    auto now = begin;
+    do {
+        pollfd pfd{(int)socket, POLLIN, 0};
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+            return true;
+        }
+        now = std::chrono::steady_clock::now();
+    } while (now < end);
+    timeout = std::max(timeout - (now - begin), timeout.zero());
+    return false;
+}
+
+// Waits up to timeout millis for data on socket, returns false on timeout.
+// Also returns false early when only error queue (TX timestamps) is ready.
+bool wait_readable(Socket &socket, int timeout) {
+    std::chrono::nanoseconds left = timeout < 0
+                                        ? std::chrono::nanoseconds::max()
+                                        : std::chrono::milliseconds(timeout);
+    if (spin_readable(socket, left)) {
+        return true;
+    }
+    pollfd pfd{(int)socket, POLLIN, 0};
+    int ret = poll(
+        &pfd, 1,
+        timeout < 0
+            ? -1
+            : (int)std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    if (ret < 0 && errno != EINTR) {
+        throw std::runtime_error(std::string("poll failed: ") +
+                                 std::strerror(errno));
+    }
+    return ret > 0 && (pfd.revents & POLLIN);
+}
+
+// Same as above with sub-millisecond timeout.
+bool wait_readable(Socket &socket, std::chrono::nanoseconds timeout) {
+    if (spin_readable(socket, timeout)) {
+        return true;
+    }
+    pollfd pfd{(int)socket, POLLIN, 0};
+    timespec ts{(time_t)(timeout.count() / 1'000'000'000),
+                (long)(timeout.count() % 1'000'000'000)};
+    int ret = ppoll(&pfd, 1, &ts, nullptr);
+    if (ret < 0 && errno != EINTR) {
+        throw std::runtime_error(std::string("poll failed: ") +
+                                 std::strerror(errno));
+    }
+    return ret > 0 && (pfd.revents & POLLIN);
+}
+
 // Helper functions for template pack parameter operations.
-template <class Arg> Arg read_single_var(char *buffor) {
+template <class Arg> Arg read_single_var(const char *buffor) {
     Arg var;
     std::memcpy(&var, buffor, sizeof(Arg));
     return var;
@@ -188,6 +583,11 @@ class PacketReaderBase {
     // Move packet buffor pointer to begining.
     virtual PacketReaderBase &mtb() = 0;
 
+    // Time when kernel received packet, if socket timestamps packets.
+    virtual std::optional<timestamp_t> timestamp() const {
+        return std::nullopt;
+    }
+
     // Returns vector with n next bytes.
     std::vector<char> readn(ssize_t n) {
         std::vector<char> buffor(n);
@@ -195,12 +595,19 @@ class PacketReaderBase {
         return buffor;
     }
 
+    // Reads fixed part of packet from its beginning in one piece.
+    template <class Layout> typename Layout::values_t readLayout() {
+        char buffor[Layout::SIZE];
+        mtb().readn(buffor, Layout::SIZE);
+        return Layout::decode(buffor);
+    }
+
     // Returns tuple with template types readed from bufor.
     template <class... Args> std::tuple<Args...> readGeneric() {
-        ssize_t len = (sizeof(Args) + ... + 0);
-        auto buffor = readn(len);
+        char buffor[(sizeof(Args) + ...)];
+        readn(buffor, (ssize_t)sizeof(buffor));
 
-        char *offset = buffor.data();
+        char *offset = buffor;
         return {read_single_var<Args>(increment(offset, sizeof(Args)) -
                                       sizeof(Args))...};
     }
@@ -218,36 +625,79 @@ template <> class PacketReader<Socket::TCP> : public PacketReaderBase {
     std::chrono::steady_clock::time_point _timeout_begin;
     bool _needs_timeout;
 
+    static constexpr size_t MAX_RECEIVED_FDS = 8;
+
+    // Receives bytes and descriptors passed with them.
+    ssize_t receive(char *buff, ssize_t len) {
+        iovec iov{buff, (size_t)len};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                                 MAX_RECEIVED_FDS)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t ret = recvmsg(_socket, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS) {
+                int fds[MAX_RECEIVED_FDS];
+                size_t cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                std::memcpy(fds, CMSG_DATA(cmsg), cnt * sizeof(int));
+                _socket.receivedFds(fds, cnt);
+            }
+        }
+        return ret;
+    }
+
+    // Reads from stream attached to socket.
+    void read_stream(Stream &stream, ssize_t old_buff_size, ssize_t to_read) {
+        std::optional<std::chrono::steady_clock::time_point> deadline;
+        if (_needs_timeout) {
+            deadline = _timeout_begin + std::chrono::seconds(MAX_WAIT);
+        }
+        try {
+            stream.read(&_buff[old_buff_size], to_read, deadline);
+        } catch (...) {
+            _buff.resize(old_buff_size);
+            throw;
+        }
+    }
+
   public:
-    PacketReader(Socket &socket, sockaddr_in *, bool needs_timeout = true,
+    PacketReader(Socket &socket, Address *, bool needs_timeout = true,
                  std::chrono::steady_clock::time_point timeout_begin =
                      std::chrono::steady_clock::now())
         : _socket{socket}, _buff(0), _next_byte(0),
           _timeout_begin(timeout_begin), _needs_timeout{needs_timeout} {}
 
     void readn(void *buff, ssize_t n) {
-        if (_needs_timeout) {
-            int64_t timeout =
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::steady_clock::now() - _timeout_begin)
-                    .count();
-            if (MAX_WAIT * 1000 - timeout <= 0) {
-                throw timeout_error((int)_socket);
-            }
-
-            _socket.setRecvTimeout(MAX_WAIT * 1000 - timeout);
-        } else {
-            _socket.resetRecvTimeout();
-        }
-
         ssize_t old_buff_size = _buff.size();
         ssize_t to_read = n + _next_byte - old_buff_size;
 
-        if (0 < to_read) {
+        if (0 < to_read && _socket.stream()) {
             _buff.resize(old_buff_size + to_read);
+            read_stream(*_socket.stream(), old_buff_size, to_read);
+        } else if (0 < to_read) {
+            if (_needs_timeout) {
+                int64_t timeout =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - _timeout_begin)
+                        .count();
+                if (MAX_WAIT * 1000 - timeout <= 0) {
+                    throw timeout_error((int)_socket);
+                }
 
-            ssize_t ret = recvfrom(_socket, &_buff[old_buff_size], to_read,
-                                   MSG_WAITALL, NULL, NULL);
+                _socket.setRecvTimeout(MAX_WAIT * 1000 - timeout);
+            } else {
+                _socket.resetRecvTimeout();
+            }
+
+            _buff.resize(old_buff_size + to_read);
+
+            ssize_t ret = receive(&_buff[old_buff_size], to_read);
 
             if (_needs_timeout) {
                 _socket.resetRecvTimeout();
@@ -260,7 +710,7 @@ template <> class PacketReader<Socket::TCP> : public PacketReaderBase {
                 _buff.resize(old_buff_size + ret);
                 throw std::runtime_error(
                     std::string(
-                        "Failed to read packet (tcp) (recvfrom error): ") +
+                        "Failed to read packet (tcp) (recvmsg error): ") +
                     std::strerror(errno));
             } else if (ret != to_read) {
                 _buff.resize(old_buff_size + ret);
@@ -282,20 +732,58 @@ template <> class PacketReader<Socket::UDP> : public PacketReaderBase {
   private:
     Socket &_socket;
     std::vector<char> _buff;
+    ssize_t _len{0};
     ssize_t _bytes_readed{0};
+    std::optional<timestamp_t> _timestamp;
+
+    // Buffers of destroyed readers are reused, so that receiving datagram
+    // neither allocates nor clears MAX_UDP_PACKET_SIZE bytes.
+    static constexpr size_t MAX_POOLED_BUFFERS = 8;
+    static std::vector<std::vector<char>> &pool() {
+        static thread_local std::vector<std::vector<char>> buffers;
+        return buffers;
+    }
 
-  public:
-    PacketReader(Socket &socket, sockaddr_in *addr, bool needs_timeout = true,
-                 std::chrono::steady_clock::time_point timeout_begin =
-                     std::chrono::steady_clock::now())
-        : _socket{socket}, _buff(MAX_UDP_PACKET_SIZE) {
+    static std::vector<char> take_buffer() {
+        auto &buffers = pool();
+        if (buffers.empty()) {
+            return std::vector<char>(MAX_UDP_PACKET_SIZE);
+        }
+        std::vector<char> buffer = std::move(buffers.back());
+        buffers.pop_back();
+        return buffer;
+    }
+
+    // Non-blocking reads for busy poll time of socket, -1 if none succeeded.
+    ssize_t spin(msghdr &msg, bool needs_timeout,
+                 std::chrono::steady_clock::time_point timeout_begin) {
+        if (_socket.busyPoll() == _socket.busyPoll().zero()) {
+            return -1;
+        }
+        auto end = std::chrono::steady_clock::now() + _socket.busyPoll();
+        if (needs_timeout) {
+            end = std::min(end, timeout_begin + std::chrono::seconds(MAX_WAIT));
+        }
+        do {
+            ssize_t ret = recvmsg(_socket, &msg, MSG_DONTWAIT);
+            if (ret >= 0) {
+                return ret;
+            }
+        } while (std::chrono::steady_clock::now() < end);
+        return -1;
+    }
+
+    // Blocking read, nullopt on timeout.
+    std::optional<ssize_t>
+    receive(msghdr &msg, bool needs_timeout,
+            std::chrono::steady_clock::time_point timeout_begin) {
         if (needs_timeout) {
             int64_t timeout =
                 std::chrono::duration_cast<std::chrono::milliseconds>(
                     std::chrono::steady_clock::now() - timeout_begin)
                     .count();
             if (MAX_WAIT * 1000 - timeout <= 0) {
-                throw timeout_error((int)_socket);
+                return std::nullopt;
             }
 
             _socket.setRecvTimeout(MAX_WAIT * 1000 - timeout);
@@ -303,15 +791,13 @@ template <> class PacketReader<Socket::UDP> : public PacketReaderBase {
             _socket.resetRecvTimeout();
         }
 
-        socklen_t address_length = sizeof(addr);
-        ssize_t ret = recvfrom(_socket, _buff.data(), MAX_UDP_PACKET_SIZE,
-                               MSG_WAITALL, (sockaddr *)addr, &address_length);
+        ssize_t ret = recvmsg(_socket, &msg, MSG_WAITALL);
 
         if (needs_timeout) {
             _socket.resetRecvTimeout();
 
             if (ret == -1 && (errno == ETIMEDOUT || errno == EAGAIN)) {
-                throw timeout_error((int)_socket);
+                return std::nullopt;
             }
         }
 
@@ -319,12 +805,108 @@ template <> class PacketReader<Socket::UDP> : public PacketReaderBase {
             throw std::runtime_error(std::string("Failed to read packet: ") +
                                      std::strerror(errno));
         }
+        return ret;
+    }
+
+    struct unreceived_t {};
+
+    PacketReader(Socket &socket, unreceived_t)
+        : _socket{socket}, _buff(take_buffer()) {}
+
+    // Receives datagram into buffer, false on timeout.
+    bool receive_datagram(Address *addr, bool needs_timeout,
+                          std::chrono::steady_clock::time_point timeout_begin) {
+        iovec iov{_buff.data(), MAX_UDP_PACKET_SIZE};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec)) +
+                                      CMSG_SPACE(sizeof(scm_timestamping))];
+        msghdr msg{};
+        msg.msg_name = addr ? addr->get() : nullptr;
+        msg.msg_namelen = addr ? sizeof(sockaddr_storage) : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t ret = spin(msg, needs_timeout, timeout_begin);
+        if (ret < 0) {
+            auto received = receive(msg, needs_timeout, timeout_begin);
+            if (!received) {
+                return false;
+            }
+            ret = *received;
+        }
+
+        _len = ret;
+        if (addr) {
+            addr->resize(msg.msg_namelen);
+        }
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts;
+                std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                _timestamp = to_timestamp(ts);
+            }
+        }
+        return true;
+    }
+
+  public:
+    PacketReader(Socket &socket, Address *addr, bool needs_timeout = true,
+                 std::chrono::steady_clock::time_point timeout_begin =
+                     std::chrono::steady_clock::now())
+        : PacketReader(socket, unreceived_t{}) {
+        if (!receive_datagram(addr, needs_timeout, timeout_begin)) {
+            throw timeout_error((int)_socket);
+        }
+    }
 
-        _buff.resize(ret);
+    // Receives datagram like constructor, but timeout and datagram shorter
+    // than min_len (e.g. header of packet) are returned.
+    static Expected<std::unique_ptr<PacketReader>>
+    try_receive(Socket &socket, Address *addr, size_t min_len,
+                bool needs_timeout = true,
+                std::chrono::steady_clock::time_point timeout_begin =
+                    std::chrono::steady_clock::now()) {
+        std::unique_ptr<PacketReader> reader(
+            new PacketReader(socket, unreceived_t{}));
+        if (!reader->receive_datagram(addr, needs_timeout, timeout_begin)) {
+            return failure_t::timeout;
+        }
+        if (reader->size() < min_len) {
+            return failure_t::too_short;
+        }
+        return reader;
+    }
+
+    // Reads datagram received before and kept by caller.
+    PacketReader(Socket &socket, const std::vector<char> &datagram)
+        : _socket{socket}, _buff(take_buffer()),
+          _len((ssize_t)datagram.size()) {
+        std::memcpy(_buff.data(), datagram.data(), datagram.size());
+    }
+
+    PacketReader(const PacketReader &) = delete;
+    PacketReader &operator=(const PacketReader &) = delete;
+
+    ~PacketReader() {
+        if (pool().size() < MAX_POOLED_BUFFERS) {
+            pool().push_back(std::move(_buff));
+        }
+    }
+
+    std::optional<timestamp_t> timestamp() const { return _timestamp; }
+
+    size_t size() const { return (size_t)_len; }
+
+    // Copy of whole datagram, to be read again later.
+    std::vector<char> datagram() const {
+        return std::vector<char>(_buff.begin(), _buff.begin() + _len);
     }
 
     void readn(void *buff, ssize_t n) {
-        if (n <= (ssize_t)_buff.size() - _bytes_readed) {
+        if (n <= _len - _bytes_readed) {
             std::memcpy(buff, _buff.data() + _bytes_readed, n);
             _bytes_readed += n;
         } else {
@@ -340,15 +922,19 @@ template <> class PacketReader<Socket::UDP> : public PacketReaderBase {
 
 // Base function used to send data over socket.
 template <Socket::connection_t C>
-void send_n(Socket &socket, sockaddr_in *addr, char *buffor, ssize_t len);
+void send_n(Socket &socket, Address *addr, char *buffor, ssize_t len);
 
+// Stream sockets are connected, unix ones reject address given with data.
 template <>
-void send_n<Socket::TCP>(Socket &socket, sockaddr_in *addr, char *buffor,
+void send_n<Socket::TCP>(Socket &socket, Address *, char *buffor,
                          ssize_t len) {
+    if (Stream *stream = socket.stream()) {
+        stream->write(buffor, len);
+        return;
+    }
     ssize_t sent = 0;
     while (sent != len) {
-        ssize_t ret = sendto((int)socket, buffor + sent, len - sent, 0,
-                             (sockaddr *)addr, (socklen_t)sizeof(addr));
+        ssize_t ret = send((int)socket, buffor + sent, len - sent, 0);
 
         if (ret <= 0) {
             throw std::runtime_error(
@@ -360,7 +946,7 @@ void send_n<Socket::TCP>(Socket &socket, sockaddr_in *addr, char *buffor,
 }
 
 template <>
-void send_n<Socket::UDP>(Socket &socket, sockaddr_in *addr, char *buffor,
+void send_n<Socket::UDP>(Socket &socket, Address *addr, char *buffor,
                          ssize_t len) {
     if (len > MAX_UDP_PACKET_SIZE) {
         throw std::runtime_error(
@@ -368,9 +954,13 @@ void send_n<Socket::UDP>(Socket &socket, sockaddr_in *addr, char *buffor,
             std::to_string(len) + std::string("/") +
             std::to_string(MAX_UDP_PACKET_SIZE));
     }
-    ssize_t ret = sendto((int)socket, buffor, len, 0, (sockaddr *)addr,
-                         (socklen_t)sizeof(sockaddr));
+    ssize_t ret = sendto((int)socket, buffor, len,
+                         socket.dropsWhenFull() ? MSG_DONTWAIT : 0, addr->get(),
+                         addr->size());
 
+    if (ret < 0 && socket.dropsWhenFull() && errno == EAGAIN) {
+        return;
+    }
     if (ret <= 0) {
         throw std::runtime_error(std::string("UDP failed to send packet: ") +
                                  std::strerror(errno));
@@ -380,11 +970,37 @@ void send_n<Socket::UDP>(Socket &socket, sockaddr_in *addr, char *buffor,
         throw std::runtime_error(
             std::string("UDP failed to send all data in one packet: "));
     }
+    socket.datagramSent();
+}
+
+// Sends bytes over unix stream socket with descriptors attached to them.
+void send_fds(Socket &socket, char *buffor, ssize_t len,
+              const std::vector<int> &fds) {
+    iovec iov{buffor, (size_t)len};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    ssize_t ret = sendmsg((int)socket, &msg, 0);
+    if (ret <= 0) {
+        throw std::runtime_error(
+            std::string("Failed to send descriptors: ") +
+            std::strerror(errno));
+    }
+    send_n<Socket::TCP>(socket, nullptr, buffor + ret, len - ret);
 }
 
 // Sends argument variables over socket.
 template <Socket::connection_t C, class... Args>
-void send_v(Socket &socket, sockaddr_in *addr, Args... args) {
+void send_v(Socket &socket, Address *addr, Args... args) {
     ssize_t len = (sizeof(Args) + ... + 0);
     std::vector<char> buffor(len);
     ssize_t offset = 0;
@@ -401,10 +1017,10 @@ class PacketSender {
   private:
     Socket &_socket;
     std::vector<char> _buffor;
-    sockaddr_in *_addr;
+    Address *_addr;
 
   public:
-    PacketSender(Socket &socket, sockaddr_in *addr)
+    PacketSender(Socket &socket, Address *addr)
         : _socket(socket), _buffor(0), _addr(addr) {}
 
     PacketSender &add_data(const void *data, size_t len) {
@@ -429,9 +1045,27 @@ class PacketSender {
         return *this;
     }
 
+    // Appends fixed part of packet, reserving space for extra bytes that
+    // follow it.
+    template <class Layout>
+    PacketSender &add_layout(const typename Layout::values_t &values,
+                             size_t extra = 0) {
+        size_t offset = _buffor.size();
+        _buffor.reserve(offset + Layout::SIZE + extra);
+        _buffor.resize(offset + Layout::SIZE);
+        Layout::encode(_buffor.data() + offset, values);
+        return *this;
+    }
+
+    size_t size() const { return _buffor.size(); }
+
     template <Socket::connection_t C> void send() {
         send_n<C>(_socket, _addr, _buffor.data(), _buffor.size());
     }
+
+    void send_fds(const std::vector<int> &fds) {
+        IO::send_fds(_socket, _buffor.data(), _buffor.size(), fds);
+    }
 };
 
 // Functions from labs with added exceptions.
@@ -457,6 +1091,28 @@ size_t read_size(char const *string) {
     return number;
 }
 
+// Pins calling thread, and threads it starts later, to one CPU.
+void pin_to_cpu(size_t cpu) {
+    if (cpu >= CPU_SETSIZE) {
+        throw std::runtime_error("Couldn't pin to CPU " + std::to_string(cpu));
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        throw std::runtime_error("Couldn't pin to CPU " + std::to_string(cpu));
+    }
+}
+
+// Busy poll time of low-latency mode, in microseconds.
+std::chrono::microseconds read_busy_poll(char const *string) {
+    size_t us = read_size(string);
+    if (us > 1'000'000) {
+        throw std::runtime_error("Busy poll time can be at most 1000000 us");
+    }
+    return std::chrono::microseconds(us);
+}
+
 struct sockaddr_in get_server_address(char const *host, uint16_t port) {
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
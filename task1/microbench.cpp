@@ -0,0 +1,265 @@
+#include "common.hpp"
+#include "interface.hpp"
+#include "io.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// Microbenchmarks of packet codec and Session hot path. Every benchmark
+// reports time and heap allocations per packet. Sockets are UDP pair on
+// loopback, as codec passes address to sendto, which socketpair
+// sockets reject.
+
+using namespace PPCB;
+
+static uint64_t allocations = 0;
+
+// Not inlined, as gcc takes malloc and free inlined next to new and delete
+// for mismatched pairs.
+[[gnu::noinline]] void *operator new(size_t size) {
+    allocations++;
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+[[gnu::noinline]] void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+// Keeps compiler from dropping computation of value.
+template <class T> void keep(T &&value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Accumulates time and allocations of measured parts of benchmark.
+class Meter {
+  private:
+    using clock = std::chrono::steady_clock;
+    clock::time_point _begin;
+    uint64_t _allocations_begin{0};
+    clock::duration _elapsed{0};
+    uint64_t _allocations{0};
+
+  public:
+    void start() {
+        _allocations_begin = allocations;
+        _begin = clock::now();
+    }
+
+    void stop() {
+        _elapsed += clock::now() - _begin;
+        _allocations += allocations - _allocations_begin;
+    }
+
+    void report(const std::string &name, size_t packet_size,
+                size_t packets) const {
+        std::cout << "microbench: name=" << name
+                  << " packet_size=" << packet_size << " ns_per_packet="
+                  << (double)std::chrono::duration_cast<
+                         std::chrono::nanoseconds>(_elapsed)
+                             .count() /
+                         (double)packets
+                  << " allocs_per_packet="
+                  << (double)_allocations / (double)packets << "\n";
+    }
+};
+
+struct SocketPair {
+    IO::Socket _sender{IO::Socket::UDP};
+    IO::Socket _receiver{IO::Socket::UDP};
+    IO::Address _to;
+
+    SocketPair() {
+        _receiver.bind(0);
+        sockaddr_in to;
+        socklen_t len = sizeof(to);
+        getsockname((int)_receiver, (sockaddr *)&to, &len);
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        _to = to;
+        int size = 1 << 22;
+        _receiver.setsockopt(IO::Socket::RCVBUF, &size, sizeof(size));
+    }
+
+    // Drops all datagrams waiting at receiver.
+    void drain() {
+        static std::vector<char> buffer(IO::MAX_UDP_PACKET_SIZE);
+        while (recv((int)_receiver, buffer.data(), buffer.size(),
+                    MSG_DONTWAIT) > 0) {
+        }
+    }
+};
+
+// Packets are sent and received in bursts of at most that many packets,
+// fewer if burst wouldn't fit in receive buffer kernel granted.
+constexpr size_t MAX_BURST = 256;
+
+int main(int argc, char *argv[]) {
+    try {
+        size_t packets = argc > 1 ? IO::read_size(argv[1]) : 200'000;
+        size_t packet_size = argc > 2 ? IO::read_size(argv[2])
+                                      : (size_t)OPTIMAL_DATA_SIZE;
+        if (packets == 0 || packet_size == 0 || packet_size > MAX_DATA_SIZE) {
+            throw std::runtime_error(
+                "Usage: [<packets> [<packet size up to " +
+                std::to_string(MAX_DATA_SIZE) + ">]]");
+        }
+        SocketPair pair;
+        size_t space = pair._receiver.receiveSpace();
+        size_t truesize =
+            datagram_truesize(Packet<DATA>::layout::SIZE + packet_size);
+        size_t burst = std::min(MAX_BURST, space / truesize);
+        if (burst == 0) {
+            throw std::runtime_error(
+                "Packet of " + std::to_string(packet_size) +
+                " bytes doesn't fit in receive buffer of " +
+                std::to_string(space) + " bytes");
+        }
+        packets = (packets + burst - 1) / burst * burst;
+
+        session_t session_id = session_id_generate();
+        std::vector<char> data(packet_size, 'x');
+        Packet<DATA> packet(session_id, 7, packet_size, data);
+
+        {
+            Meter meter;
+            meter.start();
+            for (size_t i = 0; i < packets; i++) {
+                auto sender = packet.getSender(pair._sender, &pair._to);
+                keep(sender);
+            }
+            meter.stop();
+            meter.report("data_encode", packet_size, packets);
+        }
+
+        {
+            Meter meter;
+            for (size_t i = 0; i < packets; i += burst) {
+                meter.start();
+                for (size_t j = 0; j < burst; j++) {
+                    packet.getSender(pair._sender, &pair._to)
+                        .send<IO::Socket::UDP>();
+                }
+                meter.stop();
+                pair.drain();
+            }
+            meter.report("data_encode_send", packet_size, packets);
+        }
+
+        {
+            Meter meter;
+            for (size_t i = 0; i < packets; i += burst) {
+                for (size_t j = 0; j < burst; j++) {
+                    packet.getSender(pair._sender, &pair._to)
+                        .send<IO::Socket::UDP>();
+                }
+                meter.start();
+                for (size_t j = 0; j < burst; j++) {
+                    IO::Address addr;
+                    IO::PacketReader<IO::Socket::UDP> reader(pair._receiver,
+                                                             &addr);
+                    keep(reader);
+                }
+                meter.stop();
+            }
+            meter.report("udp_receive", packet_size, packets);
+        }
+
+        {
+            // Deadline passed already, only reporting of timeout is measured.
+            auto expired = std::chrono::steady_clock::now() -
+                           std::chrono::seconds(MAX_WAIT);
+            Meter returned, thrown;
+            returned.start();
+            for (size_t i = 0; i < packets; i++) {
+                IO::Address addr;
+                auto received = IO::PacketReader<IO::Socket::UDP>::try_receive(
+                    pair._receiver, &addr, Header::SIZE, true, expired);
+                keep(received);
+            }
+            returned.stop();
+            returned.report("timeout_returned", packet_size, packets);
+
+            thrown.start();
+            for (size_t i = 0; i < packets; i++) {
+                try {
+                    IO::Address addr;
+                    IO::PacketReader<IO::Socket::UDP> reader(
+                        pair._receiver, &addr, true, expired);
+                    keep(reader);
+                } catch (IO::timeout_error &e) {
+                    keep(e);
+                }
+            }
+            thrown.stop();
+            thrown.report("timeout_thrown", packet_size, packets);
+        }
+
+        packet.getSender(pair._sender, &pair._to).send<IO::Socket::UDP>();
+        IO::Address addr;
+        std::unique_ptr<IO::PacketReaderBase> reader =
+            std::make_unique<IO::PacketReader<IO::Socket::UDP>>(
+                pair._receiver, &addr);
+
+        {
+            Meter meter;
+            meter.start();
+            for (size_t i = 0; i < packets; i++) {
+                Packet<DATA> decoded(*reader);
+                keep(decoded);
+            }
+            meter.stop();
+            meter.report("data_decode", packet_size, packets);
+        }
+
+        {
+            Meter meter;
+            meter.start();
+            for (size_t i = 0; i < packets; i++) {
+                auto header = reader->readLayout<Header>();
+                keep(header);
+            }
+            meter.stop();
+            meter.report("read_header", packet_size, packets);
+        }
+
+        {
+            Meter meter;
+            meter.start();
+            for (size_t i = 0; i < packets; i++) {
+                bool skip = can_skip<DATA>(reader, 8);
+                keep(skip);
+            }
+            meter.stop();
+            meter.report("can_skip", packet_size, packets);
+        }
+
+        {
+            Session<udpr> session(pair._sender, pair._to, session_id, false);
+            std::vector<char> input(burst * packet_size);
+            Meter meter;
+            for (size_t i = 0; i < packets; i += burst) {
+                File file(session_id, input, packet_size);
+                meter.start();
+                for (size_t j = 0; j < burst; j++) {
+                    session.send(std::make_unique<Packet<DATA>>(
+                        file.get_next_packet()));
+                }
+                meter.stop();
+                pair.drain();
+            }
+            meter.report("session_send", packet_size, packets);
+        }
+    } catch (std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}
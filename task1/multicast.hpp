@@ -0,0 +1,384 @@
+#ifndef MULTICAST_HPP
+#define MULTICAST_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interface.hpp"
+#include "io.hpp"
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// One-to-many transfers. Sender multicasts CONN (as announcement and
+// heartbeat) and DATA to group once, receivers send NACK for missing packets
+// to sender, which repeats them by multicast when several receivers miss
+// them or by unicast otherwise. Receivers confirm complete data with RCVD.
+namespace MULTICAST {
+using namespace PPCB;
+using clock = std::chrono::steady_clock;
+
+constexpr auto ANNOUNCE_INTERVAL = std::chrono::milliseconds(200);
+constexpr auto NACK_INTERVAL = std::chrono::milliseconds(50);
+// Packet is not repaired again by multicast sooner than that.
+constexpr auto REPAIR_HOLDOFF = std::chrono::milliseconds(20);
+// Sender ends when no receiver asked for repair for that long.
+constexpr auto LINGER = std::chrono::seconds(MAX_WAIT);
+// Receiver abandons session when sender is silent for that long.
+constexpr auto RECEIVER_TIMEOUT = std::chrono::seconds(MAX_WAIT);
+// Number of receivers missing packet that makes repair multicast.
+constexpr size_t MULTICAST_REPAIR_MIN = 2;
+constexpr size_t MAX_NACK_RANGES = 256;
+// Limit of packets repeated for single receiver in one feedback round.
+constexpr b_cnt_t MAX_REPAIR_PACKETS = 4096;
+constexpr size_t MAX_PENDING_PACKETS = 1 << 16;
+constexpr int SEND_BURST = 32;
+constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+
+struct MulticastOptions {
+    in_addr iface{htonl(INADDR_ANY)};
+    int ttl{1};
+    // Sender ends after that many receivers confirmed data.
+    std::optional<size_t> receivers;
+};
+
+in_addr read_ip(const std::string &ip) {
+    in_addr addr;
+    if (inet_pton(AF_INET, ip.c_str(), &addr) != 1) {
+        throw std::runtime_error(ip + " is not a valid IPv4 address");
+    }
+    return addr;
+}
+
+class Sender {
+  private:
+    IO::Socket &_socket;
+    IO::Address _group;
+    session_t _session_id;
+    b_cnt_t _total;
+    std::vector<Packet<DATA>> _packets;
+    // Number of packets multicast so far, later ones are not repaired.
+    b_cnt_t _sent{0};
+    std::vector<clock::time_point> _last_repair;
+    std::set<IO::Address> _done;
+    clock::time_point _last_announce;
+    clock::time_point _last_feedback;
+    MulticastOptions _options;
+
+    void announce() {
+        Packet<CONN>(_session_id, mcast, _total)
+            .getSender(_socket, &_group)
+            .send<IO::Socket::UDP>();
+        _last_announce = clock::now();
+    }
+
+    void announce_if_needed() {
+        if (clock::now() - _last_announce >= ANNOUNCE_INTERVAL) {
+            announce();
+        }
+    }
+
+    // Reads feedback available within timeout millis and repairs
+    // requested packets.
+    void process_feedback(int timeout) {
+        std::map<b_cnt_t, std::set<IO::Address>> requests;
+        std::map<IO::Address, b_cnt_t> budgets;
+        while (IO::wait_readable(_socket, timeout)) {
+            timeout = 0;
+            try {
+                IO::Address addr;
+                IO::PacketReader<IO::Socket::UDP> reader(_socket, &addr,
+                                                         false);
+                auto [id, session_id] =
+                    reader.readGeneric<packet_type_t, session_t>();
+                if (session_id != _session_id) {
+                    continue;
+                }
+                reader.mtb();
+
+                if (id == RCVD) {
+                    _done.insert(addr);
+                    DBG_printer("receivers done:", _done.size());
+                } else if (id == NACK) {
+                    _last_feedback = clock::now();
+                    Packet<NACK> nack(reader);
+                    b_cnt_t end = std::min<b_cnt_t>(
+                        _sent,
+                        (b_cnt_t)nack._packet_number +
+                            std::min<b_cnt_t>(nack._cnt, MAX_REPAIR_PACKETS));
+                    b_cnt_t &budget = budgets[addr];
+                    for (b_cnt_t nr = nack._packet_number;
+                         nr < end && budget < MAX_REPAIR_PACKETS; nr++) {
+                        requests[nr].insert(addr);
+                        budget++;
+                    }
+                }
+            } catch (IO::packet_smaller_than_expected &e) {
+                // Incorrect packet, skipping
+            }
+        }
+
+        for (auto &[nr, addrs] : requests) {
+            if (addrs.size() >= MULTICAST_REPAIR_MIN) {
+                if (clock::now() - _last_repair[nr] < REPAIR_HOLDOFF) {
+                    continue;
+                }
+                _packets[nr].getSender(_socket, &_group)
+                    .send<IO::Socket::UDP>();
+                _last_repair[nr] = clock::now();
+            } else {
+                IO::Address addr = *addrs.begin();
+                _packets[nr].getSender(_socket, &addr).send<IO::Socket::UDP>();
+            }
+        }
+    }
+
+    bool all_done() const {
+        return _options.receivers && _done.size() >= *_options.receivers;
+    }
+
+  public:
+    Sender(IO::Socket &socket, IO::Address group, session_t session_id,
+           const std::vector<char> &input, MulticastOptions options)
+        : _socket(socket), _group(group), _session_id(session_id),
+          _total(input.size()), _options(options) {
+        unsigned char ttl = (unsigned char)options.ttl;
+        unsigned char loop = 1;
+        _socket.setIpOption(IP_MULTICAST_IF, &options.iface,
+                            sizeof(options.iface));
+        _socket.setIpOption(IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        _socket.setIpOption(IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+        for (b_cnt_t offset = 0; offset < input.size();
+             offset += OPTIMAL_DATA_SIZE) {
+            b_cnt_t len =
+                std::min<b_cnt_t>(OPTIMAL_DATA_SIZE, input.size() - offset);
+            _packets.emplace_back(
+                session_id, (p_cnt_t)_packets.size(), len,
+                std::vector<char>(input.begin() + offset,
+                                  input.begin() + offset + len));
+        }
+        _last_repair.resize(_packets.size());
+    }
+
+    // Returns number of receivers that confirmed data.
+    size_t run() {
+        announce();
+        for (; _sent < _packets.size(); _sent++) {
+            _packets[_sent].getSender(_socket, &_group).send<IO::Socket::UDP>();
+            if (_sent % SEND_BURST == SEND_BURST - 1) {
+                process_feedback(0);
+                announce_if_needed();
+            }
+        }
+
+        _last_feedback = clock::now();
+        while (!all_done() && clock::now() - _last_feedback < LINGER) {
+            announce_if_needed();
+            process_feedback((int)std::chrono::duration_cast<
+                                 std::chrono::milliseconds>(NACK_INTERVAL)
+                                 .count());
+        }
+        return _done.size();
+    }
+};
+
+class Receiver {
+  private:
+    IO::Socket &_socket;
+    IO::Socket _feedback;
+    Sink &_sink;
+
+    // State of currently received session.
+    struct Transfer {
+        session_t _session_id;
+        IO::Address _sender;
+        std::optional<b_cnt_t> _total;
+        p_cnt_t _next{0};
+        b_cnt_t _written{0};
+        std::map<p_cnt_t, Packet<DATA>> _pending;
+        clock::time_point _last_packet{clock::now()};
+        clock::time_point _last_nack{clock::now()};
+        bool _done{false};
+    };
+    std::optional<Transfer> _transfer;
+
+    void confirm() {
+        Packet<RCVD>(_transfer->_session_id)
+            .getSender(_feedback, &_transfer->_sender)
+            .send<IO::Socket::UDP>();
+    }
+
+    void check_done() {
+        if (_transfer->_total && _transfer->_written == *_transfer->_total &&
+            !_transfer->_done) {
+            _sink.finish();
+            _transfer->_done = true;
+            DBG_printer("multicast session", _transfer->_session_id, "done");
+            confirm();
+        }
+    }
+
+    // Starts receiving new session unless other is in progress.
+    bool accept_session(session_t session_id, IO::Address sender) {
+        if (_transfer && _transfer->_session_id == session_id) {
+            return true;
+        }
+        if (_transfer && !_transfer->_done) {
+            return false;
+        }
+        _transfer.emplace();
+        _transfer->_session_id = session_id;
+        _transfer->_sender = sender;
+        return true;
+    }
+
+    void handle_data(Packet<DATA> data) {
+        auto &transfer = *_transfer;
+        if (transfer._done || data._packet_number < transfer._next ||
+            transfer._pending.size() >= MAX_PENDING_PACKETS) {
+            return;
+        }
+        transfer._pending.emplace(data._packet_number, std::move(data));
+
+        auto it = transfer._pending.begin();
+        while (it != transfer._pending.end() && it->first == transfer._next) {
+            auto &packet = it->second;
+            if (transfer._total &&
+                transfer._written + packet._packet_byte_cnt > *transfer._total) {
+                throw std::runtime_error("Received to much bytes");
+            }
+            _sink.write(packet._data.data(), packet._data.size());
+            transfer._written += packet._packet_byte_cnt;
+            transfer._next++;
+            it = transfer._pending.erase(it);
+        }
+        check_done();
+    }
+
+    void send_nacks() {
+        auto &transfer = *_transfer;
+        transfer._last_nack = clock::now();
+
+        std::vector<Packet<NACK>> nacks;
+        p_cnt_t missing = transfer._next;
+        for (auto &[nr, packet] : transfer._pending) {
+            if (nacks.size() == MAX_NACK_RANGES) {
+                break;
+            }
+            if (missing < nr) {
+                nacks.emplace_back(transfer._session_id, missing, nr - missing);
+            }
+            missing = nr + 1;
+        }
+        if (nacks.size() < MAX_NACK_RANGES) {
+            nacks.emplace_back(transfer._session_id, missing,
+                               Packet<NACK>::ALL_PACKETS);
+        }
+
+        for (auto &nack : nacks) {
+            DBG_printer("sending: ", nack);
+            nack.getSender(_feedback, &transfer._sender)
+                .send<IO::Socket::UDP>();
+        }
+    }
+
+    // Handles packet from group or repair sent directly to receiver.
+    void receive(IO::Socket &socket) {
+        try {
+            IO::Address addr;
+            IO::PacketReader<IO::Socket::UDP> reader(socket, &addr, false);
+            auto [id, session_id] =
+                reader.readGeneric<packet_type_t, session_t>();
+            reader.mtb();
+
+            if (id == CONN) {
+                Packet<CONN> conn(reader);
+                if (conn._protocol == mcast &&
+                    accept_session(session_id, addr)) {
+                    _transfer->_total = conn._data_len;
+                    _transfer->_last_packet = clock::now();
+                    if (_transfer->_done) {
+                        confirm();
+                    }
+                    check_done();
+                }
+            } else if (id == DATA) {
+                Packet<DATA> data(reader);
+                if (accept_session(session_id, addr)) {
+                    _transfer->_last_packet = clock::now();
+                    handle_data(std::move(data));
+                }
+            }
+        } catch (IO::packet_smaller_than_expected &e) {
+            // Incorrect packet, skipping
+        } catch (data_packet_wrong_format &e) {
+            // Incorrect packet, skipping
+        }
+    }
+
+  public:
+    // Binds socket to port shared with other local receivers. Feedback is
+    // sent from separate socket, so that sender can tell receivers apart
+    // and send them repairs.
+    Receiver(IO::Socket &socket, uint16_t port, in_addr group, Sink &sink,
+             MulticastOptions options)
+        : _socket(socket), _feedback(IO::Socket::UDP), _sink(sink) {
+        _feedback.bind(0);
+        int reuse = 1;
+        int buffer = SOCKET_BUFFER_SIZE;
+        _socket.setsockopt(IO::Socket::REUSEADDR, &reuse, sizeof(reuse));
+        _socket.setsockopt(IO::Socket::RCVBUF, &buffer, sizeof(buffer));
+        _socket.bind(port);
+
+        ip_mreq membership{group, options.iface};
+        _socket.setIpOption(IP_ADD_MEMBERSHIP, &membership,
+                            sizeof(membership));
+    }
+
+    // Receives multicast sessions one after another.
+    void run() {
+        while (true) {
+            pollfd fds[2] = {{(int)_socket, POLLIN, 0},
+                             {(int)_feedback, POLLIN, 0}};
+            int timeout =
+                (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    NACK_INTERVAL)
+                    .count();
+            if (poll(fds, 2, timeout) > 0) {
+                for (int i = 0; i < 2; i++) {
+                    if (fds[i].revents & POLLIN) {
+                        receive(i == 0 ? _socket : _feedback);
+                    }
+                }
+            }
+
+            if (!_transfer || _transfer->_done) {
+                continue;
+            }
+
+            if (clock::now() - _transfer->_last_packet > RECEIVER_TIMEOUT) {
+                session_t session_id = _transfer->_session_id;
+                _transfer.reset();
+                throw std::runtime_error("Multicast session " +
+                                         std::to_string(session_id) +
+                                         " timed out");
+            }
+
+            if (clock::now() - _transfer->_last_nack >= NACK_INTERVAL &&
+                (!_transfer->_pending.empty() ||
+                 clock::now() - _transfer->_last_packet >= NACK_INTERVAL)) {
+                send_nacks();
+            }
+        }
+    }
+};
+} // namespace MULTICAST
+
+#endif /* MULTICAST_HPP */
@@ -0,0 +1,162 @@
+#ifndef NETEM_HPP
+#define NETEM_HPP
+
+#include "io.hpp"
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+// Emulation of lossy network link: loss, duplication, reordering, delay with
+// jitter and bandwidth limit with bounded queue. All random decisions come
+// from one seeded generator, so runs with same seed and traffic are
+// repeatable.
+namespace NETEM {
+using clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+struct Conditions {
+    double loss{0};
+    double duplicate{0};
+    double reorder{0};
+    milliseconds delay{0};
+    milliseconds jitter{0};
+    // Reordered packets are held back that much longer than others.
+    milliseconds reorder_delay{5};
+    // Bytes per second, 0 means unlimited.
+    uint64_t rate{0};
+    // Bytes waiting for link above that are dropped.
+    uint64_t queue{1 << 20};
+};
+
+struct LinkStats {
+    uint64_t _received{0};
+    uint64_t _forwarded{0};
+    uint64_t _lost{0};
+    uint64_t _overflowed{0};
+    uint64_t _duplicated{0};
+    uint64_t _reordered{0};
+
+    void print(std::ostream &os, const std::string &name) const {
+        os << name << ": received=" << _received
+           << " forwarded=" << _forwarded << " lost=" << _lost
+           << " overflowed=" << _overflowed << " duplicated=" << _duplicated
+           << " reordered=" << _reordered << "\n";
+    }
+};
+
+// One direction of emulated link.
+class Link {
+  private:
+    struct Scheduled {
+        clock::time_point _at;
+        uint64_t _seq;
+        std::vector<char> _data;
+        IO::Socket _out;
+        sockaddr_in _to;
+
+        bool operator>(const Scheduled &other) const {
+            return std::tie(_at, _seq) > std::tie(other._at, other._seq);
+        }
+    };
+
+    const Conditions &_conditions;
+    std::mt19937_64 &_rng;
+    std::priority_queue<Scheduled, std::vector<Scheduled>,
+                        std::greater<Scheduled>>
+        _scheduled;
+    uint64_t _seq{0};
+    // Time when link finishes sending already queued bytes.
+    clock::time_point _free{clock::now()};
+    LinkStats _stats;
+
+    bool chance(double p) {
+        return p > 0 && std::uniform_real_distribution<double>(0, 1)(_rng) < p;
+    }
+
+    void schedule(const std::vector<char> &data, IO::Socket &out,
+                  sockaddr_in to, clock::time_point now) {
+        clock::time_point sent = now;
+        if (_conditions.rate) {
+            auto backlog = std::chrono::duration<double>(
+                std::max(_free, now) - now);
+            if (backlog.count() * (double)_conditions.rate >
+                (double)_conditions.queue) {
+                _stats._overflowed++;
+                return;
+            }
+            sent = std::max(_free, now) +
+                   std::chrono::duration_cast<clock::duration>(
+                       std::chrono::duration<double>(
+                           (double)data.size() / (double)_conditions.rate));
+            _free = sent;
+        }
+
+        clock::duration delay = _conditions.delay;
+        if (_conditions.jitter.count() > 0) {
+            delay += std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double, std::milli>(
+                    std::uniform_real_distribution<double>(
+                        0, (double)_conditions.jitter.count())(_rng)));
+        }
+        if (chance(_conditions.reorder)) {
+            delay += _conditions.reorder_delay;
+            _stats._reordered++;
+        }
+        _scheduled.push({sent + delay, _seq++, data, out, to});
+    }
+
+  public:
+    Link(const Conditions &conditions, std::mt19937_64 &rng)
+        : _conditions(conditions), _rng(rng) {}
+
+    // Accepts datagram that should be sent from out socket to address to.
+    void push(const std::vector<char> &data, IO::Socket &out, sockaddr_in to) {
+        auto now = clock::now();
+        _stats._received++;
+        if (chance(_conditions.loss)) {
+            _stats._lost++;
+            return;
+        }
+        schedule(data, out, to, now);
+        if (chance(_conditions.duplicate)) {
+            _stats._duplicated++;
+            schedule(data, out, to, now);
+        }
+    }
+
+    std::optional<clock::time_point> next() const {
+        if (_scheduled.empty()) {
+            return std::nullopt;
+        }
+        return _scheduled.top()._at;
+    }
+
+    // Sends all datagrams due until now.
+    void flush() {
+        auto now = clock::now();
+        while (!_scheduled.empty() && _scheduled.top()._at <= now) {
+            auto &packet = _scheduled.top();
+            sockaddr_in to = packet._to;
+            ssize_t ret = sendto((int)packet._out, packet._data.data(),
+                                 packet._data.size(), 0, (sockaddr *)&to,
+                                 (socklen_t)sizeof(to));
+            if (ret >= 0) {
+                _stats._forwarded++;
+            }
+            _scheduled.pop();
+        }
+    }
+
+    const LinkStats &stats() const { return _stats; }
+};
+} // namespace NETEM
+
+#endif /* NETEM_HPP */
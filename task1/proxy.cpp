@@ -0,0 +1,168 @@
+#include "debug.hpp"
+#include "io.hpp"
+#include "netem.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+
+using namespace DEBUG_NS;
+using clock_type = std::chrono::steady_clock;
+
+// UDP relay between ppcbc and ppcbs emulating lossy link in both directions.
+// Every client gets its own socket towards server, so that answers can be
+// passed back to it.
+
+static volatile sig_atomic_t stop = 0;
+
+struct ProxyOptions {
+    NETEM::Conditions conditions;
+    uint64_t seed{1};
+};
+
+double read_probability(const char *string) {
+    char *endptr;
+    errno = 0;
+    double p = strtod(string, &endptr);
+    if (errno != 0 || *endptr != 0 || !(p >= 0 && p <= 1)) {
+        throw std::runtime_error(std::string(string) +
+                                 " is not a valid probability");
+    }
+    return p;
+}
+
+ProxyOptions read_options(int argc, char *argv[], int first) {
+    ProxyOptions options;
+    auto &conditions = options.conditions;
+    for (int i = first; i < argc; i++) {
+        std::string option(argv[i]);
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value of option: " + option);
+        }
+        const char *value = argv[++i];
+        if (option == "--loss") {
+            conditions.loss = read_probability(value);
+        } else if (option == "--dup") {
+            conditions.duplicate = read_probability(value);
+        } else if (option == "--reorder") {
+            conditions.reorder = read_probability(value);
+        } else if (option == "--reorder-delay") {
+            conditions.reorder_delay =
+                std::chrono::milliseconds(IO::read_size(value));
+        } else if (option == "--delay") {
+            conditions.delay = std::chrono::milliseconds(IO::read_size(value));
+        } else if (option == "--jitter") {
+            conditions.jitter = std::chrono::milliseconds(IO::read_size(value));
+        } else if (option == "--rate") {
+            conditions.rate = IO::read_size(value);
+        } else if (option == "--queue") {
+            conditions.queue = IO::read_size(value);
+        } else if (option == "--seed") {
+            options.seed = IO::read_size(value);
+        } else {
+            throw std::runtime_error("Unknown option: " + option);
+        }
+    }
+    return options;
+}
+
+struct Client {
+    sockaddr_in _addr;
+    IO::Socket _upstream;
+};
+
+int main(int argc, char *argv[]) {
+    try {
+        if (argc < 4) {
+            throw std::runtime_error(
+                "Usage: <port> <server ip> <server port> [--loss <p>] "
+                "[--dup <p>] [--reorder <p>] [--reorder-delay <ms>] "
+                "[--delay <ms>] [--jitter <ms>] [--rate <bytes/s>] "
+                "[--queue <bytes>] [--seed <n>]");
+        }
+
+        uint16_t port = IO::read_port(argv[1]);
+        sockaddr_in server =
+            IO::get_server_address(argv[2], IO::read_port(argv[3]));
+        ProxyOptions options = read_options(argc, argv, 4);
+
+        signal(SIGINT, [](int) { stop = 1; });
+        signal(SIGTERM, [](int) { stop = 1; });
+
+        std::mt19937_64 rng(options.seed);
+        NETEM::Link up(options.conditions, rng);
+        NETEM::Link down(options.conditions, rng);
+
+        IO::Socket listening(IO::Socket::UDP);
+        listening.bind(port);
+        std::vector<Client> clients;
+        std::vector<char> buffer(IO::MAX_UDP_PACKET_SIZE);
+
+        while (!stop) {
+            int timeout = -1;
+            for (auto next : {up.next(), down.next()}) {
+                if (next) {
+                    auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+                        *next - clock_type::now());
+                    int millis = (int)std::max<int64_t>(wait.count(), 0);
+                    timeout = timeout < 0 ? millis : std::min(timeout, millis);
+                }
+            }
+
+            std::vector<pollfd> fds{{(int)listening, POLLIN, 0}};
+            for (auto &client : clients) {
+                fds.push_back({(int)client._upstream, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("poll failed: ") +
+                                         std::strerror(errno));
+            }
+
+            for (size_t i = 0; i < fds.size(); i++) {
+                if (!(fds[i].revents & POLLIN)) {
+                    continue;
+                }
+                sockaddr_in addr;
+                socklen_t len = sizeof(addr);
+                ssize_t ret = recvfrom(fds[i].fd, buffer.data(), buffer.size(),
+                                       MSG_DONTWAIT, (sockaddr *)&addr, &len);
+                if (ret < 0) {
+                    continue;
+                }
+                std::vector<char> data(buffer.begin(), buffer.begin() + ret);
+
+                if (i == 0) {
+                    Client *client = nullptr;
+                    for (auto &known : clients) {
+                        if (known._addr == addr) {
+                            client = &known;
+                        }
+                    }
+                    if (!client) {
+                        DBG_printer("new client on port", ntohs(addr.sin_port));
+                        clients.push_back({addr, IO::Socket(IO::Socket::UDP)});
+                        client = &clients.back();
+                    }
+                    up.push(data, client->_upstream, server);
+                } else if (addr == server) {
+                    down.push(data, listening, clients[i - 1]._addr);
+                }
+            }
+
+            up.flush();
+            down.flush();
+        }
+
+        up.stats().print(std::cerr, "client->server");
+        down.stats().print(std::cerr, "server->client");
+    } catch (std::exception &e) {
+        std::cerr << "ERROR: [FATAL] " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef READAHEAD_HPP
+#define READAHEAD_HPP
+
+#include "common.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Read-ahead of client's input. Reader thread reads input in large blocks and
+// cuts it into data of packets, which are handed to sending thread through
+// lock-free queue, so reading input overlaps with waiting for server and
+// sending thread makes no other syscalls than sends. Size of input goes in
+// connection request, so only regular files, whose size is known before
+// they're read, are read ahead.
+namespace READAHEAD {
+using namespace PPCB;
+
+// Queue with one producer and one consumer thread. Each side waits on other
+// side's index only when queue is full or empty.
+template <class T> class Ring {
+  private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    std::vector<T> _slots;
+    // Next slot to pop, written only by consumer.
+    alignas(CACHE_LINE) std::atomic<size_t> _head{0};
+    // Next slot to push, written only by producer.
+    alignas(CACHE_LINE) std::atomic<size_t> _tail{0};
+    std::atomic<bool> _closed{false};
+
+  public:
+    explicit Ring(size_t capacity) : _slots(capacity) {}
+
+    // Waits for free slot, false if consumer closed queue.
+    bool push(T value) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_acquire);
+        while (tail - head == _slots.size()) {
+            _head.wait(head, std::memory_order_acquire);
+            head = _head.load(std::memory_order_acquire);
+        }
+        if (_closed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        _slots[tail % _slots.size()] = std::move(value);
+        _tail.store(tail + 1, std::memory_order_release);
+        _tail.notify_one();
+        return true;
+    }
+
+    // Waits for value.
+    T pop() {
+        size_t head = _head.load(std::memory_order_relaxed);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        while (tail == head) {
+            _tail.wait(tail, std::memory_order_acquire);
+            tail = _tail.load(std::memory_order_acquire);
+        }
+        T value = std::move(_slots[head % _slots.size()]);
+        _head.store(head + 1, std::memory_order_release);
+        _head.notify_one();
+        return value;
+    }
+
+    // Called by consumer that won't pop anymore. Head is moved, so that
+    // producer waiting for free slot wakes up and sees queue closed.
+    void close() {
+        _closed.store(true, std::memory_order_release);
+        _head.fetch_add(1, std::memory_order_acq_rel);
+        _head.notify_one();
+    }
+};
+
+// Size of input behind fd if it's regular file.
+std::optional<b_cnt_t> regular_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return std::nullopt;
+    }
+    b_cnt_t offset = 0;
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if (position > 0) {
+        offset = (b_cnt_t)position;
+    }
+    return (b_cnt_t)st.st_size - std::min((b_cnt_t)st.st_size, offset);
+}
+
+// Reads size bytes from fd on its own thread, data of consecutive packets is
+// taken with next().
+class Reader {
+  private:
+    // Input is read in blocks of that many bytes.
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+    // Empty data means reading failed.
+    Ring<std::vector<char>> _ring;
+    std::exception_ptr _error;
+    std::jthread _thread;
+
+    void read_all(int fd, b_cnt_t size, size_t packet_size) {
+        std::vector<char> block(std::max(BLOCK_SIZE, packet_size));
+        size_t begin = 0, end = 0;
+        try {
+            while (size != 0) {
+                size_t len = (size_t)std::min<b_cnt_t>(packet_size, size);
+                if (end - begin < len) {
+                    std::memmove(block.data(), block.data() + begin,
+                                 end - begin);
+                    end -= begin;
+                    begin = 0;
+                    ssize_t ret = ::read(fd, block.data() + end,
+                                         block.size() - end);
+                    if (ret < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (ret <= 0) {
+                        throw std::runtime_error(
+                            "Input ended " + std::to_string(size) +
+                            " bytes before its size");
+                    }
+                    end += (size_t)ret;
+                    continue;
+                }
+                std::vector<char> data(block.data() + begin,
+                                       block.data() + begin + len);
+                if (!_ring.push(std::move(data))) {
+                    return;
+                }
+                begin += len;
+                size -= len;
+            }
+        } catch (...) {
+            _error = std::current_exception();
+            _ring.push({});
+        }
+    }
+
+  public:
+    Reader(int fd, b_cnt_t size, size_t packet_size, size_t capacity)
+        : _ring(capacity),
+          _thread([this, fd, size, packet_size]() {
+              read_all(fd, size, packet_size);
+          }) {}
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    ~Reader() { _ring.close(); }
+
+    // Data of next packet, waits for reader thread if it's behind.
+    std::vector<char> next() {
+        std::vector<char> data = _ring.pop();
+        if (data.empty()) {
+            std::rethrow_exception(_error);
+        }
+        return data;
+    }
+};
+} // namespace READAHEAD
+
+#endif /* READAHEAD_HPP */
@@ -0,0 +1,80 @@
+#ifndef REORDER_HPP
+#define REORDER_HPP
+
+#include "common.hpp"
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Reorder buffer of plain udp sessions, which have no retransmissions.
+// Packets that came before ones preceding them are held until gap before
+// them is filled. Only packets up to window after first missing one are
+// held, and gap has to be filled within time limit.
+namespace REORDER {
+using namespace PPCB;
+using clock = std::chrono::steady_clock;
+
+struct Options {
+    // Packets after first missing one that can be held, 0 turns buffer off.
+    size_t packets{256};
+    std::chrono::milliseconds time{500};
+};
+
+class Buffer {
+  private:
+    Options _options;
+    // Packet number n is kept at index n % _slots.size().
+    std::vector<std::unique_ptr<Packet<DATA>>> _slots;
+    size_t _held{0};
+    clock::time_point _gap_since;
+
+  public:
+    explicit Buffer(const Options &options)
+        : _options(options), _slots(options.packets) {}
+
+    // Holds packet that came before expected one, false if it's beyond
+    // window. Duplicates of held packets are dropped.
+    bool hold(const Packet<DATA> &packet, p_cnt_t expected) {
+        if (packet._packet_number - expected > _slots.size()) {
+            return false;
+        }
+        auto &slot = _slots[packet._packet_number % _slots.size()];
+        if (!slot) {
+            slot = std::make_unique<Packet<DATA>>(packet);
+            if (_held++ == 0) {
+                _gap_since = clock::now();
+            }
+        }
+        return true;
+    }
+
+    // Takes held packet that is expected now, if there is one. Gap before
+    // next held packet is timed from now.
+    std::unique_ptr<Packet<DATA>> take(p_cnt_t expected) {
+        if (_held == 0) {
+            return nullptr;
+        }
+        auto &slot = _slots[expected % _slots.size()];
+        if (!slot || slot->_packet_number != expected) {
+            return nullptr;
+        }
+        _held--;
+        _gap_since = clock::now();
+        return std::move(slot);
+    }
+
+    size_t held() const { return _held; }
+
+    // Time until which gap has to be filled, if there is one.
+    std::optional<clock::time_point> deadline() const {
+        if (_held == 0) {
+            return std::nullopt;
+        }
+        return _gap_since + _options.time;
+    }
+};
+} // namespace REORDER
+
+#endif /* REORDER_HPP */
@@ -0,0 +1,164 @@
+#ifndef RESUME_HPP
+#define RESUME_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interface.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+// Resumable transfers. Server keeps received data of transfer named by
+// client in <dir>/<name> and number of accepted bytes in <dir>/<name>.state.
+namespace RESUMABLE {
+using namespace PPCB;
+
+// State is checkpointed after every CHECKPOINT_BYTES of accepted data.
+constexpr b_cnt_t CHECKPOINT_BYTES = 16 * 1024 * 1024;
+
+// Transfer names are used as file names in server directory, next to state
+// files of transfers, which they can't name.
+bool valid_name(const std::string &name) {
+    return !name.empty() && name.size() <= Packet<RESUME>::MAX_NAME_LEN &&
+           name != "." && name != ".." && name.find('/') == std::string::npos &&
+           name.find('\0') == std::string::npos && !name.ends_with(".state") &&
+           !name.ends_with(".state.tmp");
+}
+
+const std::string &checked_name(const std::string &name) {
+    if (!valid_name(name)) {
+        throw std::runtime_error("Invalid transfer name: " + name);
+    }
+    return name;
+}
+
+// Persisted progress of single transfer.
+class TransferState {
+  private:
+    std::string _path;
+
+  public:
+    b_cnt_t _total{0};
+    b_cnt_t _accepted{0};
+
+    TransferState(const std::string &dir, const std::string &name)
+        : _path(dir + "/" + checked_name(name) + ".state") {
+        std::ifstream file(_path);
+        if (!(file >> _total >> _accepted) || _accepted > _total) {
+            _total = _accepted = 0;
+        }
+    }
+
+    // Atomically replaces state file.
+    void save() const {
+        std::string tmp = _path + ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::trunc);
+            file << _total << " " << _accepted << "\n";
+            if (!file.flush()) {
+                throw std::runtime_error("Couldn't write state file: " + tmp);
+            }
+        }
+        if (std::rename(tmp.c_str(), _path.c_str()) < 0) {
+            throw std::runtime_error(std::string("Couldn't save state: ") +
+                                     std::strerror(errno));
+        }
+    }
+};
+
+// Writes data to file of transfer and checkpoints progress in batches.
+class ResumeSink : public Sink {
+  private:
+    TransferState _state;
+    int _fd;
+    b_cnt_t _checkpointed;
+
+    void checkpoint() {
+        if (fdatasync(_fd) < 0) {
+            throw std::runtime_error(std::string("Couldn't sync data: ") +
+                                     std::strerror(errno));
+        }
+        _state.save();
+        _checkpointed = _state._accepted;
+        DBG_printer("checkpoint at", _checkpointed);
+    }
+
+  public:
+    // Opens transfer of total bytes, dropping data written after last
+    // checkpoint or whole file if it was a different transfer. File shorter
+    // than checkpoint (e.g. replaced) is kept only as far as it goes.
+    ResumeSink(const std::string &dir, const std::string &name, b_cnt_t total)
+        : _state(dir, name) {
+        if (_state._total != total) {
+            _state._total = total;
+            _state._accepted = 0;
+        }
+
+        std::string path = dir + "/" + name;
+        _fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        struct stat st;
+        bool opened = _fd >= 0 && fstat(_fd, &st) == 0;
+        if (opened) {
+            _state._accepted =
+                std::min(_state._accepted, (b_cnt_t)st.st_size);
+        }
+        if (!opened || ftruncate(_fd, (off_t)_state._accepted) < 0 ||
+            lseek(_fd, 0, SEEK_END) < 0) {
+            std::string error = std::strerror(errno);
+            if (_fd >= 0) {
+                close(_fd);
+            }
+            throw std::runtime_error("Couldn't open transfer file " + path +
+                                     ": " + error);
+        }
+        _checkpointed = _state._accepted;
+        _state.save();
+    }
+
+    ResumeSink(const ResumeSink &) = delete;
+    ResumeSink &operator=(const ResumeSink &) = delete;
+
+    b_cnt_t offset() const { return _state._accepted; }
+
+    void write(const char *data, size_t len) {
+        while (len > 0) {
+            ssize_t ret = ::write(_fd, data, len);
+            if (ret < 0) {
+                throw std::runtime_error(
+                    std::string("Couldn't write transfer file: ") +
+                    std::strerror(errno));
+            }
+            data += ret;
+            len -= ret;
+            _state._accepted += ret;
+        }
+
+        if (_state._accepted - _checkpointed >= CHECKPOINT_BYTES) {
+            checkpoint();
+        }
+    }
+
+    void finish() { checkpoint(); }
+
+    // Interrupted session keeps everything accepted so far.
+    ~ResumeSink() {
+        try {
+            if (_checkpointed != _state._accepted) {
+                checkpoint();
+            }
+        } catch (std::exception &e) {
+            std::cerr << "ERROR: " << e.what() << "\n";
+        }
+        close(_fd);
+    }
+};
+} // namespace RESUMABLE
+
+#endif /* RESUME_HPP */
@@ -0,0 +1,113 @@
+#ifndef SCHEMA_HPP
+#define SCHEMA_HPP
+
+#include <endian.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Compile-time layouts of fixed part of packets. Layout lists fields in wire
+// order, offsets and size are computed from it, so that encoding and
+// decoding of packet come from the same list and can't drift apart. Both
+// go over whole layout at once in caller's buffer.
+namespace SCHEMA {
+// Net fields are big-endian on wire, raw ones (packet type, session ids,
+// enums) are copied as they are.
+enum order_t : uint8_t { raw, net };
+
+template <class T, order_t O> struct Field {
+    static_assert(std::is_trivially_copyable_v<T>);
+    using type = T;
+    static constexpr order_t order = O;
+};
+
+template <class T> using Raw = Field<T, raw>;
+template <class T> using Net = Field<T, net>;
+
+template <class T> T swap(T value) {
+    if constexpr (sizeof(T) == 1) {
+        return value;
+    } else if constexpr (sizeof(T) == 2) {
+        return (T)htobe16((uint16_t)value);
+    } else if constexpr (sizeof(T) == 4) {
+        return (T)htobe32((uint32_t)value);
+    } else {
+        static_assert(sizeof(T) == 8);
+        return (T)htobe64((uint64_t)value);
+    }
+}
+
+template <class F> void store(char *at, typename F::type value) {
+    if constexpr (F::order == net) {
+        value = swap(value);
+    }
+    std::memcpy(at, &value, sizeof(value));
+}
+
+template <class F> typename F::type load(const char *at) {
+    typename F::type value;
+    std::memcpy(&value, at, sizeof(value));
+    if constexpr (F::order == net) {
+        value = swap(value);
+    }
+    return value;
+}
+
+template <class... Fields> struct Layout {
+    using values_t = std::tuple<typename Fields::type...>;
+    static constexpr size_t CNT = sizeof...(Fields);
+    static constexpr size_t SIZE = (sizeof(typename Fields::type) + ... + 0);
+    static constexpr std::array<size_t, CNT> OFFSETS = []() {
+        std::array<size_t, CNT> offsets{};
+        size_t sizes[] = {sizeof(typename Fields::type)..., 0};
+        size_t offset = 0;
+        for (size_t i = 0; i < CNT; i++) {
+            offsets[i] = offset;
+            offset += sizes[i];
+        }
+        return offsets;
+    }();
+
+    template <class... More> using append = Layout<Fields..., More...>;
+
+    template <size_t I>
+    using field_t = std::tuple_element_t<I, std::tuple<Fields...>>;
+
+    // Writes SIZE bytes to buffer.
+    static void encode(char *buffer, const values_t &values) {
+        encode(buffer, values, std::make_index_sequence<CNT>());
+    }
+
+    // Reads SIZE bytes from buffer.
+    static values_t decode(const char *buffer) {
+        return decode(buffer, std::make_index_sequence<CNT>());
+    }
+
+  private:
+    template <size_t... I>
+    static void encode(char *buffer, const values_t &values,
+                       std::index_sequence<I...>) {
+        (store<field_t<I>>(buffer + OFFSETS[I], std::get<I>(values)), ...);
+    }
+
+    template <size_t... I>
+    static values_t decode(const char *buffer, std::index_sequence<I...>) {
+        return values_t(load<field_t<I>>(buffer + OFFSETS[I])...);
+    }
+};
+
+// Tuple without its first N elements.
+template <size_t N, class... Args>
+auto drop(const std::tuple<Args...> &tuple) {
+    return [&]<size_t... I>(std::index_sequence<I...>) {
+        return std::make_tuple(std::get<N + I>(tuple)...);
+    }(std::make_index_sequence<sizeof...(Args) - N>());
+}
+} // namespace SCHEMA
+
+#endif /* SCHEMA_HPP */
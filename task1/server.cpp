@@ -1,59 +1,146 @@
+#include "admission.hpp"
+#include "batch.hpp"
 #include "common.hpp"
 #include "debug.hpp"
+#include "delta.hpp"
+#include "demux.hpp"
 #include "interface.hpp"
 #include "io.hpp"
+#include "multicast.hpp"
+#include "reorder.hpp"
+#include "resume.hpp"
+#include "shm.hpp"
+#include "stats.hpp"
+#include "stripe.hpp"
+#include "timer.hpp"
 
+#include <exception>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include <signal.h>
 
 using namespace PPCB;
 using namespace DEBUG_NS;
 
+// Answers connection request with accept packet and receives data_len bytes.
+// First data packet could have been carried by connection request. Plain udp
+// holds packets that came too early in reorder buffer.
 template <protocol_t P>
-void server_handler(Session<P> &session, Packet<CONN> conn) {
-    session_t session_id = conn._session_id;
-    b_cnt_t bytes_left = conn._data_len;
+void server_handler(Session<P> &session, session_t session_id,
+                    b_cnt_t data_len, std::unique_ptr<PacketBase> accept,
+                    Sink &sink, const REORDER::Options &reorder = {},
+                    const std::optional<Packet<DATA>> &first = std::nullopt) {
+    b_cnt_t bytes_left = data_len;
+    REORDER::Buffer early(P == udp ? reorder : REORDER::Options{0, {}});
 
-    session.send(std::make_unique<Packet<CONNACC>>(session_id));
+    session.send(std::move(accept));
 
     p_cnt_t packet_number = 0;
 
+    auto accept_data = [&](const Packet<DATA> &data_packet) {
+        if (bytes_left < data_packet._packet_byte_cnt) {
+            session.send(std::make_unique<Packet<RJT>>(
+                session_id, data_packet._packet_number));
+
+            throw std::runtime_error(
+                "Received to much bytes: left to read:" +
+                std::to_string(data_len) +
+                ", received:" + std::to_string(data_len - bytes_left));
+        }
+
+        try {
+            sink.write(data_packet._data.data(), data_packet._data.size());
+        } catch (std::exception &e) {
+            session.send(std::make_unique<Packet<RJT>>(
+                session_id, data_packet._packet_number));
+            throw;
+        }
+        session.stats().data(data_packet._packet_byte_cnt);
+
+        bytes_left -= data_packet._packet_byte_cnt;
+        packet_number++;
+
+        // Retransmit part in if constexpr to avoid copy pasting code.
+        if constexpr (retransmits<P>()) {
+            session.send(std::make_unique<Packet<ACC>>(
+                session_id, data_packet._packet_number,
+                receive_credit(session.socket(), data_packet._data.size())));
+        }
+    };
+
     try {
+        if (first) {
+            accept_data(*first);
+        }
+
         while (bytes_left > 0) {
-            auto [reader, packet_id] =
-                session.template get_next<CONN, DATA>(0, packet_number);
+            // Packet is awaited for MAX_WAIT from to_begin, with gap in
+            // sequence only until reorder time limit.
+            auto to_begin = std::chrono::steady_clock::now();
+            if (auto deadline = early.deadline()) {
+                to_begin = std::min(to_begin,
+                                    *deadline - std::chrono::seconds(MAX_WAIT));
+            }
+            std::unique_ptr<IO::PacketReaderBase> reader;
+            packet_type_t packet_id;
+            try {
+                std::tie(reader, packet_id) =
+                    session.template get_next<CONN, CONNDATA, RESUME, BATCH,
+                                              DATA>(0, 0, 0, 0, packet_number,
+                                                    to_begin);
+            } catch (IO::timeout_error &e) {
+                if (!early.deadline()) {
+                    throw;
+                }
+                session.send(std::make_unique<Packet<RJT>>(session_id,
+                                                           packet_number));
+                throw std::runtime_error(
+                    "Packet " + std::to_string(packet_number) +
+                    " missing for longer than reorder time limit");
+            }
 
             if (packet_id == DATA) {
                 Packet<DATA> data_packet(*reader);
 
+                if constexpr (P == udp) {
+                    if (data_packet._packet_number < packet_number) {
+                        // Duplicated by network.
+                        continue;
+                    }
+                    if (data_packet._packet_number > packet_number &&
+                        early.hold(data_packet, packet_number)) {
+                        session.stats().reordered();
+                        continue;
+                    }
+                }
+
+                if constexpr (retransmits<P>()) {
+                    // Windowed client sent packets after lost one, repeating
+                    // acknowledgment of last packet in order.
+                    if (data_packet._packet_number > packet_number) {
+                        if (packet_number > 0) {
+                            session.send(std::make_unique<Packet<ACC>>(
+                                session_id, packet_number - 1,
+                                receive_credit(session.socket(),
+                                               data_packet._data.size())));
+                        }
+                        continue;
+                    }
+                }
+
                 if (data_packet._packet_number != packet_number) {
                     session.send(std::make_unique<Packet<RJT>>(
                         session_id, data_packet._packet_number));
                     throw unexpected_packet(DATA, packet_number, DATA,
                                             data_packet._packet_number);
-                } else if (bytes_left < data_packet._packet_byte_cnt) {
-                    session.send(std::make_unique<Packet<RJT>>(
-                        session_id, data_packet._packet_number));
-
-                    throw std::runtime_error(
-                        "Received to much bytes: left to read:" +
-                        std::to_string(conn._data_len) + ", received:" +
-                        std::to_string(conn._data_len - bytes_left));
                 }
 
-                std::cout.write(data_packet._data.data(),
-                                data_packet._data.size());
-                std::cout << std::flush;
-
-                bytes_left -= data_packet._packet_byte_cnt;
-                packet_number++;
-
-                // Retransmit part in if constexpr to avoid copy pasting code.
-                if constexpr (retransmits<P>()) {
-                    session.send(std::make_unique<Packet<ACC>>(
-                        session_id, data_packet._packet_number));
+                accept_data(data_packet);
+                while (auto held = early.take(packet_number)) {
+                    accept_data(*held);
                 }
             } else {
                 throw unexpected_packet(DATA, std::nullopt, packet_id,
@@ -65,28 +152,622 @@ void server_handler(Session<P> &session, Packet<CONN> conn) {
         throw e;
     }
 
+    try {
+        sink.finish();
+    } catch (std::exception &e) {
+        session.send(
+            std::make_unique<Packet<RJT>>(session_id, packet_number - 1));
+        throw;
+    }
+
     session.send(std::make_unique<Packet<RCVD>>(session_id));
 }
 
+struct ServerOptions {
+    std::optional<std::string> basis;
+    std::optional<std::string> resume_dir;
+    std::optional<std::string> batch_dir;
+    // Unix socket answering connections with stats of sessions.
+    std::optional<std::string> stats_socket;
+    std::optional<in_addr> group;
+    // Low-latency mode: receiving spins that long before blocking.
+    std::chrono::microseconds busy_poll{0};
+    std::optional<size_t> cpu;
+    // Data of sessions is verified against generated pattern and dropped.
+    bool discard{false};
+    ADMISSION::Limits admission;
+    REORDER::Options reorder;
+    MULTICAST::MulticastOptions multicast;
+};
+
+ServerOptions read_options(int argc, char *argv[], int first) {
+    ServerOptions options;
+    for (int i = first; i < argc; i++) {
+        std::string option(argv[i]);
+        if (option == "--basis" && i + 1 < argc) {
+            options.basis = argv[++i];
+        } else if (option == "--resume-dir" && i + 1 < argc) {
+            options.resume_dir = argv[++i];
+        } else if (option == "--batch-dir" && i + 1 < argc) {
+            options.batch_dir = argv[++i];
+        } else if (option == "--stats-socket" && i + 1 < argc) {
+            options.stats_socket = argv[++i];
+        } else if (option == "--busy-poll" && i + 1 < argc) {
+            options.busy_poll = IO::read_busy_poll(argv[++i]);
+        } else if (option == "--cpu" && i + 1 < argc) {
+            options.cpu = IO::read_size(argv[++i]);
+        } else if (option == "--discard") {
+            options.discard = true;
+        } else if (option == "--max-sessions" && i + 1 < argc) {
+            options.admission.max_sessions = IO::read_size(argv[++i]);
+            if (options.admission.max_sessions == 0) {
+                throw std::runtime_error("--max-sessions has to be positive");
+            }
+        } else if (option == "--max-buffered" && i + 1 < argc) {
+            options.admission.max_buffered = IO::read_size(argv[++i]);
+        } else if (option == "--admission-wait" && i + 1 < argc) {
+            options.admission.max_wait =
+                std::chrono::milliseconds(IO::read_size(argv[++i]));
+        } else if (option == "--reorder" && i + 1 < argc) {
+            options.reorder.packets = IO::read_size(argv[++i]);
+        } else if (option == "--reorder-time" && i + 1 < argc) {
+            options.reorder.time =
+                std::chrono::milliseconds(IO::read_size(argv[++i]));
+        } else if (option == "--group" && i + 1 < argc) {
+            options.group = MULTICAST::read_ip(argv[++i]);
+        } else if (option == "--iface" && i + 1 < argc) {
+            options.multicast.iface = MULTICAST::read_ip(argv[++i]);
+        } else {
+            throw std::runtime_error("Unknown option: " + option);
+        }
+    }
+    return options;
+}
+
+// Answers SIGREQ with signatures of basis file (none if server has no basis).
+template <IO::Socket::connection_t C>
+uint32_t answer_sigreq(IO::Socket &socket, IO::Address *addr,
+                       session_t session_id, const ServerOptions &options) {
+    DELTA::Signatures signatures;
+    if (options.basis) {
+        signatures = DELTA::Signatures(options.basis.value());
+    }
+    DELTA::send_signatures<C>(socket, addr, session_id, signatures);
+    return signatures.block_size();
+}
+
+// Serves session with sink rebuilding data from delta stream if it asked for
+// signatures before. Data goes to stdout, or is only verified with --discard.
+template <protocol_t P>
+void serve(Session<P> &session, Packet<CONN> conn,
+           std::optional<uint32_t> delta_block_size,
+           const ServerOptions &options,
+           const std::optional<Packet<DATA>> &first) {
+    session_t session_id = conn._session_id;
+    StdoutSink stdout_sink;
+    DiscardSink discard_sink;
+    Sink &out = options.discard ? (Sink &)discard_sink : stdout_sink;
+    if (delta_block_size) {
+        DELTA::DeltaSink delta(out, options.basis.value_or("/dev/null"),
+                               delta_block_size.value());
+        server_handler(session, session_id, conn._data_len,
+                       std::make_unique<Packet<CONNACC>>(session_id), delta,
+                       options.reorder, first);
+    } else {
+        server_handler(session, session_id, conn._data_len,
+                       std::make_unique<Packet<CONNACC>>(session_id), out,
+                       options.reorder, first);
+    }
+}
+
+// Reads CONN or CONNDATA, returning request and data packet carried by it.
+std::tuple<Packet<CONN>, std::optional<Packet<DATA>>>
+read_connection_request(IO::PacketReaderBase &reader, packet_type_t id) {
+    if (id == CONNDATA) {
+        Packet<CONNDATA> conndata(reader);
+        DBG_printer("connection request carries", conndata._packet_byte_cnt,
+                    "bytes");
+        return {conndata.conn(), conndata.first_data()};
+    }
+    return {Packet<CONN>(reader), std::nullopt};
+}
+
+// Continues named transfer from last accepted offset.
+template <protocol_t P>
+void serve_resume(Session<P> &session, Packet<RESUME> resume,
+                  const ServerOptions &options) {
+    session_t session_id = resume._session_id;
+    if (!options.resume_dir) {
+        session.send(std::make_unique<Packet<CONNRJT>>(session_id));
+        throw std::runtime_error("Resume requested, but no --resume-dir set");
+    }
+    if (!RESUMABLE::valid_name(resume._name)) {
+        session.send(std::make_unique<Packet<CONNRJT>>(session_id));
+        throw std::runtime_error("Invalid transfer name: " + resume._name);
+    }
+
+    RESUMABLE::ResumeSink sink(options.resume_dir.value(), resume._name,
+                            resume._data_len);
+    DBG_printer("resuming", resume._name, "from", sink.offset());
+
+    server_handler(session, session_id, resume._data_len - sink.offset(),
+                   std::make_unique<Packet<RESUMEACC>>(session_id,
+                                                       sink.offset()),
+                   sink, options.reorder);
+}
+
+// Receives batch of files into batch directory.
+template <protocol_t P>
+void serve_batch(Session<P> &session, Packet<BATCH> batch,
+                 const ServerOptions &options) {
+    session_t session_id = batch._session_id;
+    if (!options.batch_dir) {
+        session.send(std::make_unique<Packet<CONNRJT>>(session_id));
+        throw std::runtime_error("Batch sent, but no --batch-dir set");
+    }
+
+    BATCHING::BatchSink sink(options.batch_dir.value());
+    server_handler(session, session_id, batch._data_len,
+                   std::make_unique<Packet<CONNACC>>(session_id), sink,
+                   options.reorder);
+}
+
+// Runs handler with session of given udp based protocol.
+template <class Handler>
+void with_udp_session(IO::Socket &socket, IO::Address client_address,
+                      protocol_t protocol, session_t session_id,
+                      Handler handler) {
+    if (protocol == udp) {
+        DBG_printer("connected via udp protocol");
+        Session<udp> session(socket, client_address, session_id, true);
+        handler(session);
+    } else if (protocol == udpr) {
+        DBG_printer("connected via udpr protocol");
+        Session<udpr> session(socket, client_address, session_id, true);
+        handler(session);
+    } else {
+        throw std::runtime_error("Unknown protocol: " +
+                                 std::to_string(protocol));
+    }
+}
+
+// Serves all streams of striped group over tcp, each in its own thread,
+// taking the remaining connections of group from admission queue.
+void serve_striped_tcp(ADMISSION::Queue<ADMISSION::Connection> &queue,
+                       IO::Socket first_socket, IO::Address first_address,
+                       Packet<STRIPE> first) {
+    STRIPING::Group group(first);
+    if (!group.contains(first)) {
+        throw std::runtime_error("Invalid stripe request");
+    }
+
+    StdoutSink out;
+    STRIPING::Reassembler reassembler(out, group._total);
+    if (group._layout == contiguous && !reassembler.seekable()) {
+        Packet<CONNRJT>(first._session_id)
+            .getSender(first_socket, &first_address)
+            .send<IO::Socket::TCP>();
+        throw std::runtime_error("Contiguous stripes need seekable output");
+    }
+    std::vector<bool> joined(group._cnt, false);
+    std::mutex errors_mutex;
+    std::vector<std::exception_ptr> errors;
+    {
+        std::vector<std::jthread> streams;
+        auto start_stream = [&](IO::Socket client_socket, IO::Address addr,
+                                Packet<STRIPE> hello) {
+            joined[hello._stream_idx] = true;
+            DBG_printer("stream", hello._stream_idx, "joined");
+            streams.emplace_back([&, client_socket, addr, hello]() mutable {
+                try {
+                    Session<tcp> session(client_socket, addr,
+                                         hello._session_id, true);
+                    STRIPING::StreamSink sink(reassembler,
+                                              STRIPING::StripeMap(hello));
+                    server_handler(
+                        session, hello._session_id, hello._data_len,
+                        std::make_unique<Packet<CONNACC>>(hello._session_id),
+                        sink);
+                } catch (...) {
+                    reassembler.abort();
+                    std::lock_guard<std::mutex> lock(errors_mutex);
+                    errors.push_back(std::current_exception());
+                }
+            });
+        };
+        start_stream(first_socket, first_address, first);
+
+        for (uint32_t cnt = 1; cnt < group._cnt;) {
+            auto slot = queue.pop(
+                std::chrono::steady_clock::now() +
+                    std::chrono::seconds(MAX_WAIT),
+                ADMISSION::reject);
+            if (!slot) {
+                reassembler.abort();
+                throw std::runtime_error(
+                    "Striped group incomplete, joined streams: " +
+                    std::to_string(cnt) + "/" + std::to_string(group._cnt));
+            }
+            IO::Socket client_socket = slot->_value._socket;
+            IO::Address client_address = slot->_value._addr;
+
+            try {
+                IO::PacketReader<IO::Socket::TCP> reader(client_socket,
+                                                         nullptr);
+                auto [id, session_id] =
+                    reader.readGeneric<packet_type_t, session_t>();
+                reader.mtb();
+                if (id == STRIPE) {
+                    Packet<STRIPE> hello(reader);
+                    if (group.contains(hello) && !joined[hello._stream_idx] &&
+                        hello._protocol == tcp) {
+                        start_stream(client_socket, client_address, hello);
+                        cnt++;
+                        continue;
+                    }
+                }
+                Packet<CONNRJT>(session_id)
+                    .getSender(client_socket, &client_address)
+                    .send<IO::Socket::TCP>();
+            } catch (std::exception &e) {
+                std::cerr << "ERROR: [SINGLE CONNECTION] " << e.what()
+                          << "\n";
+            }
+        }
+    }
+
+    if (!errors.empty()) {
+        std::rethrow_exception(errors.front());
+    }
+    reassembler.finish();
+}
+
+// State of single stream of group served over udp.
+struct UdpStream {
+    IO::Address _addr;
+    session_t _session_id;
+    protocol_t _protocol;
+    std::unique_ptr<STRIPING::StreamSink> _sink;
+    b_cnt_t _bytes_left;
+    p_cnt_t _packet_number{0};
+    std::unique_ptr<PacketBase> _last_msg;
+    bool _done{false};
+    TIMER::timer_id_t _timer{TIMER::NO_TIMER};
+    int _retransmit_cnt{MAX_RETRANSMITS};
+    STATS::Handle _stats;
+
+    UdpStream(IO::Address addr, const Packet<STRIPE> &hello,
+              STRIPING::Reassembler &reassembler)
+        : _addr(addr), _session_id(hello._session_id),
+          _protocol(hello._protocol),
+          _sink(std::make_unique<STRIPING::StreamSink>(
+              reassembler, STRIPING::StripeMap(hello))),
+          _bytes_left(hello._data_len),
+          _stats(hello._session_id, addr,
+                 STATS::kind_name(hello._protocol) + "-stripe") {}
+};
+
+// Serves all streams of striped group over udp in one loop demultiplexing
+// datagrams between them. Acknowledgments lost by udpr streams are resent
+// when client retransmits, last message of each stream when its timer
+// expires. Loop sleeps until datagram arrives or next timer expires.
+void serve_striped_udp(IO::Socket &socket, IO::Address first_address,
+                       Packet<STRIPE> first) {
+    using clock = std::chrono::steady_clock;
+    static constexpr auto RETRANSMIT_TIMEOUT = std::chrono::seconds(MAX_WAIT);
+
+    STRIPING::Group group(first);
+    if (!group.contains(first)) {
+        throw std::runtime_error("Invalid stripe request");
+    }
+
+    StdoutSink out;
+    STRIPING::Reassembler reassembler(out, group._total);
+    if (group._layout == contiguous && !reassembler.seekable()) {
+        Packet<CONNRJT>(first._session_id)
+            .getSender(socket, &first_address)
+            .send<IO::Socket::UDP>();
+        throw std::runtime_error("Contiguous stripes need seekable output");
+    }
+    DEMUX::SessionTable<UdpStream> streams;
+    std::vector<bool> joined(group._cnt, false);
+    uint32_t joined_cnt = 0;
+    uint32_t done = 0;
+
+    // Timers of streams are keyed by stream, timer without key waits for
+    // streams that didn't join yet.
+    TIMER::TimerWheel<std::optional<DEMUX::SessionKey>> timers;
+    TIMER::timer_id_t join_timer = TIMER::NO_TIMER;
+
+    auto arm = [&](UdpStream &stream) {
+        timers.cancel(stream._timer);
+        stream._timer =
+            timers.arm(clock::now() + RETRANSMIT_TIMEOUT,
+                       DEMUX::SessionKey(stream._addr, stream._session_id));
+    };
+
+    auto send = [&](UdpStream &stream, std::unique_ptr<PacketBase> packet) {
+        DBG_printer("sending: ", *packet);
+        auto sender = packet->getSender(socket, &stream._addr);
+        sender.send<IO::Socket::UDP>();
+        TRACE::record(TRACE::SENT, packet->getID(), stream._session_id,
+                      packet_number(*packet));
+        stream._stats->sent(sender.size());
+        if (packet->getID() == RJT) {
+            stream._stats->rejected();
+        }
+        stream._last_msg = std::move(packet);
+        if (!stream._done) {
+            arm(stream);
+        }
+    };
+
+    // Streams share receive buffer of socket.
+    auto credit = [&](const Packet<DATA> &data) {
+        return receive_credit(socket, data._data.size()) / group._cnt;
+    };
+
+    auto finish_stream = [&](UdpStream &stream) {
+        stream._done = true;
+        timers.cancel(stream._timer);
+        stream._timer = TIMER::NO_TIMER;
+        send(stream, std::make_unique<Packet<RCVD>>(stream._session_id));
+        done++;
+    };
+
+    auto join = [&](IO::Address addr, Packet<STRIPE> hello) {
+        if (hello._protocol != udp && hello._protocol != udpr) {
+            throw std::runtime_error("Unknown protocol: " +
+                                     std::to_string(hello._protocol));
+        }
+        auto &stream =
+            streams.emplace(addr, hello._session_id, addr, hello, reassembler);
+        joined[hello._stream_idx] = true;
+        joined_cnt++;
+        DBG_printer("stream", hello._stream_idx, "joined");
+
+        timers.cancel(join_timer);
+        join_timer = TIMER::NO_TIMER;
+        if (joined_cnt < group._cnt) {
+            join_timer = timers.arm(clock::now() + RETRANSMIT_TIMEOUT *
+                                                       (MAX_RETRANSMITS + 1),
+                                    std::nullopt);
+        }
+
+        send(stream, std::make_unique<Packet<CONNACC>>(hello._session_id));
+        if (stream._bytes_left == 0) {
+            finish_stream(stream);
+        }
+    };
+
+    auto expired = [&](const std::optional<DEMUX::SessionKey> &key) {
+        if (!key) {
+            throw std::runtime_error(
+                "Striped group incomplete, joined streams: " +
+                std::to_string(joined_cnt) + "/" + std::to_string(group._cnt));
+        }
+        UdpStream *stream = streams.find(*key);
+        if (!stream || stream->_done) {
+            return;
+        }
+        stream->_timer = TIMER::NO_TIMER;
+        TRACE::record(TRACE::TIMEOUT, 0, stream->_session_id);
+        stream->_stats->timed_out();
+        if (stream->_retransmit_cnt <= 0) {
+            throw IO::timeout_error((int)socket);
+        }
+        stream->_retransmit_cnt--;
+        if (stream->_protocol == udpr && stream->_last_msg) {
+            DBG_printer("retransmiting", *stream->_last_msg);
+            auto sender = stream->_last_msg->getSender(socket, &stream->_addr);
+            sender.send<IO::Socket::UDP>();
+            TRACE::record(TRACE::RETRANSMITTED, stream->_last_msg->getID(),
+                          stream->_session_id,
+                          packet_number(*stream->_last_msg));
+            stream->_stats->retransmitted(sender.size());
+        }
+        arm(*stream);
+    };
+
+    join(first_address, first);
+
+    while (done < group._cnt) {
+        timers.expire(clock::now(), expired);
+        auto next = timers.next_expiry();
+        clock::duration wait = next ? *next - clock::now()
+                                    : clock::duration(RETRANSMIT_TIMEOUT);
+        if (!IO::wait_readable(socket, std::max(wait, clock::duration(0)))) {
+            continue;
+        }
+
+        IO::Address addr;
+        auto received = IO::PacketReader<IO::Socket::UDP>::try_receive(
+            socket, &addr, Header::SIZE, false);
+        if (!received) {
+            // Incorrect packet, skipping
+            continue;
+        }
+        auto &reader = **received;
+
+        try {
+            auto [id, session_id] = reader.readLayout<Header>();
+            reader.mtb();
+            UdpStream *stream = streams.find(addr, session_id);
+
+            if (id == STRIPE) {
+                Packet<STRIPE> hello(reader);
+                if (stream) {
+                    send(*stream,
+                         std::make_unique<Packet<CONNACC>>(session_id));
+                } else if (group.contains(hello) &&
+                           !joined[hello._stream_idx]) {
+                    join(addr, hello);
+                } else {
+                    Packet<CONNRJT>(session_id)
+                        .getSender(socket, &addr)
+                        .send<IO::Socket::UDP>();
+                }
+            } else if (is_connection_request(id)) {
+                Packet<CONNRJT>(session_id)
+                    .getSender(socket, &addr)
+                    .send<IO::Socket::UDP>();
+            } else if (id == DATA && !stream) {
+                reject_data(socket, &addr, reader);
+            } else if (id == DATA) {
+                Packet<DATA> data(reader);
+                p_cnt_t number = data._packet_number;
+                TRACE::record(TRACE::RECEIVED, DATA, session_id, number);
+                stream->_stats->received();
+
+                if (number < stream->_packet_number) {
+                    // Client didn't get acknowledgment, resending.
+                    if (stream->_protocol == udpr) {
+                        auto acc = Packet<ACC>(session_id, number,
+                                               credit(data))
+                                       .getSender(socket, &addr);
+                        acc.send<IO::Socket::UDP>();
+                        stream->_stats->retransmitted(acc.size());
+                        if (stream->_done) {
+                            auto last =
+                                stream->_last_msg->getSender(socket, &addr);
+                            last.send<IO::Socket::UDP>();
+                            stream->_stats->retransmitted(last.size());
+                        }
+                    }
+                } else if (number > stream->_packet_number) {
+                    if (stream->_protocol == udpr &&
+                        stream->_packet_number > 0) {
+                        Packet<ACC>(session_id, stream->_packet_number - 1,
+                                    credit(data))
+                            .getSender(socket, &addr)
+                            .send<IO::Socket::UDP>();
+                    } else if (stream->_protocol == udp) {
+                        send(*stream,
+                             std::make_unique<Packet<RJT>>(session_id, number));
+                        throw unexpected_packet(DATA, stream->_packet_number,
+                                                DATA, number);
+                    }
+                } else if (stream->_bytes_left < data._packet_byte_cnt) {
+                    send(*stream,
+                         std::make_unique<Packet<RJT>>(session_id, number));
+                    throw std::runtime_error("Received to much bytes in stream");
+                } else if (!stream->_sink->fits(data._packet_byte_cnt)) {
+                    // Other streams are behind, packet is left to be
+                    // retransmitted once they catch up.
+                    if (stream->_protocol == udpr && number > 0) {
+                        Packet<ACC>(session_id, number - 1, 0)
+                            .getSender(socket, &addr)
+                            .send<IO::Socket::UDP>();
+                    } else if (stream->_protocol == udp) {
+                        send(*stream,
+                             std::make_unique<Packet<RJT>>(session_id, number));
+                        throw std::runtime_error("Reassembly buffer full");
+                    }
+                } else {
+                    stream->_sink->write(data._data.data(), data._data.size());
+                    stream->_stats->data(data._packet_byte_cnt);
+                    stream->_bytes_left -= data._packet_byte_cnt;
+                    stream->_packet_number++;
+                    stream->_retransmit_cnt = MAX_RETRANSMITS;
+                    if (stream->_protocol == udpr) {
+                        send(*stream, std::make_unique<Packet<ACC>>(
+                                          session_id, number, credit(data)));
+                    } else {
+                        arm(*stream);
+                    }
+                    if (stream->_bytes_left == 0) {
+                        finish_stream(*stream);
+                    }
+                }
+            }
+        } catch (IO::packet_smaller_than_expected &e) {
+            // Incorrect packet, skipping
+        } catch (data_packet_wrong_format &e) {
+            // Incorrect packet, skipping
+        }
+    }
+
+    reassembler.finish();
+}
+
+// Opens server socket bound to unix socket path, if given, or to port.
+IO::Socket open_socket(IO::Socket::connection_t type,
+                       const std::optional<IO::Address> &path, uint16_t port) {
+    if (!path) {
+        IO::Socket socket(type);
+        socket.bind(port);
+        return socket;
+    }
+    IO::Socket socket(type, AF_UNIX);
+    // Socket file left by previous server would make bind fail.
+    unlink(path->path().c_str());
+    socket.bind(*path);
+    return socket;
+}
+
 int main(int argc, char *argv[]) {
     try {
         signal(SIGPIPE, SIG_IGN);
+        TRACE::init("ppcbs");
+        STATS::Reporter::block_signals();
 
-        if (argc != 3) {
-            throw std::runtime_error("Usage: <protocol> <port>");
+        if (argc < 3) {
+            throw std::runtime_error(
+                "Usage: <protocol> <port | socket path> [--basis <file>] "
+                "[--resume-dir <dir>] [--batch-dir <dir>] "
+                "[--stats-socket <path>] [--busy-poll <us>] [--cpu <n>] "
+                "[--discard] [--max-sessions <n>] [--max-buffered <bytes>] "
+                "[--admission-wait <ms>] [--reorder <packets>] "
+                "[--reorder-time <ms>] "
+                "(mcast: --group <ip> [--iface <ip>])");
         }
 
-        uint16_t port = IO::read_port(argv[2]);
         std::string s_protocol(argv[1]);
+        // Path selects unix socket transport instead of IPv4.
+        std::optional<IO::Address> path;
+        uint16_t port = 0;
+        if (IO::Address::is_path(argv[2])) {
+            path = IO::Address::unix_path(argv[2]);
+        } else {
+            port = IO::read_port(argv[2]);
+        }
+        ServerOptions options = read_options(argc, argv, 3);
 
-        if (s_protocol != "tcp" && s_protocol != "udp") {
+        if (s_protocol != "tcp" && s_protocol != "udp" &&
+            s_protocol != "mcast") {
             throw std::runtime_error("Unknown protocol name: " + s_protocol);
         }
+        if (path && s_protocol == "mcast") {
+            throw std::runtime_error("mcast requires port");
+        }
+
+        // Stats are dumped on SIGUSR1 and to clients of stats socket, trace
+        // on SIGUSR2.
+        STATS::Reporter reporter(options.stats_socket);
+        if (options.cpu) {
+            IO::pin_to_cpu(*options.cpu);
+        }
 
-        if (s_protocol == std::string("tcp")) {
+        if (s_protocol == "mcast") {
+            if (!options.group) {
+                throw std::runtime_error("mcast requires --group <ip>");
+            }
+
+            IO::Socket socket(IO::Socket::UDP);
+            StdoutSink out;
+            MULTICAST::Receiver receiver(socket, port, options.group.value(),
+                                         out, options.multicast);
+            while (true) {
+                try {
+                    receiver.run();
+                } catch (std::exception &e) {
+                    std::cerr << "ERROR: [SINGLE CONNECTION] " << e.what()
+                              << "\n";
+                }
+            }
+        } else if (s_protocol == std::string("tcp")) {
             static constexpr int QUEUE_LENGTH = 10;
-            IO::Socket socket(IO::Socket::TCP);
-            socket.bind(port);
+            IO::Socket socket = open_socket(IO::Socket::TCP, path, port);
 
             if (listen((int)(socket), QUEUE_LENGTH) < 0) {
                 throw std::runtime_error(
@@ -94,28 +775,106 @@ int main(int argc, char *argv[]) {
                     std::strerror(errno));
             }
 
-            while (true) {
-                sockaddr_in client_address;
+            ADMISSION::Queue<ADMISSION::Connection> queue(options.admission);
+            std::jthread gatekeeper([&](std::stop_token stop) {
+                ADMISSION::gatekeep(stop, socket, queue,
+                                    options.admission.max_wait);
+            });
 
-                socket.resetRecvTimeout();
-
-                socklen_t address_length = sizeof(client_address);
-                IO::Socket client_socket(accept(
-                    (int)socket, (sockaddr *)&client_address, &address_length));
+            while (true) {
+                auto slot = queue.pop(std::nullopt, ADMISSION::reject);
+                IO::Socket client_socket = slot->_value._socket;
+                IO::Address client_address = slot->_value._addr;
+                client_socket.setBusyPoll(options.busy_poll);
 
                 DBG_printer("connected via tcp protocol");
 
                 try {
-                    IO::PacketReader<IO::Socket::TCP> reader(client_socket,
-                                                             NULL);
-                    auto [id] = reader.readGeneric<packet_type_t>();
-                    if (id != CONN) {
+                    std::optional<uint32_t> delta_block_size;
+                    auto reader = std::make_unique<
+                        IO::PacketReader<IO::Socket::TCP>>(client_socket,
+                                                           nullptr);
+                    auto [id] = reader->readGeneric<packet_type_t>();
+                    if (id == SHMOPEN) {
+                        reader->mtb();
+                        Packet<SHMOPEN> open(*reader);
+                        SHM::accept(client_socket, open);
+
+                        reader = std::make_unique<
+                            IO::PacketReader<IO::Socket::TCP>>(client_socket,
+                                                               nullptr);
+                        std::tie(id) = reader->readGeneric<packet_type_t>();
+                    }
+
+                    if (id == SIGREQ) {
+                        reader->mtb();
+                        Packet<SIGREQ> sigreq(*reader);
+                        delta_block_size = answer_sigreq<IO::Socket::TCP>(
+                            client_socket, &client_address,
+                            sigreq._session_id, options);
+
+                        reader = std::make_unique<
+                            IO::PacketReader<IO::Socket::TCP>>(client_socket,
+                                                               nullptr);
+                        std::tie(id) = reader->readGeneric<packet_type_t>();
+                    }
+
+                    if (id == STRIPE) {
+                        reader->mtb();
+                        Packet<STRIPE> stripe(*reader);
+
+                        if (stripe._protocol != tcp) {
+                            throw std::runtime_error(
+                                "Unknown protocol: " +
+                                std::to_string(stripe._protocol));
+                        }
+
+                        serve_striped_tcp(queue, client_socket,
+                                          client_address, stripe);
+                        continue;
+                    }
+
+                    if (id == RESUME) {
+                        reader->mtb();
+                        Packet<RESUME> resume(*reader);
+
+                        if (resume._protocol != tcp) {
+                            throw std::runtime_error(
+                                "Unknown protocol: " +
+                                std::to_string(resume._protocol));
+                        }
+
+                        Session<tcp> session(client_socket, client_address,
+                                             resume._session_id, true);
+
+                        serve_resume(session, resume, options);
+                        continue;
+                    }
+
+                    if (id == BATCH) {
+                        reader->mtb();
+                        Packet<BATCH> batch(*reader);
+
+                        if (batch._protocol != tcp) {
+                            throw std::runtime_error(
+                                "Unknown protocol: " +
+                                std::to_string(batch._protocol));
+                        }
+
+                        Session<tcp> session(client_socket, client_address,
+                                             batch._session_id, true);
+
+                        serve_batch(session, batch, options);
+                        continue;
+                    }
+
+                    if (id != CONN && id != CONNDATA) {
                         throw unexpected_packet(CONN, std::nullopt, id,
                                                 std::nullopt);
                     }
 
-                    reader.mtb();
-                    Packet<CONN> conn(reader);
+                    reader->mtb();
+                    auto [conn, first] = read_connection_request(*reader, id);
 
                     if (conn._protocol != tcp) {
                         throw std::runtime_error(
@@ -126,64 +885,145 @@ int main(int argc, char *argv[]) {
                     Session<tcp> session(client_socket, client_address,
                                          conn._session_id, true);
 
-                    server_handler(session, conn);
+                    serve(session, conn, delta_block_size, options, first);
                 } catch (std::exception &e) {
                     std::cerr << "ERROR: [SINGLE CONNECTION] " << e.what()
                               << "\n";
                 }
             }
         } else {
-            IO::Socket socket(IO::Socket::UDP);
-            socket.bind(port);
+            IO::Socket socket = open_socket(IO::Socket::UDP, path, port);
+            // Only receive timestamps, as socket is shared by sessions and
+            // TX ones couldn't be told apart.
+            socket.enableTimestamps(false);
+            socket.setBusyPoll(options.busy_poll);
+
+            // Client that received signatures and will send delta stream.
+            std::optional<std::tuple<session_t, IO::Address, uint32_t>>
+                delta_client;
+
+            auto &admission = ADMISSION::datagrams();
+            admission.configure(options.admission);
+            auto reject = [&](ADMISSION::Datagram &datagram,
+                              session_t session_id) {
+                Packet<CONNRJT>(session_id)
+                    .getSender(socket, &datagram._addr)
+                    .send<IO::Socket::UDP>();
+            };
 
             while (true) {
                 try {
-                    sockaddr_in client_address;
+                    IO::Address client_address;
 
-                    socket.resetRecvTimeout();
-                    IO::PacketReader<IO::Socket::UDP> reader(
-                        socket, &client_address, false);
+                    // Requests that came while previous session was served
+                    // are taken first.
+                    std::unique_ptr<IO::PacketReader<IO::Socket::UDP>> reader;
+                    auto slot =
+                        admission.pop(std::chrono::steady_clock::now(), reject);
+                    if (slot) {
+                        client_address = slot->_value._addr;
+                        reader =
+                            std::make_unique<IO::PacketReader<IO::Socket::UDP>>(
+                                socket, slot->_value._data);
+                    } else {
+                        socket.resetRecvTimeout();
+                        reader =
+                            std::make_unique<IO::PacketReader<IO::Socket::UDP>>(
+                                socket, &client_address, false);
+                    }
                     socket.setRecvTimeout(MAX_WAIT * 1000);
 
-                    auto [id] = reader.readGeneric<packet_type_t>();
+                    auto [id, session_id] =
+                        reader->readGeneric<packet_type_t, session_t>();
 
                     DBG_printer("UDP server waiting for client received id: ",
                                 packet_to_string(id));
 
-                    if (id != CONN) {
-                        if (id == DATA) {
-                            Packet<DATA> data(reader);
-                            Packet<RJT>(data._session_id, data._packet_number)
+                    if (id == SIGREQ) {
+                        reader->mtb();
+                        Packet<SIGREQ> sigreq(*reader);
+                        uint32_t block_size = answer_sigreq<IO::Socket::UDP>(
+                            socket, &client_address, sigreq._session_id,
+                            options);
+                        delta_client = {sigreq._session_id, client_address,
+                                        block_size};
+                        continue;
+                    }
+
+                    if (id == STRIPE) {
+                        reader->mtb();
+                        Packet<STRIPE> stripe(*reader);
+
+                        serve_striped_udp(socket, client_address, stripe);
+                        continue;
+                    }
+
+                    // Other requests read from socket go through queue, which
+                    // rejects ones over caps.
+                    if (!slot && is_connection_request(id)) {
+                        if (!admission.offer(
+                                client_address, session_id, reader->size(),
+                                [&]() {
+                                    return ADMISSION::Datagram{
+                                        client_address, reader->datagram()};
+                                })) {
+                            Packet<CONNRJT>(session_id)
                                 .getSender(socket, &client_address)
                                 .send<IO::Socket::UDP>();
-
-                            DBG_printer(
-                                "Wating server rejected packet data nr:",
-                                data._packet_number);
                         }
                         continue;
                     }
 
-                    reader.mtb();
-                    Packet<CONN> conn(reader);
+                    if (id == RESUME) {
+                        reader->mtb();
+                        Packet<RESUME> resume(*reader);
 
-                    if (conn._protocol == udp) {
-                        DBG_printer("connected via udp protocol");
-                        Session<udp> session(socket, client_address,
-                                             conn._session_id, true);
+                        with_udp_session(socket, client_address,
+                                         resume._protocol, resume._session_id,
+                                         [&](auto &session) {
+                                             serve_resume(session, resume,
+                                                          options);
+                                         });
+                        continue;
+                    }
 
-                        server_handler(session, conn);
-                    } else if (conn._protocol == udpr) {
-                        DBG_printer("connected via udpr protocol");
-                        Session<udpr> session(socket, client_address,
-                                              conn._session_id, true);
+                    if (id == BATCH) {
+                        reader->mtb();
+                        Packet<BATCH> batch(*reader);
 
-                        server_handler(session, conn);
-                    } else {
-                        throw std::runtime_error(
-                            "Unknown protocol: " +
-                            std::to_string(conn._protocol));
+                        with_udp_session(socket, client_address,
+                                         batch._protocol, batch._session_id,
+                                         [&](auto &session) {
+                                             serve_batch(session, batch,
+                                                         options);
+                                         });
+                        continue;
                     }
+
+                    if (id != CONN && id != CONNDATA) {
+                        if (id == DATA) {
+                            reject_data(socket, &client_address, *reader);
+                            DBG_printer("Wating server rejected data packet");
+                        }
+                        continue;
+                    }
+
+                    reader->mtb();
+                    auto [conn, first] = read_connection_request(*reader, id);
+
+                    std::optional<uint32_t> delta_block_size;
+                    if (delta_client &&
+                        std::get<0>(*delta_client) == conn._session_id &&
+                        std::get<1>(*delta_client) == client_address) {
+                        delta_block_size = std::get<2>(*delta_client);
+                    }
+                    delta_client.reset();
+
+                    with_udp_session(socket, client_address, conn._protocol,
+                                     conn._session_id, [&](auto &session) {
+                                         serve(session, conn, delta_block_size,
+                                               options, first);
+                                     });
                 } catch (std::exception &e) {
                     std::cerr << "ERROR: [SINGLE CONNECTION] " << e.what()
                               << "\n";
@@ -193,4 +1033,4 @@ int main(int argc, char *argv[]) {
     } catch (std::exception &e) {
         std::cerr << "ERROR: [FATAL] " << e.what() << "\n";
     }
-}
\ No newline at end of file
+}
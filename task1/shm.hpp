@@ -0,0 +1,326 @@
+#ifndef SHM_HPP
+#define SHM_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "io.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Shared memory transport for client and server on one host. Client creates
+// memfd with two single-producer single-consumer byte rings, one for each
+// direction, and passes it with eventfds over unix stream socket (SHMOPEN).
+// Packets are then written to and read from rings as they would be to and
+// from the socket, which only tells whether peer is still alive.
+namespace SHM {
+using namespace PPCB;
+
+constexpr uint32_t DEFAULT_CAPACITY = 1 << 22;
+constexpr uint32_t MIN_CAPACITY = 1 << 12;
+constexpr uint32_t MAX_CAPACITY = 1 << 30;
+constexpr size_t CACHE_LINE = 64;
+// Size of memfd is fixed with these seals, so peer can't truncate it under
+// mapping of the other side.
+constexpr int SEALS = F_SEAL_SHRINK | F_SEAL_GROW;
+
+// Positions are bytes written and read since channel was created, producer
+// only moves head and consumer only tail. Side that sleeps sets its waiting
+// flag, so that the other one signals eventfd after it moves its position.
+struct RingHeader {
+    alignas(CACHE_LINE) std::atomic<uint64_t> _head{0};
+    alignas(CACHE_LINE) std::atomic<uint64_t> _tail{0};
+    alignas(CACHE_LINE) std::atomic<uint32_t> _reader_waiting{0};
+    std::atomic<uint32_t> _writer_waiting{0};
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(RingHeader) % CACHE_LINE == 0);
+
+size_t region_size(uint32_t capacity) {
+    return 2 * (sizeof(RingHeader) + capacity);
+}
+
+// One direction of channel.
+class Ring {
+  private:
+    RingHeader *_header;
+    char *_data;
+    uint32_t _capacity;
+    // Signalled by producer after it writes, by consumer after it reads.
+    int _readable_fd;
+    int _writable_fd;
+
+    // Positions are written by peer as well, so their distance is checked
+    // before it's used to copy data.
+    size_t used(uint64_t head, uint64_t tail) const {
+        if (head - tail > _capacity) {
+            throw std::runtime_error("Corrupted shared memory ring");
+        }
+        return (size_t)(head - tail);
+    }
+
+  public:
+    Ring(char *region, uint32_t capacity, int readable_fd, int writable_fd)
+        : _header((RingHeader *)region), _data(region + sizeof(RingHeader)),
+          _capacity(capacity), _readable_fd(readable_fd),
+          _writable_fd(writable_fd) {}
+
+    RingHeader &header() { return *_header; }
+    int readable_fd() const { return _readable_fd; }
+    int writable_fd() const { return _writable_fd; }
+
+    size_t readable() const {
+        return used(_header->_head.load(),
+                    _header->_tail.load(std::memory_order_relaxed));
+    }
+
+    size_t writable() const {
+        return _capacity - used(_header->_head.load(std::memory_order_relaxed),
+                                _header->_tail.load());
+    }
+
+    // Copies len <= writable() bytes in, wrapping around end of ring.
+    void put(const char *data, size_t len) {
+        uint64_t head = _header->_head.load(std::memory_order_relaxed);
+        size_t offset = (size_t)(head & (_capacity - 1));
+        size_t run = std::min<size_t>(len, _capacity - offset);
+        std::memcpy(_data + offset, data, run);
+        std::memcpy(_data, data + run, len - run);
+        _header->_head.store(head + len);
+        if (_header->_reader_waiting.load()) {
+            eventfd_write(_readable_fd, 1);
+        }
+    }
+
+    // Copies len <= readable() bytes out.
+    void take(char *data, size_t len) {
+        uint64_t tail = _header->_tail.load(std::memory_order_relaxed);
+        size_t offset = (size_t)(tail & (_capacity - 1));
+        size_t run = std::min<size_t>(len, _capacity - offset);
+        std::memcpy(data, _data + offset, run);
+        std::memcpy(data + run, _data, len - run);
+        _header->_tail.store(tail + len);
+        if (_header->_writer_waiting.load()) {
+            eventfd_write(_writable_fd, 1);
+        }
+    }
+};
+
+// End of channel attached to socket of client or server.
+class Channel : public IO::Stream {
+  private:
+    using clock = std::chrono::steady_clock;
+
+    // Memfd, then readable and writable eventfds of client to server ring
+    // and of server to client ring.
+    std::vector<int> _fds;
+    char *_region;
+    size_t _size;
+    int _peer;
+    std::chrono::nanoseconds _spin;
+    std::optional<Ring> _tx;
+    std::optional<Ring> _rx;
+    bool _closed{false};
+
+    // Sleeps until event is signalled, peer closes socket or deadline.
+    void sleep(int event_fd, std::optional<clock::time_point> deadline) {
+        pollfd pfds[2] = {{event_fd, POLLIN, 0}, {_peer, POLLRDHUP, 0}};
+        int timeout = -1;
+        if (deadline) {
+            timeout = (int)std::max<int64_t>(
+                std::chrono::ceil<std::chrono::milliseconds>(*deadline -
+                                                             clock::now())
+                    .count(),
+                0);
+        }
+        int ret = poll(pfds, 2, timeout);
+        if (ret < 0 && errno != EINTR) {
+            throw std::runtime_error(std::string("poll failed: ") +
+                                     std::strerror(errno));
+        }
+        if (pfds[0].revents & POLLIN) {
+            eventfd_t value;
+            eventfd_read(event_fd, &value);
+        }
+        if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            _closed = true;
+        }
+    }
+
+    // Returns ready() once it's non-zero: spins for busy poll time of
+    // socket, then sleeps on event_fd with waiting flag set.
+    template <class Ready>
+    size_t await(Ready ready, std::atomic<uint32_t> &waiting, int event_fd,
+                 std::optional<clock::time_point> deadline) {
+        size_t n = ready();
+        if (n == 0 && _spin != _spin.zero()) {
+            auto end = clock::now() + _spin;
+            while ((n = ready()) == 0 && clock::now() < end) {
+            }
+        }
+        while (n == 0) {
+            if (_closed) {
+                throw std::runtime_error("Peer closed shared memory channel");
+            }
+            if (deadline && clock::now() >= *deadline) {
+                throw IO::timeout_error(_peer);
+            }
+            waiting.store(1);
+            if ((n = ready()) == 0) {
+                sleep(event_fd, deadline);
+                n = ready();
+            }
+            waiting.store(0);
+        }
+        return n;
+    }
+
+  public:
+    // Client constructs rings, server maps ones passed to it.
+    Channel(IO::Socket &socket, std::vector<int> fds, uint32_t capacity,
+            bool client)
+        : _fds(std::move(fds)), _region(nullptr),
+          _size(region_size(capacity)), _peer((int)socket),
+          _spin(socket.busyPoll()) {
+        struct stat st;
+        int seals = _fds.size() == 5 ? fcntl(_fds[0], F_GET_SEALS) : -1;
+        if (seals < 0 || (seals & SEALS) != SEALS ||
+            fstat(_fds[0], &st) < 0 || (size_t)st.st_size != _size) {
+            close_fds();
+            throw std::runtime_error("Invalid shared memory channel");
+        }
+        void *region = mmap(nullptr, _size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, _fds[0], 0);
+        if (region == MAP_FAILED) {
+            close_fds();
+            throw std::runtime_error(
+                std::string("Couldn't map shared memory: ") +
+                std::strerror(errno));
+        }
+        _region = (char *)region;
+        if (client) {
+            // Memfd is zeroed, headers only have to be constructed.
+            new (_region) RingHeader();
+            new (_region + _size / 2) RingHeader();
+        }
+        Ring to_server(_region, capacity, _fds[1], _fds[2]);
+        Ring to_client(_region + _size / 2, capacity, _fds[3], _fds[4]);
+        _tx = client ? to_server : to_client;
+        _rx = client ? to_client : to_server;
+    }
+
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    ~Channel() {
+        munmap(_region, _size);
+        close_fds();
+    }
+
+    void close_fds() {
+        for (int fd : _fds) {
+            close(fd);
+        }
+        _fds.clear();
+    }
+
+    const std::vector<int> &fds() const { return _fds; }
+
+    void write(const char *data, size_t len) {
+        auto deadline = clock::now() +
+                        std::chrono::seconds(IO::Socket::DEFAULT_SEND_TIMEOUT);
+        while (len > 0) {
+            size_t n = await([this]() { return _tx->writable(); },
+                             _tx->header()._writer_waiting,
+                             _tx->writable_fd(), deadline);
+            n = std::min(n, len);
+            _tx->put(data, n);
+            data += n;
+            len -= n;
+        }
+    }
+
+    void read(char *data, size_t len,
+              std::optional<clock::time_point> deadline) {
+        while (len > 0) {
+            size_t n = await([this]() { return _rx->readable(); },
+                             _rx->header()._reader_waiting,
+                             _rx->readable_fd(), deadline);
+            n = std::min(n, len);
+            _rx->take(data, n);
+            data += n;
+            len -= n;
+        }
+    }
+};
+
+// Creates channel and sends it to server, then attaches it to socket.
+void connect(IO::Socket &socket, uint32_t capacity = DEFAULT_CAPACITY) {
+    std::vector<int> fds;
+    auto fail = [&fds](const char *what) {
+        std::string msg = std::string(what) + ": " + std::strerror(errno);
+        for (int fd : fds) {
+            close(fd);
+        }
+        throw std::runtime_error(msg);
+    };
+
+    int memfd = memfd_create("ppcb-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        fail("Couldn't create shared memory");
+    }
+    fds.push_back(memfd);
+    if (ftruncate(memfd, (off_t)region_size(capacity)) < 0) {
+        fail("Couldn't size shared memory");
+    }
+    if (fcntl(memfd, F_ADD_SEALS, SEALS) < 0) {
+        fail("Couldn't seal shared memory");
+    }
+    for (int i = 0; i < 4; i++) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            fail("Couldn't create eventfd");
+        }
+        fds.push_back(fd);
+    }
+
+    auto channel = std::make_shared<Channel>(socket, fds, capacity, true);
+    Packet<SHMOPEN>(0, capacity).getSender(socket, nullptr).send_fds(fds);
+    socket.attach(channel);
+    DBG_printer("shared memory channel of", capacity, "bytes opened");
+}
+
+// Attaches channel announced by SHMOPEN, passed descriptors are taken from
+// socket.
+void accept(IO::Socket &socket, const Packet<SHMOPEN> &open) {
+    std::vector<int> fds = socket.takeFds();
+    if (open._capacity < MIN_CAPACITY || open._capacity > MAX_CAPACITY ||
+        (open._capacity & (open._capacity - 1)) != 0) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        throw std::runtime_error("Invalid shared memory capacity: " +
+                                 std::to_string(open._capacity));
+    }
+    socket.attach(
+        std::make_shared<Channel>(socket, std::move(fds), open._capacity,
+                                  false));
+    DBG_printer("shared memory channel of", open._capacity, "bytes accepted");
+}
+} // namespace SHM
+
+#endif /* SHM_HPP */
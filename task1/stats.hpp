@@ -0,0 +1,444 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "common.hpp"
+#include "trace.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Transport statistics of sessions, kept in release builds. Counters are
+// atomic, as stats are dumped from another thread while session runs.
+namespace STATS {
+using namespace PPCB;
+using clock = std::chrono::steady_clock;
+
+// Bucket i counts RTT samples below 2^(i+1) us (last one also above), it's
+// split in RTT_STEPS equal parts for percentiles.
+constexpr size_t RTT_BUCKETS = 24;
+constexpr size_t RTT_STEPS = 8;
+// Finished sessions that are still reported.
+constexpr size_t MAX_FINISHED = 64;
+
+class SessionStats {
+  private:
+    using counter_t = std::atomic<uint64_t>;
+
+    const session_t _session_id;
+    const IO::Address _peer;
+    const std::string _kind;
+    const clock::time_point _begin{clock::now()};
+    // Nanoseconds from _begin to end of session, 0 while it's served.
+    std::atomic<int64_t> _duration{0};
+    std::atomic<bool> _failed{false};
+
+  public:
+    counter_t _packets_sent{0};
+    counter_t _bytes_sent{0};
+    counter_t _packets_received{0};
+    // Payload of DATA packets sent for first time or accepted.
+    counter_t _data_bytes{0};
+    counter_t _retransmits{0};
+    counter_t _rejects{0};
+    counter_t _timeouts{0};
+    // Packets held until packets before them came.
+    counter_t _reordered{0};
+    counter_t _rtt[RTT_BUCKETS * RTT_STEPS] = {};
+
+    SessionStats(session_t session_id, IO::Address peer, std::string kind)
+        : _session_id(session_id), _peer(peer), _kind(std::move(kind)) {}
+
+    void sent(size_t bytes) {
+        _packets_sent.fetch_add(1, std::memory_order_relaxed);
+        _bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void retransmitted(size_t bytes) {
+        sent(bytes);
+        _retransmits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void received() {
+        _packets_received.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void data(size_t bytes) {
+        _data_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void rejected() { _rejects.fetch_add(1, std::memory_order_relaxed); }
+
+    void timed_out() { _timeouts.fetch_add(1, std::memory_order_relaxed); }
+
+    void reordered() { _reordered.fetch_add(1, std::memory_order_relaxed); }
+
+    // Samples may come from CLOCK_REALTIME kernel timestamps, so negative
+    // ones (clock was set back) are dropped.
+    void rtt(clock::duration sample) {
+        if (sample < clock::duration::zero()) {
+            return;
+        }
+        uint64_t us = (uint64_t)std::chrono::duration_cast<
+                          std::chrono::microseconds>(sample)
+                          .count();
+        size_t bucket = 0;
+        while (bucket + 1 < RTT_BUCKETS && us >= (uint64_t(2) << bucket)) {
+            bucket++;
+        }
+        size_t step = (size_t)std::min<uint64_t>(
+            (us - std::min(us, rtt_low(bucket))) * RTT_STEPS /
+                rtt_width(bucket),
+            RTT_STEPS - 1);
+        _rtt[bucket * RTT_STEPS + step].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static uint64_t rtt_low(size_t bucket) {
+        return bucket ? uint64_t(1) << bucket : 0;
+    }
+
+    static uint64_t rtt_width(size_t bucket) {
+        return (uint64_t(2) << bucket) - rtt_low(bucket);
+    }
+
+    uint64_t rtt_bucket(size_t bucket) const {
+        uint64_t cnt = 0;
+        for (size_t step = 0; step < RTT_STEPS; step++) {
+            cnt += _rtt[bucket * RTT_STEPS + step];
+        }
+        return cnt;
+    }
+
+    // Upper bound in us of step of RTT histogram that holds quantile q of
+    // samples, 0 if there are none.
+    uint64_t rtt_percentile(double q) const {
+        uint64_t total = 0;
+        for (auto &cnt : _rtt) {
+            total += cnt;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < RTT_BUCKETS * RTT_STEPS && total; i++) {
+            seen += _rtt[i];
+            if ((double)seen >= q * (double)total) {
+                size_t bucket = i / RTT_STEPS;
+                return rtt_low(bucket) +
+                       (rtt_width(bucket) * (i % RTT_STEPS + 1) + RTT_STEPS -
+                        1) / RTT_STEPS;
+            }
+        }
+        return 0;
+    }
+
+    void finish(bool ok) {
+        _failed = !ok;
+        _duration = std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                                 _begin)
+                .count(),
+            1);
+    }
+
+    bool finished() const { return _duration != 0; }
+
+    void print(std::ostream &os) const {
+        int64_t duration = _duration;
+        double seconds =
+            (double)(duration ? duration
+                              : std::chrono::duration_cast<
+                                    std::chrono::nanoseconds>(clock::now() -
+                                                              _begin)
+                                    .count()) /
+            1e9;
+        os << "session: id=" << _session_id << " kind=" << _kind
+           << " peer=" << _peer.to_string() << " state="
+           << (!duration ? "active" : (_failed ? "failed" : "done"))
+           << " seconds=" << seconds << " packets_sent=" << _packets_sent
+           << " bytes_sent=" << _bytes_sent
+           << " packets_received=" << _packets_received
+           << " data_bytes=" << _data_bytes
+           << " retransmits=" << _retransmits << " rejects=" << _rejects
+           << " timeouts=" << _timeouts << " reordered=" << _reordered
+           << " goodput_mbps="
+           << (seconds > 0 ? (double)_data_bytes * 8 / 1e6 / seconds : 0)
+           << " rtt_p50_us=" << rtt_percentile(0.5)
+           << " rtt_p99_us=" << rtt_percentile(0.99) << " rtt_us=";
+        bool first = true;
+        for (size_t i = 0; i < RTT_BUCKETS; i++) {
+            if (uint64_t cnt = rtt_bucket(i)) {
+                os << (first ? "" : ",") << "<" << (uint64_t(2) << i) << ":"
+                   << cnt;
+                first = false;
+            }
+        }
+        os << (first ? "-" : "") << "\n";
+    }
+};
+
+// Connection requests of server: admitted ones, ones rejected over caps on
+// sessions or buffered bytes and ones that waited too long in queue.
+class AdmissionStats {
+  private:
+    using counter_t = std::atomic<uint64_t>;
+
+  public:
+    counter_t _admitted{0};
+    counter_t _rejected_sessions{0};
+    counter_t _rejected_bytes{0};
+    counter_t _expired{0};
+
+    void admitted() { _admitted.fetch_add(1, std::memory_order_relaxed); }
+
+    void rejected_sessions() {
+        _rejected_sessions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void rejected_bytes() {
+        _rejected_bytes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void expired() { _expired.fetch_add(1, std::memory_order_relaxed); }
+
+    // Nothing is printed by processes that admit no sessions (clients).
+    void print(std::ostream &os) const {
+        if (_admitted + _rejected_sessions + _rejected_bytes + _expired == 0) {
+            return;
+        }
+        os << "admission: admitted=" << _admitted
+           << " rejected_sessions=" << _rejected_sessions
+           << " rejected_bytes=" << _rejected_bytes
+           << " expired=" << _expired << "\n";
+    }
+};
+
+// Stats of sessions of process: all served ones and MAX_FINISHED last
+// finished.
+class Registry {
+  private:
+    std::mutex _mutex;
+    std::deque<std::shared_ptr<SessionStats>> _sessions;
+    AdmissionStats _admission;
+
+  public:
+    std::shared_ptr<SessionStats> open(session_t session_id, IO::Address peer,
+                                       std::string kind) {
+        auto stats = std::make_shared<SessionStats>(session_id, peer,
+                                                    std::move(kind));
+        std::lock_guard<std::mutex> lock(_mutex);
+        size_t finished = 0;
+        for (auto &session : _sessions) {
+            finished += session->finished();
+        }
+        for (auto it = _sessions.begin();
+             it != _sessions.end() && finished > MAX_FINISHED;) {
+            if ((*it)->finished()) {
+                it = _sessions.erase(it);
+                finished--;
+            } else {
+                ++it;
+            }
+        }
+        _sessions.push_back(stats);
+        return stats;
+    }
+
+    AdmissionStats &admission() { return _admission; }
+
+    void print(std::ostream &os) {
+        _admission.print(os);
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto &session : _sessions) {
+            session->print(os);
+        }
+    }
+
+    std::string dump() {
+        std::ostringstream os;
+        print(os);
+        return os.str();
+    }
+};
+
+Registry &registry() {
+    static Registry registry;
+    return registry;
+}
+
+std::string kind_name(protocol_t protocol) {
+    switch (protocol) {
+    case tcp:
+        return "tcp";
+    case udp:
+        return "udp";
+    case udpr:
+        return "udpr";
+    case mcast:
+        return "mcast";
+    }
+    return "unknown";
+}
+
+// Registers stats of session for its lifetime. Session is marked finished
+// when handle is destroyed, as failed when it's destroyed by exception.
+class Handle {
+  private:
+    std::shared_ptr<SessionStats> _stats;
+    int _exceptions;
+
+  public:
+    Handle(session_t session_id, IO::Address peer, std::string kind)
+        : _stats(registry().open(session_id, peer, std::move(kind))),
+          _exceptions(std::uncaught_exceptions()) {}
+
+    Handle(Handle &&) = default;
+    Handle &operator=(Handle &&) = default;
+
+    ~Handle() {
+        if (_stats) {
+            _stats->finish(std::uncaught_exceptions() <= _exceptions);
+        }
+    }
+
+    SessionStats &operator*() const { return *_stats; }
+    SessionStats *operator->() const { return _stats.get(); }
+};
+
+// Dumps registry to stderr on SIGUSR1 and to every client connecting to
+// unix socket at path, if given, and trace to its file on SIGUSR2. Signals
+// have to be blocked in all threads (block_signals before any thread is
+// started).
+class Reporter {
+  private:
+    int _signal_fd{-1};
+    int _listen_fd{-1};
+    int _stop_fd{-1};
+    std::string _path;
+    std::jthread _thread;
+
+    static void write_all(int fd, const std::string &text) {
+        size_t written = 0;
+        while (written < text.size()) {
+            ssize_t ret = ::write(fd, text.data() + written,
+                                  text.size() - written);
+            if (ret <= 0) {
+                return;
+            }
+            written += ret;
+        }
+    }
+
+    void run() {
+        while (true) {
+            pollfd fds[3] = {{_stop_fd, POLLIN, 0},
+                             {_signal_fd, POLLIN, 0},
+                             {_listen_fd, POLLIN, 0}};
+            if (poll(fds, _listen_fd >= 0 ? 3 : 2, -1) < 0) {
+                continue;
+            }
+            if (fds[0].revents) {
+                return;
+            }
+            if (fds[1].revents & POLLIN) {
+                signalfd_siginfo info;
+                if (read(_signal_fd, &info, sizeof(info)) <= 0) {
+                } else if (info.ssi_signo == SIGUSR1) {
+                    write_all(STDERR_FILENO, registry().dump());
+                } else if (!TRACE::dump()) {
+                    write_all(STDERR_FILENO, "Couldn't write trace\n");
+                }
+            }
+            if (_listen_fd >= 0 && (fds[2].revents & POLLIN)) {
+                int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0) {
+                    write_all(fd, registry().dump());
+                    close(fd);
+                }
+            }
+        }
+    }
+
+  public:
+    static sigset_t signals() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGUSR2);
+        return set;
+    }
+
+    static void block_signals() {
+        sigset_t set = signals();
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+
+    explicit Reporter(const std::optional<std::string> &path) {
+        sigset_t set = signals();
+        _signal_fd = signalfd(-1, &set, SFD_CLOEXEC);
+        _stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (_signal_fd < 0 || _stop_fd < 0) {
+            throw std::runtime_error(std::string("Couldn't set up stats: ") +
+                                     std::strerror(errno));
+        }
+
+        if (path) {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (path->size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("Stats socket path too long: " +
+                                         *path);
+            }
+            std::memcpy(addr.sun_path, path->c_str(), path->size() + 1);
+            _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            unlink(path->c_str());
+            if (_listen_fd < 0 ||
+                bind(_listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+                listen(_listen_fd, 4) < 0) {
+                throw std::runtime_error(
+                    std::string("Couldn't open stats socket: ") +
+                    std::strerror(errno));
+            }
+            _path = *path;
+        }
+
+        _thread = std::jthread([this]() { run(); });
+    }
+
+    Reporter(const Reporter &) = delete;
+    Reporter &operator=(const Reporter &) = delete;
+
+    // Thread polls descriptors, so it's joined before they're closed.
+    ~Reporter() {
+        uint64_t one = 1;
+        while (::write(_stop_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+        _thread.join();
+        close(_stop_fd);
+        close(_signal_fd);
+        if (_listen_fd >= 0) {
+            close(_listen_fd);
+            unlink(_path.c_str());
+        }
+    }
+};
+} // namespace STATS
+
+#endif /* STATS_HPP */
@@ -0,0 +1,285 @@
+#ifndef STRIPE_HPP
+#define STRIPE_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interface.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Striped transfers: input is split between several parallel sessions and
+// reassembled by server into one ordered output.
+namespace STRIPING {
+using namespace PPCB;
+
+constexpr uint32_t MAX_STREAMS = 64;
+
+// Mapping between bytes of stream and bytes of whole input.
+class StripeMap {
+  private:
+    b_cnt_t _total;
+    uint32_t _cnt;
+    uint32_t _idx;
+    stripe_layout_t _layout;
+    uint32_t _chunk;
+
+    b_cnt_t contiguous_begin(uint32_t idx) const {
+        return (_total / _cnt) * idx + std::min<b_cnt_t>(idx, _total % _cnt);
+    }
+
+  public:
+    StripeMap(b_cnt_t total, uint32_t cnt, uint32_t idx,
+              stripe_layout_t layout, uint32_t chunk)
+        : _total(total), _cnt(cnt), _idx(idx), _layout(layout),
+          _chunk(chunk) {
+        if (cnt == 0 || cnt > MAX_STREAMS || idx >= cnt) {
+            throw std::runtime_error("Invalid stream " + std::to_string(idx) +
+                                     "/" + std::to_string(cnt));
+        }
+        if (layout != contiguous && layout != strided) {
+            throw std::runtime_error("Unknown stripe layout: " +
+                                     std::to_string(layout));
+        }
+        if (chunk == 0 || chunk > MAX_DATA_SIZE) {
+            throw std::runtime_error("Invalid stripe chunk size: " +
+                                     std::to_string(chunk));
+        }
+    }
+
+    explicit StripeMap(const Packet<STRIPE> &hello)
+        : StripeMap(hello._total_len, hello._stream_cnt, hello._stream_idx,
+                    hello._layout, hello._chunk_size) {}
+
+    // Number of bytes carried by stream.
+    b_cnt_t length() const {
+        if (_layout == contiguous) {
+            return contiguous_begin(_idx + 1) - contiguous_begin(_idx);
+        }
+        b_cnt_t chunks = (_total + _chunk - 1) / _chunk;
+        if (chunks <= _idx) {
+            return 0;
+        }
+        b_cnt_t own = (chunks - 1 - _idx) / _cnt + 1;
+        if ((chunks - 1) % _cnt == _idx) {
+            return (own - 1) * _chunk + (_total - (chunks - 1) * _chunk);
+        }
+        return own * _chunk;
+    }
+
+    // Offset in input of local byte of stream.
+    b_cnt_t global(b_cnt_t local) const {
+        if (_layout == contiguous) {
+            return contiguous_begin(_idx) + local;
+        }
+        return ((local / _chunk) * _cnt + _idx) * _chunk + local % _chunk;
+    }
+
+    // Number of bytes from local byte that are consecutive in input.
+    b_cnt_t run(b_cnt_t local) const {
+        if (_layout == contiguous) {
+            return length() - local;
+        }
+        return _chunk - local % _chunk;
+    }
+};
+
+// Splits input into parts carried by each of cnt streams.
+std::vector<std::vector<char>> split(const std::vector<char> &input,
+                                     uint32_t cnt, stripe_layout_t layout,
+                                     uint32_t chunk) {
+    std::vector<std::vector<char>> parts;
+    for (uint32_t idx = 0; idx < cnt; idx++) {
+        StripeMap map(input.size(), cnt, idx, layout, chunk);
+        std::vector<char> part;
+        part.reserve(map.length());
+        while (part.size() < map.length()) {
+            b_cnt_t begin = map.global(part.size());
+            b_cnt_t len =
+                std::min(map.run(part.size()), map.length() - part.size());
+            part.insert(part.end(), input.begin() + begin,
+                        input.begin() + begin + len);
+        }
+        parts.push_back(std::move(part));
+    }
+    return parts;
+}
+
+// Puts parts of input received by streams in order. Parts are written with
+// pwrite when sink writes to a seekable file, otherwise early parts are
+// buffered. Buffered bytes are capped: part that doesn't fit waits until
+// parts before it are written, part that comes next in order always fits.
+// Contiguous layout would buffer most of input, so it needs seekable sink.
+class Reassembler {
+  private:
+    static constexpr b_cnt_t MAX_PENDING = 64 * 1024 * 1024;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    Sink &_out;
+    b_cnt_t _total;
+    std::optional<int> _fd;
+    std::optional<off_t> _base;
+    b_cnt_t _written{0};
+    std::map<b_cnt_t, std::vector<char>> _pending;
+    b_cnt_t _pending_bytes{0};
+    bool _aborted{false};
+
+    bool fits_locked(b_cnt_t offset, size_t len) const {
+        return _base || offset == _written ||
+               _pending_bytes + len <= MAX_PENDING;
+    }
+
+    void write_pending() {
+        while (!_pending.empty() && _pending.begin()->first == _written) {
+            auto &data = _pending.begin()->second;
+            _out.write(data.data(), data.size());
+            _written += data.size();
+            _pending_bytes -= data.size();
+            _pending.erase(_pending.begin());
+        }
+    }
+
+  public:
+    Reassembler(Sink &out, b_cnt_t total)
+        : _out(out), _total(total), _fd(out.fd()) {
+        if (!_fd) {
+            return;
+        }
+        int flags = fcntl(*_fd, F_GETFL);
+        off_t base = lseek(*_fd, 0, SEEK_CUR);
+        if (flags >= 0 && !(flags & O_APPEND) && base >= 0) {
+            _base = base;
+        }
+    }
+
+    bool seekable() const { return _base.has_value(); }
+
+    // Whether part can be taken now without waiting.
+    bool fits(b_cnt_t offset, size_t len) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return fits_locked(offset, len);
+    }
+
+    // Writes part, waiting until it fits in buffer.
+    void write(b_cnt_t offset, const char *data, size_t len) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (offset + len > _total) {
+            throw std::runtime_error("Stripe data outside of input");
+        }
+        _cv.wait(lock, [&]() { return _aborted || fits_locked(offset, len); });
+        if (_aborted) {
+            throw std::runtime_error("Striped transfer aborted");
+        }
+
+        if (_base) {
+            while (len > 0) {
+                ssize_t ret = pwrite(*_fd, data, len, *_base + (off_t)offset);
+                if (ret < 0) {
+                    throw std::runtime_error(
+                        std::string("Couldn't write output: ") +
+                        std::strerror(errno));
+                }
+                data += ret;
+                len -= ret;
+                offset += ret;
+                _written += ret;
+            }
+        } else {
+            _pending.emplace(offset, std::vector<char>(data, data + len));
+            _pending_bytes += len;
+            write_pending();
+            _cv.notify_all();
+        }
+    }
+
+    // Wakes streams waiting for buffer when one of them failed.
+    void abort() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _aborted = true;
+        _cv.notify_all();
+    }
+
+    // Checks whether whole input was received.
+    void finish() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_written != _total) {
+            throw std::runtime_error("Striped transfer incomplete: " +
+                                     std::to_string(_written) + "/" +
+                                     std::to_string(_total));
+        }
+        if (_base) {
+            lseek(*_fd, *_base + (off_t)_total, SEEK_SET);
+        }
+        _out.finish();
+    }
+};
+
+// Sink of single stream passing its bytes to reassembler.
+class StreamSink : public Sink {
+  private:
+    Reassembler &_reassembler;
+    StripeMap _map;
+    b_cnt_t _local{0};
+
+  public:
+    StreamSink(Reassembler &reassembler, StripeMap map)
+        : _reassembler(reassembler), _map(map) {}
+
+    // Whether next len bytes of stream can be written without waiting. Each
+    // run they span is checked for all of them, as earlier runs may end up
+    // buffered too.
+    bool fits(size_t len) {
+        for (b_cnt_t local = _local; local < _local + len;
+             local += _map.run(local)) {
+            if (!_reassembler.fits(_map.global(local), len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void write(const char *data, size_t len) {
+        while (len > 0) {
+            size_t part = std::min<b_cnt_t>(len, _map.run(_local));
+            _reassembler.write(_map.global(_local), data, part);
+            _local += part;
+            data += part;
+            len -= part;
+        }
+    }
+};
+
+// Identity of group of streams, shared by all their STRIPE packets.
+struct Group {
+    session_t _id;
+    uint32_t _cnt;
+    stripe_layout_t _layout;
+    uint32_t _chunk;
+    b_cnt_t _total;
+
+    explicit Group(const Packet<STRIPE> &hello)
+        : _id(hello._group_id), _cnt(hello._stream_cnt),
+          _layout(hello._layout), _chunk(hello._chunk_size),
+          _total(hello._total_len) {}
+
+    // Checks whether hello belongs to group and is consistent with it.
+    bool contains(const Packet<STRIPE> &hello) const {
+        return hello._group_id == _id && hello._stream_cnt == _cnt &&
+               hello._layout == _layout && hello._chunk_size == _chunk &&
+               hello._total_len == _total && hello._stream_idx < _cnt &&
+               hello._data_len == StripeMap(hello).length();
+    }
+};
+} // namespace STRIPING
+
+#endif /* STRIPE_HPP */
@@ -0,0 +1,198 @@
+#ifndef TIMER_HPP
+#define TIMER_HPP
+
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Timers of many sessions served by one event loop.
+namespace TIMER {
+using clock = std::chrono::steady_clock;
+
+using timer_id_t = uint32_t;
+constexpr timer_id_t NO_TIMER = UINT32_MAX;
+
+// Hierarchical timer wheel: LEVELS wheels of SLOTS slots, slot of level l
+// spans SLOTS^l ticks. Timer is kept on level on which its expiry and
+// current tick first share block, and moved to lower levels when current
+// tick reaches its slot. Arming, cancelling and expiring timer is O(1),
+// next expiry is found from per-level bitmaps of occupied slots.
+template <class T> class TimerWheel {
+  private:
+    static constexpr int BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << BITS;
+    static constexpr int LEVELS = 4;
+    static constexpr auto TICK = std::chrono::milliseconds(1);
+
+    struct Node {
+        T _value;
+        uint64_t _expiry;
+        timer_id_t _prev;
+        timer_id_t _next;
+        uint16_t _slot;
+    };
+
+    clock::time_point _epoch{clock::now()};
+    uint64_t _now{0};
+    std::vector<std::optional<Node>> _nodes;
+    std::vector<timer_id_t> _free;
+    // Heads of lists of timers in each slot, slot index is level * SLOTS + i.
+    std::vector<timer_id_t> _heads =
+        std::vector<timer_id_t>(LEVELS * SLOTS, NO_TIMER);
+    uint64_t _occupied[LEVELS] = {};
+
+    static uint64_t block(uint64_t tick, int level) {
+        return tick >> (BITS * level);
+    }
+
+    uint64_t to_tick(clock::time_point when) const {
+        if (when <= _epoch) {
+            return 0;
+        }
+        // Rounded up, so that timer never expires early.
+        return (uint64_t)((when - _epoch + TICK - clock::duration(1)) / TICK);
+    }
+
+    void link(timer_id_t id) {
+        Node &node = *_nodes[id];
+        uint64_t expiry = std::max(node._expiry, _now);
+        int level = 0;
+        while (level < LEVELS - 1 &&
+               block(expiry, level + 1) != block(_now, level + 1)) {
+            level++;
+        }
+        uint64_t idx = block(expiry, level) & (SLOTS - 1);
+        node._slot = (uint16_t)(level * SLOTS + idx);
+        node._prev = NO_TIMER;
+        node._next = _heads[node._slot];
+        if (node._next != NO_TIMER) {
+            _nodes[node._next]->_prev = id;
+        }
+        _heads[node._slot] = id;
+        _occupied[level] |= uint64_t(1) << idx;
+    }
+
+    void unlink(timer_id_t id) {
+        Node &node = *_nodes[id];
+        if (node._prev != NO_TIMER) {
+            _nodes[node._prev]->_next = node._next;
+        } else {
+            _heads[node._slot] = node._next;
+        }
+        if (node._next != NO_TIMER) {
+            _nodes[node._next]->_prev = node._prev;
+        }
+        if (_heads[node._slot] == NO_TIMER) {
+            _occupied[node._slot / SLOTS] &= ~(uint64_t(1) << (node._slot % SLOTS));
+        }
+    }
+
+    // Takes all timers out of slot.
+    std::vector<timer_id_t> take(int level, uint64_t idx) {
+        std::vector<timer_id_t> ids;
+        timer_id_t id = _heads[level * SLOTS + idx];
+        while (id != NO_TIMER) {
+            ids.push_back(id);
+            id = _nodes[id]->_next;
+        }
+        _heads[level * SLOTS + idx] = NO_TIMER;
+        _occupied[level] &= ~(uint64_t(1) << idx);
+        return ids;
+    }
+
+    // First tick at which some slot has to be cascaded or expired.
+    std::optional<uint64_t> next_event() const {
+        uint64_t current = _now & (SLOTS - 1);
+        uint64_t later = _occupied[0] & (~uint64_t(0) << current);
+        if (later) {
+            return (_now & ~(SLOTS - 1)) | (uint64_t)std::countr_zero(later);
+        }
+        for (int level = 1; level < LEVELS; level++) {
+            current = block(_now, level) & (SLOTS - 1);
+            uint64_t base = block(_now, level + 1) << (BITS * (level + 1));
+            later = current + 1 < SLOTS
+                        ? _occupied[level] & (~uint64_t(0) << (current + 1))
+                        : 0;
+            if (later) {
+                return base | ((uint64_t)std::countr_zero(later)
+                               << (BITS * level));
+            }
+            // Top level keeps also timers beyond its range, they are
+            // cascaded again when wheel turns around.
+            if (level == LEVELS - 1 && _occupied[level]) {
+                return base + (uint64_t(1) << (BITS * (level + 1))) +
+                       ((uint64_t)std::countr_zero(_occupied[level])
+                        << (BITS * level));
+            }
+        }
+        return std::nullopt;
+    }
+
+  public:
+    timer_id_t arm(clock::time_point when, T value) {
+        timer_id_t id;
+        if (_free.empty()) {
+            id = (timer_id_t)_nodes.size();
+            _nodes.emplace_back();
+        } else {
+            id = _free.back();
+            _free.pop_back();
+        }
+        _nodes[id].emplace(Node{std::move(value), to_tick(when), NO_TIMER,
+                                NO_TIMER, 0});
+        link(id);
+        return id;
+    }
+
+    void cancel(timer_id_t id) {
+        if (id == NO_TIMER || !_nodes[id]) {
+            return;
+        }
+        unlink(id);
+        _nodes[id].reset();
+        _free.push_back(id);
+    }
+
+    // Time of next expiry or cascade of timers, no timer expires before it.
+    std::optional<clock::time_point> next_expiry() const {
+        auto tick = next_event();
+        if (!tick) {
+            return std::nullopt;
+        }
+        return _epoch + *tick * TICK;
+    }
+
+    // Calls handler with value of every timer expired until now. Ids of
+    // expired timers are released before handler is called.
+    template <class F> void expire(clock::time_point now, F handler) {
+        uint64_t target = to_tick(now);
+        if (now < _epoch + target * TICK) {
+            target--;
+        }
+        std::optional<uint64_t> tick;
+        while ((tick = next_event()) && *tick <= target) {
+            _now = *tick;
+            for (int level = LEVELS - 1; level > 0; level--) {
+                if (_now % (uint64_t(1) << (BITS * level)) == 0) {
+                    for (timer_id_t id :
+                         take(level, block(_now, level) & (SLOTS - 1))) {
+                        link(id);
+                    }
+                }
+            }
+            for (timer_id_t id : take(0, _now & (SLOTS - 1))) {
+                T value = std::move(_nodes[id]->_value);
+                _nodes[id].reset();
+                _free.push_back(id);
+                handler(value);
+            }
+        }
+        _now = std::max(_now, target);
+    }
+};
+} // namespace TIMER
+
+#endif /* TIMER_HPP */
@@ -0,0 +1,206 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// Binary trace of protocol events, always on. Every thread appends fixed
+// size records to its own ring (single writer, no locks), rings are
+// written to file on demand (dump) or when process crashes. Reader of
+// dump that runs concurrently with writers may see torn last records.
+// File (host byte order): MAGIC, then for every ring its number, record
+// count and records from oldest.
+namespace TRACE {
+constexpr char MAGIC[8] = {'P', 'P', 'C', 'B', 'T', 'R', 'C', '1'};
+constexpr size_t RING_SIZE = 1 << 14;
+constexpr size_t MAX_THREADS = 64;
+
+enum event_t : uint16_t {
+    SENT = 1,
+    RECEIVED = 2,
+    RETRANSMITTED = 3,
+    SKIPPED = 4,
+    TIMEOUT = 5,
+    LOSS = 6,
+    SESSION_BEGIN = 7,
+    SESSION_END = 8,
+};
+
+const char *event_name(uint16_t event) {
+    switch (event) {
+    case SENT:
+        return "SENT";
+    case RECEIVED:
+        return "RECEIVED";
+    case RETRANSMITTED:
+        return "RETRANSMITTED";
+    case SKIPPED:
+        return "SKIPPED";
+    case TIMEOUT:
+        return "TIMEOUT";
+    case LOSS:
+        return "LOSS";
+    case SESSION_BEGIN:
+        return "SESSION_BEGIN";
+    case SESSION_END:
+        return "SESSION_END";
+    }
+    return "UNKNOWN";
+}
+
+struct Record {
+    // CLOCK_MONOTONIC nanoseconds.
+    uint64_t _time;
+    uint64_t _session;
+    uint64_t _number;
+    uint16_t _event;
+    // Packet type (packet_type_t), 0 if event isn't about packet.
+    uint8_t _packet;
+    uint8_t _pad[5];
+};
+static_assert(sizeof(Record) == 32);
+
+struct Ring {
+    std::atomic<uint64_t> _head{0};
+    // Cleared when thread writing to ring exits.
+    std::atomic<bool> _owned{true};
+    Record _records[RING_SIZE];
+};
+
+// Rings are never freed, so that records of finished threads are dumped
+// too, ring of finished thread is taken over by next new thread. Threads
+// running at once above MAX_THREADS aren't traced.
+std::atomic<Ring *> rings[MAX_THREADS];
+std::atomic<uint32_t> ring_cnt{0};
+char dump_path[256] = "ppcb.trace";
+
+Ring *acquire_ring() {
+    uint32_t cnt = std::min<uint32_t>(ring_cnt.load(), MAX_THREADS);
+    for (uint32_t i = 0; i < cnt; i++) {
+        Ring *ring = rings[i];
+        bool owned = false;
+        if (ring && ring->_owned.compare_exchange_strong(owned, true)) {
+            return ring;
+        }
+    }
+
+    uint32_t idx = ring_cnt.load();
+    while (idx < MAX_THREADS &&
+           !ring_cnt.compare_exchange_weak(idx, idx + 1)) {
+    }
+    if (idx >= MAX_THREADS) {
+        return nullptr;
+    }
+    Ring *created = new Ring();
+    rings[idx] = created;
+    return created;
+}
+
+// Ring of thread, given back when thread exits.
+class Owner {
+  private:
+    Ring *_ring;
+
+  public:
+    Owner() : _ring(acquire_ring()) {}
+
+    Owner(const Owner &) = delete;
+    Owner &operator=(const Owner &) = delete;
+
+    ~Owner() {
+        if (_ring) {
+            _ring->_owned.store(false);
+        }
+    }
+
+    Ring *ring() const { return _ring; }
+};
+
+Ring *own_ring() {
+    static thread_local Owner owner;
+    return owner.ring();
+}
+
+void record(event_t event, uint8_t packet, uint64_t session,
+            uint64_t number = 0) {
+    Ring *ring = own_ring();
+    if (!ring) {
+        return;
+    }
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t head = ring->_head.load(std::memory_order_relaxed);
+    Record &slot = ring->_records[head & (RING_SIZE - 1)];
+    slot._time = (uint64_t)now.tv_sec * 1'000'000'000 + (uint64_t)now.tv_nsec;
+    slot._session = session;
+    slot._number = number;
+    slot._event = event;
+    slot._packet = packet;
+    ring->_head.store(head + 1, std::memory_order_release);
+}
+
+// Writes all rings to path. Only async-signal-safe calls are used, so that
+// it can run in signal handler.
+bool dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    auto write_all = [fd](const void *data, size_t len) {
+        const char *ptr = (const char *)data;
+        while (len > 0) {
+            ssize_t ret = write(fd, ptr, len);
+            if (ret <= 0) {
+                return false;
+            }
+            ptr += ret;
+            len -= ret;
+        }
+        return true;
+    };
+
+    bool ok = write_all(MAGIC, sizeof(MAGIC));
+    uint32_t cnt = std::min<uint32_t>(ring_cnt.load(), MAX_THREADS);
+    for (uint32_t i = 0; i < cnt && ok; i++) {
+        Ring *ring = rings[i];
+        uint64_t head = ring ? ring->_head.load(std::memory_order_acquire) : 0;
+        uint32_t records = (uint32_t)std::min<uint64_t>(head, RING_SIZE);
+        ok = write_all(&i, sizeof(i)) && write_all(&records, sizeof(records));
+        if (ring && ok) {
+            // Records from oldest are at most two runs of ring.
+            uint64_t first = (head - records) & (RING_SIZE - 1);
+            uint64_t run = std::min<uint64_t>(records, RING_SIZE - first);
+            ok = write_all(ring->_records + first, run * sizeof(Record)) &&
+                 write_all(ring->_records, (records - run) * sizeof(Record));
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+bool dump() { return dump(dump_path); }
+
+void crash_handler(int sig) {
+    dump();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Sets dump file to <name>.<pid>.trace and dumps trace on fatal signals.
+void init(const char *name) {
+    snprintf(dump_path, sizeof(dump_path), "%s.%d.trace", name, (int)getpid());
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+        signal(sig, crash_handler);
+    }
+}
+} // namespace TRACE
+
+#endif /* TRACE_HPP */
@@ -0,0 +1,82 @@
+#include "common.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Decoder of trace dumps: merges records of all threads by time and prints
+// them as timeline, relative to the first record.
+
+using namespace PPCB;
+
+struct Event {
+    uint32_t _thread;
+    TRACE::Record _record;
+};
+
+std::vector<Event> read_trace(const char *path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(std::string("Couldn't open: ") + path);
+    }
+    char magic[sizeof(TRACE::MAGIC)];
+    if (!file.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, TRACE::MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error(std::string("Not a trace file: ") + path);
+    }
+
+    std::vector<Event> events;
+    uint32_t header[2];
+    while (file.read((char *)header, sizeof(header))) {
+        if (header[1] > TRACE::RING_SIZE) {
+            throw std::runtime_error("Corrupted ring of thread " +
+                                     std::to_string(header[0]));
+        }
+        std::vector<TRACE::Record> records(header[1]);
+        if (!file.read((char *)records.data(),
+                       (std::streamsize)(records.size() *
+                                         sizeof(TRACE::Record)))) {
+            throw std::runtime_error("Truncated ring of thread " +
+                                     std::to_string(header[0]));
+        }
+        for (auto &record : records) {
+            events.push_back({header[0], record});
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const Event &a, const Event &b) {
+                         return a._record._time < b._record._time;
+                     });
+    return events;
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        if (argc != 2) {
+            throw std::runtime_error("Usage: <trace file>");
+        }
+        std::vector<Event> events = read_trace(argv[1]);
+        uint64_t first = events.empty() ? 0 : events.front()._record._time;
+        for (auto &event : events) {
+            auto &record = event._record;
+            char time[32];
+            snprintf(time, sizeof(time), "+%.6f",
+                     (double)(record._time - first) / 1e6);
+            std::cout << time << "ms T" << event._thread << " "
+                      << TRACE::event_name(record._event);
+            if (record._packet) {
+                std::cout << " "
+                          << packet_to_string((packet_type_t)record._packet);
+            }
+            std::cout << " session=" << record._session
+                      << " nr=" << record._number << "\n";
+        }
+    } catch (std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}